@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef DESCRIPTOR_PAYLOAD_H_
+#define DESCRIPTOR_PAYLOAD_H_
+
+#include <cstddef>
+#include <string>
+
+#include "sifter.h"
+
+
+/*
+ * SIFT descriptors a client extracted itself, for /match/descriptors.  the
+ * payload is a 32 byte little-endian header followed by the rows:
+ *
+ *   0   "SFTD"
+ *   4   u8   version, 1
+ *   5   u8   row type: 1 for float32, 2 for uint8
+ *   6   u16  row length, 128
+ *   8   i32  numFeatures
+ *   12  i32  octaves
+ *   16  f32  contrastThreshold
+ *   20  f32  edgeThreshold
+ *   24  f32  sigma
+ *   28  u32  rows
+ *   32  rows * 128 values
+ *
+ * the parameters are the ones the client's SIFT extractor was built with.
+ * rows should be ordered strongest keypoint response first, since the
+ * initial scan only uses as many as our coarse extractor would have found
+ */
+namespace descriptor_payload {
+    const size_t HEADER_SIZE = 32;
+    const int ROW_LENGTH = 128;
+
+    enum RowType {
+        FLOAT32 = 1,
+        UINT8 = 2
+    };
+
+    struct Payload {
+        SiftParams params;
+        Mat descriptors;
+    };
+
+    bool parse(const unsigned char *data, size_t size, Payload &payload,
+        std::string &error);
+    bool compatible(const SiftParams &params, const SiftParams &coarse,
+        const SiftParams &refine, std::string &error);
+}
+
+
+#endif /* DESCRIPTOR_PAYLOAD_H_ */
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef DESIGN_STORE_H_
+#define DESIGN_STORE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/filesystem.hpp>
+#include <boost/utility/string_ref.hpp>
+
+
+/*
+ * the metadata we show for a design.  the strings point straight into the
+ * DesignStore they came from, so they're only good while it's open
+ */
+struct DesignInfo {
+    int id = -1;
+    boost::string_ref artistName;
+    boost::string_ref artistUrl;
+    boost::string_ref dateAdded;
+    boost::string_ref title;
+};
+
+
+/*
+ * a read-only, memory-mapped table of design metadata.  the file is built
+ * once from prod_mapping.yaml, and is laid out so that lookups are a single
+ * array index with no allocation or copying, which also makes it safe to read
+ * from any number of threads:
+ *
+ *   header
+ *   uint32 index[maxId + 1]     record number for each design id, or NO_RECORD
+ *   Record records[numRecords]  fixed size, strings are (offset, length) pairs
+ *   char strings[stringsSize]   every string, deduplicated
+ */
+class DesignStore {
+public:
+    typedef boost::filesystem::path path;
+
+    DesignStore() = default;
+    DesignStore(const DesignStore &) = delete;
+    DesignStore &operator=(const DesignStore &) = delete;
+    ~DesignStore();
+
+    static bool build(const path &yamlFile, const path &storeFile);
+
+    bool open(const path &storeFile);
+    void close();
+    bool lookup(int id, DesignInfo &info) const;
+    size_t size() const;
+
+private:
+    struct Header;
+    struct Record;
+
+    boost::string_ref string(uint32_t offset, uint32_t length) const;
+
+    void *mapping = nullptr;
+    size_t mappingSize = 0;
+    const Header *header = nullptr;
+    const uint32_t *index = nullptr;
+    const Record *records = nullptr;
+    const char *strings = nullptr;
+};
+
+
+#endif /* DESIGN_STORE_H_ */
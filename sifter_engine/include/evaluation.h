@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef EVALUATION_H_
+#define EVALUATION_H_
+
+#include <string>
+#include <vector>
+
+#include "sifter.h"
+
+
+/*
+ * a summary of a set of measurements: how many, and where they fall
+ */
+struct Distribution {
+    size_t count = 0;
+    double mean = 0;
+    double stddev = 0;
+    double min = 0;
+    double p10 = 0;
+    double p50 = 0;
+    double p90 = 0;
+    double p99 = 0;
+    double max = 0;
+
+    static Distribution of(std::vector<double> values);
+    std::string json() const;
+};
+
+/*
+ * how a single test image went.  correctId is the design it's of, from its
+ * filename, and shortlistRank is where that design came in the initial
+ * scan's shortlist (0 for first), or -1 if it didn't make it
+ */
+struct QueryOutcome {
+    int correctId = -1;
+    PotentialMatch guess;
+    SearchContext context;
+    double elapsed = 0;
+    int shortlistRank = -1;
+
+    bool correct() const;
+};
+
+/*
+ * everything an evaluation run over the test images measured, so that a
+ * change can be judged on speed and accuracy together
+ */
+struct Evaluation {
+    std::vector<QueryOutcome> outcomes;
+    int parallelism = 1;
+    double wallTime = 0;
+    long maxRss = 0;
+
+    double accuracy() const;
+    double recall(int k) const;
+    Distribution latency() const;
+    std::string json(const std::vector<int> &recallAt) const;
+};
+
+
+Evaluation evaluate(const path &testImagesDir,
+    const std::vector<Mat> &descriptors, int numBestMatches,
+    float distanceRatioThreshold, SIFT &sifter, SIFT &refineSifter,
+    int targetLongEdge, bool multithreaded, int limit, int parallelism);
+
+
+#endif /* EVALUATION_H_ */
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef EVENT_SERVER_H_
+#define EVENT_SERVER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "http.h"
+
+
+class Server;
+
+
+/*
+ * our own HTTP front end.  a single thread owns every connection and does
+ * all of their I/O, non-blocking, through epoll: accepting, reading heads
+ * and bodies however slowly they trickle in, and writing responses out as
+ * the socket takes them.  connections are kept alive between requests, and
+ * pipelined requests are answered in order.
+ *
+ * only once a request is in in full is it handled.  matches go to a pool of
+ * handler threads, since they may wait on the scheduler; everything else is
+ * cheap enough to answer on the event thread.  a slow client costs us a
+ * socket and a buffer, but never a thread.  bodies grow as their bytes
+ * arrive, rather than being allocated at the length their head claims, and
+ * what all connections together have buffered is capped.
+ *
+ * a connection can also be upgraded to a WebSocket for a streaming match
+ * session.  frames are matched on the handler threads too, one at a time
+ * per session, and if frames come in faster than we can match them, only
+ * the latest waiting one is kept
+ */
+class EventServer {
+public:
+    EventServer(Server *server, int maxConnections, double idleTimeout,
+        size_t maxBufferedBytes, int numHandlers);
+    ~EventServer();
+
+    bool start(int port);
+    void stop();
+
+    /*
+     * a piece of a response.  either we own the bytes, or they live
+     * somewhere that outlives the response and we send them from there
+     */
+    struct Chunk {
+        std::string owned;
+        const char *borrowed = nullptr;
+        size_t size = 0;
+
+        const char *data() const {
+            return borrowed ? borrowed : owned.data();
+        }
+    };
+
+    /*
+     * response chunks from a handler thread, for the event thread to send.
+     * done means the response is complete
+     */
+    struct Completion {
+        uint64_t id;
+        std::vector<Chunk> chunks;
+        bool done;
+        bool close;
+    };
+
+    void post(Completion &&completion);
+
+private:
+    enum class State {READING_HEAD, READING_BODY, HANDLING, WEBSOCKET,
+        CLOSING};
+
+    struct Session;
+
+    struct Connection {
+        int fd;
+        uint64_t id;
+        State state = State::READING_HEAD;
+        uint32_t events = 0;
+        double lastActivity = 0;
+        bool keepAlive = true;
+
+        std::string input;
+        std::shared_ptr<HttpRequest> request;
+        size_t bodyLength = 0;
+        size_t bodyBuffered = 0;
+
+        std::deque<Chunk> output;
+        size_t outputOffset = 0;
+        size_t outputBytes = 0;
+
+        std::shared_ptr<Session> session;
+        std::string message;
+    };
+
+    void loop();
+    void acceptConnections();
+    void readFrom(Connection &conn);
+    void processInput(Connection &conn);
+    bool appendBody(Connection &conn, const char *data, size_t size);
+    void rejectBody(Connection &conn);
+    void releaseBody(Connection &conn);
+    void dispatch(Connection &conn);
+    void upgrade(Connection &conn);
+    void processFrames(Connection &conn);
+    void closeWebSocket(Connection &conn, int status);
+    void submitFrame(Connection &conn, std::string &frame);
+    void runSession(uint64_t id, std::shared_ptr<Session> session);
+    void finishResponse(Connection &conn);
+    void queueOutput(Connection &conn, std::vector<Chunk> &chunks);
+    void writeTo(Connection &conn);
+    void updateInterest(Connection &conn);
+    void closeConnection(uint64_t id);
+    void drainCompletions();
+    void sweepIdle();
+    void handlerLoop();
+
+    Server *server;
+    int maxConnections;
+    double idleTimeout;
+    size_t maxBufferedBytes;
+    int numHandlers;
+
+    int listenFd = -1;
+    int epollFd = -1;
+    int wakeFd = -1;
+    std::atomic_bool stopping;
+
+    std::thread eventThread;
+    std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections;
+    uint64_t nextId;
+
+    /*
+     * request body bytes held by connections still reading them
+     */
+    size_t bufferedBodyBytes = 0;
+
+    std::vector<std::thread> handlers;
+    std::mutex jobLock;
+    std::condition_variable jobReady;
+    std::deque<std::function<void()>> jobs;
+
+    std::mutex completionLock;
+    std::vector<Completion> completions;
+};
+
+
+#endif /* EVENT_SERVER_H_ */
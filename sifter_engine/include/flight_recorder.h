@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FLIGHT_RECORDER_H_
+#define FLIGHT_RECORDER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "sifter.h"
+
+
+/*
+ * how busy we were when a request arrived
+ */
+struct LoadSnapshot {
+    int queued = 0;
+    int running = 0;
+    int inFlight = 0;
+};
+
+/*
+ * everything we kept about a slow request: what was uploaded (an image or
+ * a descriptor payload), how long each stage took, what the initial scan
+ * shortlisted, and how busy we were
+ */
+struct FlightRecord {
+    uint64_t id = 0;
+    std::string kind;
+    std::vector<unsigned char> upload;
+
+    double arrival = 0;
+    double latency = 0;
+    double threshold = 0;
+    double budget = 0;
+    double receiveTime = 0;
+
+    SearchContext context;
+    LoadSnapshot load;
+    std::string thread;
+
+    int matchId = -1;
+    float confidence = 0;
+    bool cached = false;
+
+    std::string json() const;
+};
+
+
+/*
+ * keeps the most recent requests that took longer than a percentile of
+ * recent latencies, so there's something to look at after a latency
+ * spike.  fast requests cost a latency sample and a comparison, and
+ * nothing about them is copied.  records can be dumped to a directory,
+ * and replayed from there with --replay
+ */
+class FlightRecorder {
+public:
+    FlightRecorder(size_t capacity, double percentile, const path &dumpDir,
+        const std::string &params);
+
+    bool isSlow(double latency, double &slowerThan);
+    void keep(FlightRecord &&record);
+
+    size_t dump(std::string &error);
+    std::string listJson();
+    const path &getDumpDir() const;
+
+private:
+    size_t capacity;
+    double percentile;
+    path dumpDir;
+    std::string params;
+
+    std::mutex samplesLock;
+    std::vector<double> samples;
+    uint64_t numSamples = 0;
+    std::atomic<double> threshold{0};
+
+    std::mutex recordsLock;
+    std::deque<FlightRecord> records;
+    uint64_t nextId = 1;
+};
+
+
+void replayFlights(const path &dumpDir, const std::vector<Mat> &descriptors,
+    int numBestMatches, float distanceRatioThreshold, SIFT &sifter,
+    SIFT &refineSifter, const SiftParams &coarseParams, int targetLongEdge,
+    const std::string &params, bool multithreaded);
+
+
+#endif /* FLIGHT_RECORDER_H_ */
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef GENERATE_H_
+#define GENERATE_H_
+
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "sifter.h"
+
+
+/*
+ * records what every descriptor file in a descriptor directory was generated
+ * from: the content hash of its source image (plus size and mtime, so we
+ * don't have to rehash untouched images) and the SIFT parameters used.  this
+ * is what lets --generate only redo the images that actually need it
+ */
+class DescriptorManifest {
+public:
+    struct Entry {
+        uint64_t hash = 0;
+        uintmax_t size = 0;
+        std::time_t mtime = 0;
+    };
+
+    static std::string formatEntry(const std::string &name,
+        const Entry &entry);
+    static bool parseEntry(const std::string &line, std::string &name,
+        Entry &entry);
+
+    bool load(const path &fileName);
+    void save(const path &fileName) const;
+
+    std::string params;
+    std::map<std::string, Entry> entries;
+};
+
+
+/*
+ * how a distributed generation job is laid out.  workerCommand is only used
+ * by the coordinator, to launch localWorkers worker processes on this host
+ */
+struct SpoolOptions {
+    path spoolDir;
+    size_t unitSize;
+    double leaseSeconds;
+    int localWorkers;
+    std::vector<std::string> workerCommand;
+};
+
+
+path descriptorDirectory(const path &base, int maxTrainDescriptors,
+    float sigma);
+
+void generateDescriptors(const path &imageDir, const path &outputDir,
+    const SiftParams &params, bool multithreaded);
+
+void coordinateGeneration(const path &imageDir, const path &outputDir,
+    const SiftParams &params, const SpoolOptions &spool, bool multithreaded);
+
+bool runGenerationWorker(const path &imageDir, const path &outputDir,
+    const SiftParams &params, const SpoolOptions &spool, bool multithreaded);
+
+
+#endif /* GENERATE_H_ */
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+
+namespace hashing {
+    const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+    const uint64_t FNV_PRIME = 1099511628211ULL;
+
+    /*
+     * 64-bit FNV-1a.  it's not cryptographic, but it's fast, dependency-free,
+     * and plenty for telling whether a file's contents have changed
+     */
+    inline uint64_t fnv1a(const void *data, size_t length,
+            uint64_t hash=FNV_OFFSET) {
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i=0; i<length; i++) {
+            hash ^= bytes[i];
+            hash *= FNV_PRIME;
+        }
+        return hash;
+    }
+
+    inline uint64_t hashFile(const std::string &fileName) {
+        std::ifstream handle(fileName, std::ifstream::binary);
+        char buffer[64 * 1024];
+        uint64_t hash = FNV_OFFSET;
+
+        while (handle) {
+            handle.read(buffer, sizeof(buffer));
+            hash = fnv1a(buffer, handle.gcount(), hash);
+        }
+        return hash;
+    }
+
+    inline std::string hex(uint64_t hash) {
+        char buffer[17];
+        snprintf(buffer, sizeof(buffer), "%016llx", (unsigned long long)hash);
+        return buffer;
+    }
+}
+
+
+#endif /* HASH_H_ */
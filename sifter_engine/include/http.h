@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef HTTP_H_
+#define HTTP_H_
+
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+
+/*
+ * a request, as our handlers see it, whichever front end it came in
+ * through.  the body has been read in full by the time a handler gets it
+ */
+struct HttpRequest {
+    std::string method;
+    std::string uri;
+    std::string queryString;
+    std::string version;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::vector<unsigned char> body;
+
+    /*
+     * when the request's head arrived, and when the rest of it finished
+     * arriving, as logging::timestamp()s
+     */
+    double headArrival = 0;
+    double arrival = 0;
+
+    const char *header(const std::string &name) const;
+    bool keepAlive() const;
+};
+
+
+/*
+ * where a handler writes its response to.  each front end has its own: one
+ * writes straight to the socket, another queues the bytes for its event loop
+ * to send when the socket can take them
+ */
+class Responder {
+public:
+    virtual ~Responder() {}
+
+    virtual void write(const void *data, size_t size) = 0;
+
+    /*
+     * for data that will outlive the response, like our cached thumbnails,
+     * which a front end may send from where it is instead of copying it
+     */
+    virtual void writeStatic(const void *data, size_t size) {
+        write(data, size);
+    }
+
+    /*
+     * sends what's been written so far, if the front end holds it back until
+     * the handler is done
+     */
+    virtual void flush() {
+    }
+
+    void write(const std::string &data) {
+        write(data.data(), data.size());
+    }
+};
+
+
+/*
+ * writes a response body with chunked transfer encoding, sending each piece
+ * as soon as it's written, for responses that go out as they're worked out
+ * rather than all at once at the end
+ */
+class ChunkedWriter {
+public:
+    ChunkedWriter(Responder &out);
+
+    void write(const std::string &data);
+    void finish();
+
+private:
+    Responder &out;
+};
+
+
+enum class ParseResult {COMPLETE, INCOMPLETE, MALFORMED};
+
+ParseResult parseRequestHead(const char *data, size_t size,
+    HttpRequest &request, size_t &headLength);
+
+bool queryParameter(const std::string &query, const std::string &name,
+    std::string &value);
+
+std::string urlDecode(const std::string &encoded, bool form=false);
+
+std::string jsonString(const std::string &str);
+
+
+#endif /* HTTP_H_ */
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include <opencv2/opencv.hpp>
+
+
+/*
+ * what we're willing to decode, and how big we want the result to be.  SIFT
+ * only needs a few hundred features, so decoding a phone camera's full
+ * resolution and building a scale space over it is wasted work
+ */
+struct DecodeLimits {
+    size_t maxBytes;
+    long long maxPixels;
+    int targetLongEdge;
+};
+
+
+cv::Mat decodeGrayscale(const unsigned char *data, size_t size,
+    int targetLongEdge=0);
+
+bool imageDimensions(const unsigned char *data, size_t size, int &width,
+    int &height);
+
+bool jpegDimensions(const unsigned char *data, size_t size, int &width,
+    int &height);
+
+uint64_t perceptualHash(const cv::Mat &gray);
+int hammingDistance(uint64_t a, uint64_t b);
+
+
+#endif /* IMAGE_H_ */
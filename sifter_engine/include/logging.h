@@ -25,36 +25,56 @@
 
 #include <iostream>
 #include <iomanip>
+#include <atomic>
 
 #include <sys/time.h>
+#include <unistd.h>
 #include <cstddef>
+#include <cstdio>
 
 
+/*
+ * logging that stays off the hot path.  a log line's message is rendered on
+ * the calling thread, into a fixed buffer that thread reuses, and handed to
+ * a background thread through a lock-free queue of the caller's own.  the
+ * background thread does the rest: the line prefix, ordering lines from
+ * different threads, and writing and flushing stdout, or wherever setOutput
+ * says.  lines at a priority we aren't logging cost one relaxed load, and
+ * their message isn't rendered at all.
+ *
+ * if a thread logs faster than we can write, its dlog lines are dropped
+ * (and counted) rather than holding it up.  alog lines wait for room
+ */
 namespace logging {
-	extern double lastLog;
 	enum priority {HIGH, MEDIUM, LOW};
-	extern priority currentPriority;
+	enum format {TEXT, KEY_VALUE};
+
+	extern std::atomic<int> currentPriority;
 
 	inline double timestamp() {
 		timeval tv;
 		gettimeofday(&tv, NULL);
 		return tv.tv_sec + (tv.tv_usec / 1000000.0);
 	}
+
+	inline bool enabled(priority p) {
+		return p <= currentPriority.load(std::memory_order_relaxed);
+	}
+
+	void setPriority(priority p);
+	void setFormat(format f);
+	void setOutput(FILE *out);
+
+	std::ostream &messageBuffer();
+	void submit(priority p, const char *file, int line, bool always);
 }
 
 #ifdef LOGGING
 #define dlog(msg, p)\
 do {\
-	if (p <= logging::currentPriority) {\
-		double ts = logging::timestamp();\
-		std::cout << "(" << getpid() << ") "\
-			<< std::fixed << std::setprecision(6) << ts \
-			<< " "	<< (logging::lastLog == 0 ? 0 : ts - logging::lastLog)\
-			<< " " << __FILE__ << " line " << __LINE__\
-			<< ": ";\
-		std::cout << msg << std::endl;\
-		std::flush(std::cout);\
-		logging::lastLog = ts;\
+	if (logging::enabled(p)) {\
+		logging::messageBuffer() << msg;\
+		logging::submit(p, __FILE__, __LINE__, false);\
 	}\
 } while(0)
 #else
@@ -66,15 +86,12 @@ do {\
 // alog = always log
 #define alog(msg, p)\
 do {\
-	if (p <= logging::currentPriority) {\
-		double ts = logging::timestamp();\
-		std::cout << "(" << getpid() << ") " << std::fixed << std::setprecision(6)\
-			<< ts << " "	<< (logging::lastLog == 0 ? 0 : ts - logging::lastLog) << ": ";\
-		std::cout << msg << std::endl;\
-		std::flush(std::cout);\
-		logging::lastLog = ts;\
+	if (logging::enabled(p)) {\
+		logging::messageBuffer() << msg;\
+		logging::submit(p, nullptr, 0, true);\
 	}\
 } while(0)
 
 
+
 #endif /* LOGGING_HPP_ */
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MATCH_SESSION_H_
+#define MATCH_SESSION_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "sifter.h"
+
+
+class Server;
+
+
+/*
+ * a client streaming camera frames at us over one connection, rather than
+ * posting single stills.  consecutive frames almost always show the same
+ * design, so we remember the shortlist from the last full search and first
+ * just check a new frame against that, which is a handful of comparisons
+ * instead of a pass over every design.  only when that isn't confident do
+ * we search everything again.  a frame that looks the same as the last one
+ * (the camera is being held still) gets the last result straight back.
+ *
+ * a session handles one frame at a time, and isn't thread safe
+ */
+class MatchSession {
+public:
+    MatchSession(Server *server, ThumbnailMode thumbnailMode);
+
+    std::string processFrame(const unsigned char *data, size_t size);
+
+private:
+    std::string error(const std::string &msg, double retryAfter=0) const;
+
+    Server *server;
+    ThumbnailMode thumbnailMode;
+
+    int frames = 0;
+    std::vector<PotentialMatch> shortlist;
+    uint64_t lastFrameHash = 0;
+    bool haveLast = false;
+    MatchInfo lastResult;
+};
+
+
+#endif /* MATCH_SESSION_H_ */
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+/*
+ * counters and histograms for /metrics, in the Prometheus text format.
+ * they're updated from every request, on whatever thread it's on, so
+ * updates are a few relaxed atomic adds and never take a lock.  a scrape
+ * can see a histogram halfway through an update, which Prometheus
+ * tolerates
+ */
+namespace metrics {
+
+    class Counter {
+    public:
+        void add(uint64_t n=1);
+        uint64_t value() const;
+
+    private:
+        std::atomic<uint64_t> count{0};
+    };
+
+    /*
+     * a histogram over fixed bucket bounds, which must be ascending
+     */
+    class Histogram {
+    public:
+        Histogram(const std::vector<double> &bounds);
+
+        void observe(double value);
+        void render(std::ostream &out, const std::string &name,
+            const std::string &labels="") const;
+
+    private:
+        std::vector<double> bounds;
+
+        /*
+         * one more than there are bounds, for +Inf
+         */
+        std::unique_ptr<std::atomic<uint64_t>[]> counts;
+        std::atomic<double> sum{0};
+    };
+
+
+    /*
+     * the stages a match goes through, in order
+     */
+    enum Stage {
+        RECEIVE,
+        DECODE,
+        COARSE_EXTRACT,
+        COARSE_SEARCH,
+        REFINE_EXTRACT,
+        REFINE_MATCH,
+        RESPONSE,
+        TOTAL,
+        NUM_STAGES
+    };
+
+    void observeStage(Stage stage, double seconds);
+    void observeScanned(int designs);
+    void addBytesOut(uint64_t bytes);
+
+    void render(std::ostream &out);
+}
+
+
+#endif /* METRICS_H_ */
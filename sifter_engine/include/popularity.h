@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef POPULARITY_H_
+#define POPULARITY_H_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+
+typedef std::shared_ptr<const std::vector<int>> SearchOrder;
+
+
+/*
+ * counts how often each design is matched in production, and from that
+ * decides the order searches should scan designs in: most popular first,
+ * then newest first.  a search that runs out of time has then most likely
+ * already looked at the design it was after.  the order is rebuilt every so
+ * often as hits come in, and searches hold on to whichever order was
+ * current when they started
+ */
+class DesignPopularity {
+public:
+    typedef boost::filesystem::path path;
+
+    DesignPopularity(size_t numDesigns, const path &saveFile);
+
+    void load();
+    void recordHit(int id);
+    SearchOrder order();
+
+private:
+    void rebuild();
+    void save() const;
+
+    size_t numDesigns;
+    path saveFile;
+    std::unique_ptr<std::atomic<uint32_t>[]> hits;
+    std::atomic<uint32_t> hitsSinceRebuild;
+
+    std::mutex orderLock;
+    std::mutex rebuildLock;
+    SearchOrder current;
+};
+
+
+#endif /* POPULARITY_H_ */
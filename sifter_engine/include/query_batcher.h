@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef QUERY_BATCHER_H_
+#define QUERY_BATCHER_H_
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "sifter.h"
+
+
+/*
+ * gathers the coarse searches of concurrent requests into batches, so that
+ * one pass over the designs serves all of them instead of each request
+ * streaming every design's descriptors through the caches on its own.  the
+ * first search to arrive leads a batch: it waits up to windowSeconds (or
+ * until maxBatch searches have joined), runs the pass for everyone, and hands
+ * each search back its own shortlist
+ */
+class QueryBatcher {
+public:
+    typedef std::function<std::vector<std::vector<PotentialMatch>>(
+        const std::vector<Mat> &, std::vector<SearchContext> &)> BatchSearch;
+
+    QueryBatcher(const BatchSearch &search, double windowSeconds,
+        size_t maxBatch);
+
+    std::vector<PotentialMatch> search(const Mat &queryDescriptors,
+        SearchContext &context);
+
+private:
+    struct Batch {
+        std::vector<Mat> queries;
+        std::vector<SearchContext> contexts;
+        std::vector<std::vector<PotentialMatch>> results;
+        std::exception_ptr error;
+        bool done = false;
+    };
+
+    BatchSearch batchSearch;
+    double windowSeconds;
+    size_t maxBatch;
+
+    std::mutex lock;
+    std::condition_variable filled;
+    std::condition_variable finished;
+    std::shared_ptr<Batch> open;
+};
+
+
+#endif /* QUERY_BATCHER_H_ */
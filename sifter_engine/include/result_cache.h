@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef RESULT_CACHE_H_
+#define RESULT_CACHE_H_
+
+#include <cstdint>
+#include <future>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "sifter.h"
+
+
+/*
+ * what came of matching an upload, which is everything we need to answer
+ * another request for the same image with.  the search's context goes along
+ * with it, so that a request that waited on it has its stage times too
+ */
+struct MatchOutcome {
+    enum Status {MATCHED, UNDECODABLE, UNAVAILABLE};
+
+    Status status = MATCHED;
+    MatchInfo info;
+    double retryAfter = 0;
+    SearchContext context;
+};
+
+
+/*
+ * remembers the results of recent matches, so that an image we've already
+ * matched isn't matched again.  people scan the same shirt over and over,
+ * and the app retries uploads, so this happens a lot.  results are found by
+ * the exact content hash of the upload, or, failing that, by a perceptual
+ * hash of the decoded image within hammingTolerance bits (negative turns
+ * that off).  only the capacity most recently used results are kept.
+ *
+ * identical uploads that arrive while the first is still being matched
+ * don't start matches of their own: the first claims the content hash, and
+ * the rest wait on its outcome
+ */
+class ResultCache {
+public:
+    ResultCache(size_t capacity, int hammingTolerance);
+
+    bool find(uint64_t contentHash, MatchInfo &info);
+    bool findSimilar(uint64_t imageHash, MatchInfo &info);
+    void insert(uint64_t contentHash, uint64_t imageHash,
+        const MatchInfo &info);
+
+    bool claim(uint64_t contentHash,
+        std::shared_future<MatchOutcome> &pending);
+    void fulfil(uint64_t contentHash, const MatchOutcome &outcome);
+
+    std::string statsJson();
+
+private:
+    struct Entry {
+        uint64_t contentHash;
+        uint64_t imageHash;
+        MatchInfo info;
+    };
+
+    struct InFlight {
+        std::promise<MatchOutcome> promise;
+        std::shared_future<MatchOutcome> outcome;
+    };
+
+    void touch(std::list<Entry>::iterator entry);
+
+    size_t capacity;
+    int hammingTolerance;
+
+    std::mutex lock;
+
+    /*
+     * most recently used first
+     */
+    std::list<Entry> entries;
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> byContent;
+    std::unordered_map<uint64_t, InFlight> inFlight;
+
+    uint64_t lookups = 0;
+    uint64_t exactHits = 0;
+    uint64_t similarHits = 0;
+    uint64_t coalesced = 0;
+};
+
+
+#endif /* RESULT_CACHE_H_ */
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+#define TBB_PREVIEW_TASK_ARENA 1
+#include <tbb/task_arena.h>
+
+
+/*
+ * sits between the web server's request threads and the matcher.  only
+ * maxConcurrent matches run at once, inside their own TBB arena so they
+ * can't spill out onto other threads; the rest wait their turn in FIFO
+ * order.  once the queue is full, or the wait we'd expect for a new request
+ * is over the SLO, new requests are turned away immediately instead of being
+ * left to time out
+ */
+class MatchScheduler {
+public:
+    MatchScheduler(int maxConcurrent, int maxQueued, double sloSeconds,
+        int numThreads);
+
+    bool run(const std::function<void()> &job, double &retryAfter);
+    bool wouldReject(double &retryAfter);
+
+    int queued();
+    int running();
+    uint64_t rejected();
+
+private:
+    double estimatedWait() const;
+
+    int maxConcurrent;
+    size_t maxQueued;
+    double sloSeconds;
+
+    std::mutex lock;
+    std::condition_variable turn;
+    std::deque<uint64_t> waiting;
+    uint64_t nextTicket = 0;
+    int numRunning = 0;
+    uint64_t numRejected = 0;
+
+    /*
+     * a moving average of how long a match takes to run, which is what our
+     * wait estimates are built on
+     */
+    double averageService = 0;
+
+    tbb::task_arena arena;
+};
+
+
+#endif /* SCHEDULER_H_ */
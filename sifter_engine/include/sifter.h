@@ -23,6 +23,7 @@
 #ifndef SIFTER_H_
 #define SIFTER_H_
 
+#include <functional>
 #include <map>
 #include <memory>
 #include <vector>
@@ -33,6 +34,10 @@
 
 #include <boost/filesystem.hpp>
 
+#include "design_store.h"
+#include "thumbnails.h"
+#include "popularity.h"
+
 
 
 
@@ -45,12 +50,21 @@ typedef boost::filesystem::directory_iterator dirIt;
 typedef boost::filesystem::recursive_directory_iterator recDirIt;
 
 
-struct DesignInfo {
-    int id;
-    std::string artistName;
-    std::string artistUrl;
-    std::string dateAdded;
-    std::string title;
+/*
+ * the parameters a SIFT extractor is built from.  cv::SIFT doesn't give them
+ * back after construction, so we keep them around for anything that needs to
+ * build more extractors (one per thread) or record what a set of descriptors
+ * was generated with
+ */
+struct SiftParams {
+    int numFeatures;
+    int octaves;
+    float contrastThreshold;
+    float edgeThreshold;
+    float sigma;
+
+    SIFT create() const;
+    std::string str() const;
 };
 
 struct MatchDetails {
@@ -74,31 +88,130 @@ struct PotentialMatch {
     MatchDetails details;
 };
 
+/*
+ * what a single search is allowed, and what it managed.  a search with a
+ * deadline (a logging::timestamp(), or 0 for none) stops when it's reached
+ * and returns the best it found so far, flagged as partial.  designs are
+ * scanned in order, if one is given, so that the likeliest ones get looked
+ * at before time runs out.  the shortlist is what the initial scan came up
+ * with, before refining picked one of it
+ */
+struct SearchContext {
+    double deadline = 0;
+    SearchOrder order;
+
+    bool partial = false;
+    int scanned = 0;
+    std::vector<PotentialMatch> shortlist;
+
+    /*
+     * seconds spent in each stage, for /metrics
+     */
+    double decodeTime = 0;
+    double coarseExtractTime = 0;
+    double coarseSearchTime = 0;
+    double refineExtractTime = 0;
+    double refineMatchTime = 0;
+
+    bool expired() const;
+};
+
+/*
+ * how a match response refers to the design's thumbnail: inlined as base64,
+ * as a URL to fetch (and cache) it from, or not at all
+ */
+enum class ThumbnailMode {INLINE, URL, NONE};
+
 struct MatchInfo {
-    static std::map<int, DesignInfo> designInfoData;
-    static path designThumbsDir;
+    static DesignStore designStore;
+    static ThumbnailCache thumbnails;
 
+    MatchInfo() = default;
     MatchInfo(const PotentialMatch &match, float elapsed);
 
     std::string designUrl;
     DesignInfo design;
+    bool partial = false;
+    int scanned = 0;
+    bool cached = false;
     PotentialMatch match;
-    float elapsed;
-    std::string thumbnail;
-    int width;
-    int height;
-    std::string json();
+    float elapsed = 0;
+    const Thumbnail *thumbnail = nullptr;
+    int width = 0;
+    int height = 0;
+    std::string json(ThumbnailMode thumbnailMode=ThumbnailMode::INLINE);
 };
 
 
 
-std::vector<PotentialMatch> findBestMatches(const path &fileNameToMatch,
+Mat computeDescriptors(const Mat &img, SIFT &sifter);
+
+Mat loadDescriptors(const path &fileName);
+
+std::vector<Mat> preloadDescriptors(const path &descriptorDirectory);
+
+void applyFunctionToImages(const path &imageDirectory,
+    std::function<void(const path&)> application, int max);
+
+MatchDetails compareImageToDesign(const Mat &query, const Mat &training,
+    DescriptorMatcher &matcher, float distanceRatioThreshold);
+
+MatchDetails filterMatches(const std::vector<std::vector<DMatch>> &knnMatches,
+    float distanceRatioThreshold);
+
+std::vector<PotentialMatch> topMatches(std::vector<PotentialMatch> &results,
+    int numBest);
+
+void computeKeypointsAndDescriptors(const path &imageFile,
+    std::vector<KeyPoint> &keypoints, Mat &descriptors, SIFT &sifter);
+
+void saveDescriptorsAndKeypoints(const path &fileName, const Mat &descriptors,
+    const std::vector<KeyPoint> &keypoints);
+
+class QueryBatcher;
+
+MatchInfo findBestMatch(const Mat &imageToMatch,
     const std::vector<Mat> &descriptors, int numBestMatches,
-    float distanceRatioThreshold, SIFT &sifter, bool multithreaded);
+    float distanceRatioThreshold, SIFT &sifter, SIFT &refineSifter,
+    bool multithreaded, SearchContext &context,
+    QueryBatcher *batcher=nullptr);
+
+MatchInfo findBestMatchForDescriptors(const Mat &coarseQuery,
+    const Mat &refineQuery, const std::vector<Mat> &descriptors,
+    int numBestMatches, float distanceRatioThreshold, bool multithreaded,
+    SearchContext &context, QueryBatcher *batcher=nullptr);
+
+void findBestMatchBatch(const std::vector<Mat> &images,
+    const std::vector<Mat> &descriptors, int numBestMatches,
+    float distanceRatioThreshold, SIFT &sifter, SIFT &refineSifter,
+    bool multithreaded, std::vector<SearchContext> &contexts,
+    const std::function<void(size_t, MatchInfo &)> &found);
+
+std::vector<PotentialMatch> findBestMatches(const Mat &image,
+    const std::vector<Mat> &descriptors, int numBestMatches,
+    float distanceRatioThreshold, SIFT &sifter, bool multithreaded,
+    SearchContext &context);
+
+std::vector<std::vector<PotentialMatch>> findBestMatchesBatch(
+    const std::vector<Mat> &queryDescriptors,
+    const std::vector<Mat> &descriptors, int numBestMatches,
+    float distanceRatioThreshold, bool multithreaded,
+    std::vector<SearchContext> &contexts);
+
+MatchInfo verifyShortlist(const Mat &image,
+    const std::vector<Mat> &descriptors,
+    std::vector<PotentialMatch> &shortlist, float distanceRatioThreshold,
+    SIFT &refineSifter, SearchContext &context);
+
+PotentialMatch ofBestMatchesGetOne(const Mat &image,
+    const std::vector<Mat> &descriptors,
+    std::vector<PotentialMatch> &matches, float distanceRatioThreshold,
+    SIFT &sifter, SearchContext &context);
 
-PotentialMatch ofBestMatchesGetOne(const path &fileNameToMatch,
+PotentialMatch refineMatches(const Mat &imageToMatch,
     const std::vector<Mat> &descriptors,
-    std::vector<PotentialMatch> &matches, SIFT &sifter);
+    std::vector<PotentialMatch> &matches, float distanceRatioThreshold,
+    SearchContext &context);
 
 
 #endif /* SIFTER_H_ */
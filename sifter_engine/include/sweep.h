@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SWEEP_H_
+#define SWEEP_H_
+
+#include <string>
+#include <vector>
+
+#include "sifter.h"
+
+
+/*
+ * the values of each tunable a sweep tries.  every combination of them is
+ * one configuration
+ */
+struct SweepGrid {
+    std::vector<float> sigmas;
+    std::vector<int> trainDescriptors;
+    std::vector<int> coarseFeatures;
+    std::vector<int> refineFeatures;
+    std::vector<int> numMatches;
+    std::vector<float> ratios;
+
+    size_t size() const;
+};
+
+/*
+ * how one configuration did on the test images.  memory is what its
+ * design descriptors take up in memory, which is what the engine's
+ * footprint scales with
+ */
+struct SweepResult {
+    float sigma = 0;
+    int trainDescriptors = 0;
+    int coarseFeatures = 0;
+    int refineFeatures = 0;
+    int numMatches = 0;
+    float ratio = 0;
+
+    double accuracy = 0;
+    double recall = 0;
+    double p50 = 0;
+    double p99 = 0;
+    double throughput = 0;
+    size_t descriptorBytes = 0;
+
+    bool dominates(const SweepResult &other) const;
+    std::string json() const;
+};
+
+
+bool parseList(const std::string &list, std::vector<int> &values);
+bool parseList(const std::string &list, std::vector<float> &values);
+
+std::vector<size_t> paretoFront(const std::vector<SweepResult> &results);
+std::string sweepJson(const std::vector<SweepResult> &results);
+
+std::vector<SweepResult> runSweep(const path &base, const path &designsDir,
+    const path &testImagesDir, const SweepGrid &grid, int octaves,
+    float contrastThreshold, float edgeThreshold, int targetLongEdge,
+    bool multithreaded, int limit, int parallelism, const path &outFile);
+
+
+#endif /* SWEEP_H_ */
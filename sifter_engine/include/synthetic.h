@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SYNTHETIC_H_
+#define SYNTHETIC_H_
+
+#include <cstdint>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+
+/*
+ * made-up designs, and made-up photos of them, for measuring the engine
+ * without the real design data.  everything is drawn from the RNG it's
+ * given, so the same seed always gives the same image
+ */
+
+
+/*
+ * how far a photo strays from the design it's of.  perspective is how far
+ * each corner can move, as a fraction of the photo's size, blur is the
+ * largest blur sigma, lighting the largest change in brightness, as a
+ * fraction, and noise the largest sensor noise standard deviation
+ */
+struct PhotoDistortion {
+    float perspective = 0.08;
+    float rotation = 10;
+    float blur = 1.5;
+    float lighting = 0.3;
+    float noise = 8;
+};
+
+
+cv::Mat syntheticDesign(int width, int height, cv::RNG &rng);
+
+cv::Mat syntheticPhoto(const cv::Mat &design, int longEdge, cv::RNG &rng,
+    const PhotoDistortion &distortion=PhotoDistortion());
+
+std::string syntheticTitle(cv::RNG &rng);
+
+/*
+ * an RNG for one of a number of things made from the same seed, so that
+ * they can be made in any order, or in parallel
+ */
+cv::RNG seededRng(uint64_t seed, uint64_t id, uint64_t stream=0);
+
+
+#endif /* SYNTHETIC_H_ */
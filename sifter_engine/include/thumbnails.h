@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef THUMBNAILS_H_
+#define THUMBNAILS_H_
+
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+
+/*
+ * everything we send back to clients about a design's image, prepared ahead
+ * of time so that responding to a match needs no disk I/O or decoding
+ */
+struct Thumbnail {
+    int width = 0;
+    int height = 0;
+    std::string jpeg;
+    std::string base64;
+
+    /*
+     * a hash of the jpeg, used as its HTTP entity tag, and as a version in
+     * its URL so that clients can cache it forever
+     */
+    std::string version;
+    std::string etag;
+};
+
+
+/*
+ * every design thumbnail, loaded into memory at startup and indexed by
+ * design id.  read-only once loaded, so any thread can use it
+ */
+class ThumbnailCache {
+public:
+    typedef boost::filesystem::path path;
+
+    bool load(const path &thumbsDir, bool multithreaded);
+    const Thumbnail *get(int id) const;
+    size_t size() const;
+
+private:
+    std::vector<Thumbnail> thumbnails;
+    size_t numLoaded = 0;
+};
+
+
+void generateThumbnails(const boost::filesystem::path &designsDir,
+    const boost::filesystem::path &thumbsDir, int longEdge, bool multithreaded);
+
+
+#endif /* THUMBNAILS_H_ */
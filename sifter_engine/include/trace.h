@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <cstdint>
+#include <ostream>
+
+
+/*
+ * request-scoped tracing.  a request gets a trace id, which the thread
+ * handling it carries, and spans timed on that thread (or handed the id
+ * explicitly, like the TBB chunks of a search) are recorded against it.
+ * every thread records into a ring buffer of its own, so threads never
+ * wait on each other to record a span, and the oldest spans are dropped
+ * when a ring fills up.  the rings can be exported as Chrome trace-event
+ * JSON, for chrome://tracing or Perfetto.
+ *
+ * nothing is recorded until tracing is enabled, and span names must be
+ * string literals, since only the pointer is kept
+ */
+namespace tracing {
+    void setEnabled(bool enabled);
+    bool enabled();
+
+    uint64_t newTrace();
+    uint64_t current();
+
+    void record(const char *name, uint64_t trace, double start, double end,
+        int64_t arg=0);
+
+    void exportJson(std::ostream &out, uint64_t onlyTrace=0);
+
+
+    /*
+     * makes trace the current thread's trace, until it goes out of scope
+     */
+    class Scope {
+    public:
+        Scope(uint64_t trace);
+        ~Scope();
+
+    private:
+        uint64_t previous;
+    };
+
+
+    /*
+     * times from construction to destruction.  arg is shown alongside the
+     * span, for things like how many designs a chunk scanned
+     */
+    class Span {
+    public:
+        Span(const char *name, int64_t arg=0);
+        Span(const char *name, uint64_t trace, int64_t arg);
+        ~Span();
+
+        void setArg(int64_t arg);
+
+    private:
+        const char *name;
+        uint64_t trace;
+        int64_t arg;
+        double start;
+    };
+}
+
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TUNING_H_
+#define TUNING_H_
+
+
+/*
+ * what matching is tuned to.  the server and --test run with these,
+ * sifter_bench measures with them, and --sweep starts from them, so they're
+ * kept here rather than in any one of those
+ */
+namespace tuning {
+
+    /*
+     * a blur sigma of 3.0 seems to be the sweet spot between high accuracy
+     * and low matching time
+     */
+    const float SIGMA = 3.0;
+
+    /*
+     * after graphing the distribution of descriptors over all training images,
+     * 3500 seems to be a good cutoff
+     */
+    const int TRAIN_FEATURES = 3500;
+
+    /*
+     * SIFT parameters
+     */
+    const int OCTAVES = 3;
+    const float CONTRAST_THRESHOLD = 0.04;
+    const float EDGE_THRESHOLD = 10;
+
+    /*
+     * query features for the initial scan over every design, which has to be
+     * quick, and for refining its shortlist of the best NUM_MATCHES, which
+     * can afford more
+     */
+    const int COARSE_FEATURES = 80;
+    const int REFINE_FEATURES = 300;
+    const int NUM_MATCHES = 80;
+
+    /*
+     * how much closer a descriptor's nearest neighbour has to be than its
+     * second nearest for the match to count
+     */
+    const float RATIO_THRESHOLD = 0.75;
+
+    /*
+     * the JPEG quality of design thumbnails.  plenty for a phone screen, and
+     * small enough that the base64 we inline into every match response stays
+     * small
+     */
+    const int THUMBNAIL_QUALITY = 85;
+}
+
+
+#endif /* TUNING_H_ */
@@ -26,10 +26,18 @@
 
 
 #include <functional>
+#include <memory>
+#include <string>
 #include <vector>
 #include <atomic>
 
 #include "sifter.h"
+#include "http.h"
+#include "image.h"
+#include "scheduler.h"
+#include "result_cache.h"
+#include "descriptor_payload.h"
+#include "flight_recorder.h"
 
 
 extern "C" {
@@ -40,37 +48,194 @@ extern "C" {
 #define log_server(msg, p) dlog("web server " << port << ": " << msg, p)
 
 
-typedef std::function<MatchInfo(const path &)> Matcher;
+typedef std::function<MatchInfo(const Mat &, SearchContext &)> Matcher;
+typedef std::function<MatchInfo(const Mat &, std::vector<PotentialMatch> &,
+    SearchContext &)> Verifier;
+typedef std::function<void(const std::vector<Mat> &,
+    std::vector<SearchContext> &,
+    const std::function<void(size_t, MatchInfo &)> &)> BatchMatcher;
+typedef std::function<MatchInfo(const Mat &, SearchContext &)>
+    PrecomputedMatcher;
 
 
-int handleRequest(mg_connection *conn);
-void handleUpload(mg_connection *conn, const char *path);
+/*
+ * one part of a multipart/form-data body.  data points into the body it was
+ * parsed from
+ */
+struct BodyPart {
+    std::string headers;
+    const unsigned char *data;
+    size_t size;
+};
+
+/*
+ * one image in a /match/batch upload.  data points into the body it was
+ * parsed from
+ */
+struct BatchImage {
+    std::string name;
+    const unsigned char *data;
+    size_t size;
+};
+
+
+/*
+ * which front end owns our connections: our own event loop, which reads
+ * and writes every connection from one thread and only ties up a handler
+ * thread once a request is in, or mongoose, which gives every connection a
+ * thread of its own
+ */
+enum class Frontend {EPOLL, MONGOOSE};
+
+
+class Server;
+class EventServer;
+
+void handleRequest(Server *server, const HttpRequest &request,
+    Responder &out);
+int handleMongooseRequest(mg_connection *conn);
+bool admitRequest(Server *server, const HttpRequest &request,
+    Responder &out, size_t &maxBody);
+bool isMatchRequest(const HttpRequest &request);
+bool isInlineRequest(const HttpRequest &request);
+bool isBatchRequest(const HttpRequest &request);
+bool isDescriptorsRequest(const HttpRequest &request);
+bool isSessionRequest(const HttpRequest &request);
+HttpRequest mongooseRequest(const mg_request_info *info);
+#ifdef USE_WEBSOCKET
+void startMongooseSession(mg_connection *conn);
+int handleMongooseFrame(mg_connection *conn, int bits, char *data,
+    size_t size);
+void endMongooseRequest(const mg_connection *conn, int status);
+#endif
+void handleMatch(Server *server, const HttpRequest &request, Responder &out);
+void handleMatchBatch(Server *server, const HttpRequest &request,
+    Responder &out);
+void handleMatchDescriptors(Server *server, const HttpRequest &request,
+    Responder &out);
+MatchOutcome matchUpload(Server *server, const unsigned char *image,
+    size_t imageSize, SearchContext &context);
+void recordSearch(const SearchContext &context, bool scanned);
+void recordIfSlow(Server *server, const HttpRequest &request,
+    const char *kind, const unsigned char *upload, size_t size,
+    const SearchContext &context, const MatchInfo &info,
+    const LoadSnapshot &load);
+void recordReceive(const HttpRequest &request);
+void recordResponse(const HttpRequest &request, double start);
+double requestedBudget(const HttpRequest &request, double defaultSeconds);
+double requestedDeadline(const HttpRequest &request, double defaultDeadline);
+bool scheduleWaiting(Server *server, const std::function<void()> &job);
+std::vector<BodyPart> parseMultipart(const std::string &contentType,
+    const unsigned char *body, size_t size);
+bool parseTar(const unsigned char *body, size_t size,
+    std::vector<BatchImage> &images);
+ThumbnailMode requestedThumbnailMode(const HttpRequest &request);
 
 class Server {
 public:
     Server();
+    ~Server();
 
     void setHealthyThreshold(int healthyThreshold);
     void setMatcher(Matcher matcher);
+    void setVerifier(Verifier verifier);
+    void setBatchMatcher(BatchMatcher batchMatcher);
+    void setPrecomputedMatcher(PrecomputedMatcher precomputedMatcher);
+    void setSiftParams(const SiftParams &coarse, const SiftParams &refine);
+    const SiftParams &getCoarseParams() const;
+    const SiftParams &getRefineParams() const;
+    void setBatchLimits(size_t maxBytes, int groupSize, int maxBatches);
+    size_t getMaxBatchBytes() const;
+    int getBatchGroupSize() const;
+    bool batchesFull() const;
+    bool beginBatch();
+    void endBatch();
+    bool beginCoalescedWait();
+    void endCoalescedWait();
+    void setThumbnails(const ThumbnailCache *thumbnails);
+    void setDecodeLimits(const DecodeLimits &limits);
+    void setDefaultDeadline(double seconds);
+    double getDefaultDeadline() const;
+    void setScheduling(int maxConcurrent, int maxQueued, double sloSeconds,
+        int numThreads);
+    void setResultCache(size_t capacity, int hammingTolerance);
+    ResultCache *getResultCache();
+    void setFlightRecorder(size_t capacity, double percentile,
+        const path &dumpDir, const std::string &params);
+    FlightRecorder *getFlightRecorder();
+    LoadSnapshot loadSnapshot();
+    const DecodeLimits &getDecodeLimits() const;
+    void setFrontend(Frontend frontend);
+    void setConnectionLimits(int maxConnections, double idleTimeout,
+        size_t maxBufferedBytes);
+    int handlerThreads() const;
     void serve(int port);
     void stop();
-    MatchInfo match(const path& imagePath);
-    std::string createResponse(int code, const std::string &codeMsg,
-        const std::string &msg,
+    MatchInfo match(const Mat &image, SearchContext &context);
+    MatchInfo verify(const Mat &image, std::vector<PotentialMatch> &shortlist,
+        SearchContext &context);
+    MatchInfo matchPrecomputed(const Mat &descriptors,
+        SearchContext &context);
+    void matchBatch(const std::vector<Mat> &images,
+        std::vector<SearchContext> &contexts,
+        const std::function<void(size_t, MatchInfo &)> &found);
+    bool schedule(const std::function<void()> &job, double &retryAfter);
+    bool wouldReject(double &retryAfter);
+    std::string createHeaders(int code, const std::string &codeMsg,
+        const std::string &contentType, size_t contentLength,
+        const std::string &extraHeaders="") const;
+    std::string createChunkedHeaders(int code, const std::string &codeMsg,
         const std::string &contentType) const;
+    std::string createResponse(int code, const std::string &codeMsg,
+        const std::string &contentType,
+        const std::string &msg) const;
 
     bool isHealthy();
-    void OKJSON(mg_connection *conn, const std::string &msg) const;
-    void OK(mg_connection *conn, const std::string &msg="", const std::string &contentType="text/plain") const;
-    void errorNotAllowed(mg_connection *conn) const;
-    void errorNotFound(mg_connection *conn) const;
+    std::string statsJson();
+    std::string metricsText();
+    void OKJSON(Responder &out, const std::string &msg) const;
+    void OK(Responder &out, const std::string &msg="", const std::string &contentType="text/plain") const;
+    void errorNotAllowed(Responder &out) const;
+    void errorNotFound(Responder &out) const;
+    void error(Responder &out, int code, const std::string &codeMsg,
+        const std::string &msg="") const;
+    void errorUnavailable(Responder &out, double retryAfter) const;
+    void sendThumbnail(const HttpRequest &request, Responder &out,
+        int id) const;
 
 private:
+    int maxActive() const;
+    int maxCoalescedWaiters() const;
+
     mg_context *ctx = nullptr;
     int port = 0;
     int healthyThreshold = 2;
     Matcher matcher;
+    Verifier verifier;
+    BatchMatcher batchMatcher;
+    PrecomputedMatcher precomputedMatcher;
+    SiftParams coarseParams = {};
+    SiftParams refineParams = {};
+    size_t maxBatchBytes = 256 * 1024 * 1024;
+    int batchGroupSize = 8;
+    int maxBatches = 2;
+    std::atomic_int activeBatches;
+    std::atomic_int coalescedWaiters;
+    const ThumbnailCache *thumbnails = nullptr;
+    DecodeLimits decodeLimits = {20 * 1024 * 1024, 50 * 1000 * 1000, 1024};
+    double defaultDeadline = 0;
     std::atomic_int pendingMatches;
+    std::unique_ptr<MatchScheduler> scheduler;
+    std::unique_ptr<ResultCache> resultCache;
+    std::unique_ptr<FlightRecorder> flightRecorder;
+    int maxConcurrent = 0;
+    int maxQueued = 0;
+
+    Frontend frontend = Frontend::EPOLL;
+    int maxConnections = 10000;
+    double idleTimeout = 30;
+    size_t maxBufferedBytes = 1024 * 1024 * 1024;
+    std::unique_ptr<EventServer> eventServer;
 };
 
 
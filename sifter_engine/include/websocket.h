@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WEBSOCKET_H_
+#define WEBSOCKET_H_
+
+#include <cstddef>
+#include <string>
+
+#include "http.h"
+
+
+/*
+ * just enough of RFC 6455 for our event front end to talk to clients
+ * streaming to us: the upgrade handshake, and reading and writing frames
+ */
+namespace websocket {
+    enum Opcode {
+        CONTINUATION = 0x0,
+        TEXT = 0x1,
+        BINARY = 0x2,
+        CLOSE = 0x8,
+        PING = 0x9,
+        PONG = 0xa
+    };
+
+    struct Frame {
+        bool fin;
+        int opcode;
+        std::string payload;
+    };
+
+    bool isUpgrade(const HttpRequest &request);
+    std::string handshake(const std::string &key);
+    std::string encode(int opcode, const void *data, size_t size);
+    ParseResult decode(const char *data, size_t size, size_t maxPayload,
+        Frame &frame, size_t &frameLength);
+}
+
+
+#endif /* WEBSOCKET_H_ */
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WORK_QUEUE_H_
+#define WORK_QUEUE_H_
+
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+
+/*
+ * a queue of work units that lives entirely in a spool directory, so that any
+ * number of processes, on one host or on many hosts sharing the filesystem,
+ * can take work from it.  every state change is a rename(), which is atomic,
+ * so a unit can only ever be claimed by one worker at a time:
+ *
+ *   pending/<unit>           waiting to be claimed
+ *   claimed/<unit>@<owner>   leased to a worker.  its mtime is the worker's
+ *                            heartbeat, and once that's older than the lease,
+ *                            anyone may move it back to pending/
+ *   results/<unit>           the output of a finished unit
+ *   done/<unit>              marks that results/<unit> is complete
+ *
+ * units and results are just lines of text; what they mean is up to the
+ * caller
+ */
+class WorkQueue {
+public:
+    typedef boost::filesystem::path path;
+
+    WorkQueue(const path &spoolDir, double leaseSeconds);
+
+    void create(const std::vector<std::string> &header);
+    bool exists() const;
+    std::vector<std::string> header() const;
+    void destroy();
+
+    void add(const std::string &unit, const std::vector<std::string> &lines);
+    bool claim(std::string &unit, std::vector<std::string> &lines);
+    bool heartbeat(const std::string &unit);
+    bool complete(const std::string &unit,
+        const std::vector<std::string> &results);
+    std::vector<std::string> results(const std::string &unit) const;
+    int reapExpired();
+
+    int numPending() const;
+    int numClaimed() const;
+    std::vector<std::string> doneUnits() const;
+
+    const std::string &owner() const;
+
+private:
+    path claimedFile(const std::string &unit) const;
+
+    path spoolDir;
+    double leaseSeconds;
+    std::string ownerName;
+};
+
+
+#endif /* WORK_QUEUE_H_ */
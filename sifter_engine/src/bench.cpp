@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * microbenchmarks for the pieces of a match that we spend our time in, run
+ * on fixed inputs so that a change to one of them can be measured without
+ * the server, the design data or the network.  the inputs are drawn from a
+ * seeded RNG, unless --image is given, in which case it stands in for the
+ * design that the query photo was taken of
+ */
+
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/features2d/features2d.hpp>
+#include <opencv2/nonfree/features2d.hpp>
+
+#include <boost/program_options.hpp>
+
+#include <glib-2.0/glib.h>
+
+#include "sifter.h"
+#include "evaluation.h"
+#include "synthetic.h"
+#include "tuning.h"
+#include "logging.h"
+
+using namespace cv;
+
+
+struct BenchResult {
+    std::string name;
+    int iterations = 0;
+    std::vector<double> samples;
+    Distribution stats;
+};
+
+
+/*
+ * times fn.  calls that are too quick for the clock to see are grouped, so
+ * that each sample is at least minSample seconds long, and divided back out,
+ * so every number we report is seconds per call
+ */
+BenchResult runBench(const std::string &name, const std::function<void()> &fn,
+        int warmup, int repeat, double minSample) {
+    BenchResult result;
+    result.name = name;
+
+    for (int i=0; i<warmup; i++) {
+        fn();
+    }
+
+    int iterations = 1;
+    while (true) {
+        double start = logging::timestamp();
+        for (int i=0; i<iterations; i++) {
+            fn();
+        }
+        double elapsed = logging::timestamp() - start;
+        if (elapsed >= minSample || iterations >= (1 << 20)) {
+            break;
+        }
+        iterations *= 2;
+    }
+    result.iterations = iterations;
+
+    for (int r=0; r<repeat; r++) {
+        double start = logging::timestamp();
+        for (int i=0; i<iterations; i++) {
+            fn();
+        }
+        result.samples.push_back((logging::timestamp() - start) / iterations);
+    }
+
+    result.stats = Distribution::of(result.samples);
+    return result;
+}
+
+
+Mat resizeLongEdge(const Mat &image, int longEdge) {
+    float scale = float(longEdge) / std::max(image.cols, image.rows);
+    Mat resized;
+    resize(image, resized, Size(), scale, scale, INTER_AREA);
+    return resized;
+}
+
+
+void printResult(const BenchResult &result) {
+    const Distribution &stats = result.stats;
+    printf("%-28s %10d %12.3f %12.3f %12.3f %12.3f %8.1f%%\n",
+        result.name.c_str(), result.iterations, stats.p50 * 1e6,
+        stats.p99 * 1e6, stats.min * 1e6, stats.stddev * 1e6,
+        stats.mean > 0 ? 100 * stats.stddev / stats.mean : 0);
+    fflush(stdout);
+}
+
+
+std::string resultsJson(const std::vector<BenchResult> &results, int seed) {
+    std::stringstream buf;
+    buf << std::setprecision(9);
+    buf << "{\"seed\": " << seed << ", \"unit\": \"seconds\", \"benchmarks\": [";
+
+    for (size_t i=0; i<results.size(); i++) {
+        const BenchResult &r = results[i];
+        buf << (i ? ", " : "")
+            << "{\"name\": \"" << r.name << "\""
+            << ", \"iterations\": " << r.iterations
+            << ", \"median\": " << r.stats.p50
+            << ", \"p99\": " << r.stats.p99
+            << ", \"mean\": " << r.stats.mean
+            << ", \"stddev\": " << r.stats.stddev
+            << ", \"min\": " << r.stats.min
+            << ", \"samples\": [";
+        for (size_t s=0; s<r.samples.size(); s++) {
+            buf << (s ? ", " : "") << r.samples[s];
+        }
+        buf << "]}";
+    }
+
+    buf << "]}";
+    return buf.str();
+}
+
+
+int main(int argc, char** argv) {
+    int repeat;
+    int warmup;
+    int seed;
+    double minSample;
+    int numDesigns;
+    std::string imageFile;
+    std::string filter;
+    std::string jsonOut;
+
+    namespace opt = boost::program_options;
+    opt::options_description desc("Options");
+    desc.add_options()
+        ("help", "help message")
+        ("repeat", opt::value<int>(&repeat)->default_value(50),
+            "samples taken of each benchmark")
+        ("warmup", opt::value<int>(&warmup)->default_value(3),
+            "untimed calls before sampling")
+        ("min-sample", opt::value<double>(&minSample)->default_value(0.005),
+            "seconds each sample should last at least.  quicker calls are "
+            "repeated within a sample")
+        ("seed", opt::value<int>(&seed)->default_value(1),
+            "seed for the synthetic inputs")
+        ("designs", opt::value<int>(&numDesigns)->default_value(20000),
+            "number of designs to select the best of")
+        ("image", opt::value<std::string>(&imageFile),
+            "a design image to use instead of a synthetic one")
+        ("filter", opt::value<std::string>(&filter),
+            "only run benchmarks whose name contains this")
+        ("json", opt::value<std::string>(&jsonOut),
+            "also write the results, with every sample, to this file")
+    ;
+
+    opt::variables_map options;
+    opt::store(opt::parse_command_line(argc, argv, desc), options);
+    opt::notify(options);
+
+    if (options.count("help")) {
+        std::cout << desc << "\n";
+        return 1;
+    }
+
+    logging::setPriority(logging::HIGH);
+    RNG rng(seed);
+
+
+    /*
+     * our inputs.  the design is what --generate would have extracted
+     * training descriptors from, and the query is a photo of it, at the size
+     * clients upload
+     */
+    Mat design;
+    if (!imageFile.empty()) {
+        design = imread(imageFile, CV_LOAD_IMAGE_GRAYSCALE);
+        if (design.empty()) {
+            std::cerr << "couldn't read " << imageFile << "\n";
+            return 1;
+        }
+    }
+    else {
+        cvtColor(syntheticDesign(1200, 1500, rng), design, CV_BGR2GRAY);
+    }
+    Mat query = syntheticPhoto(design, 640, rng);
+
+    SiftParams coarseParams = {tuning::COARSE_FEATURES, tuning::OCTAVES,
+        tuning::CONTRAST_THRESHOLD, tuning::EDGE_THRESHOLD, tuning::SIGMA};
+    SiftParams refineParams = {tuning::REFINE_FEATURES, tuning::OCTAVES,
+        tuning::CONTRAST_THRESHOLD, tuning::EDGE_THRESHOLD, tuning::SIGMA};
+    SiftParams trainParams = {tuning::TRAIN_FEATURES, tuning::OCTAVES,
+        tuning::CONTRAST_THRESHOLD, tuning::EDGE_THRESHOLD, tuning::SIGMA};
+    SIFT coarseSifter = coarseParams.create();
+    SIFT refineSifter = refineParams.create();
+    SIFT trainSifter = trainParams.create();
+
+    Mat coarseQuery = computeDescriptors(query, coarseSifter);
+    Mat refineQuery = computeDescriptors(query, refineSifter);
+    Mat training = computeDescriptors(design, trainSifter);
+
+    if (coarseQuery.empty() || training.rows < 2) {
+        std::cerr << "no features found in the inputs\n";
+        return 1;
+    }
+
+    BFMatcher matcher(NORM_L2, false);
+    std::vector<std::vector<DMatch>> coarseKnn, refineKnn;
+    matcher.knnMatch(coarseQuery, training, coarseKnn, 2);
+    matcher.knnMatch(refineQuery, training, refineKnn, 2);
+
+    /*
+     * one result per design, as the coarse scan leaves them, for picking the
+     * best numMatches of
+     */
+    std::vector<PotentialMatch> scanResults(numDesigns);
+    for (int i=0; i<numDesigns; i++) {
+        scanResults[i].id = i;
+        scanResults[i].details.numMatches = rng.uniform(0, 40);
+    }
+
+    Thumbnail thumbnail;
+    std::vector<unsigned char> thumbJpeg;
+    std::vector<int> jpegParams = {CV_IMWRITE_JPEG_QUALITY,
+        tuning::THUMBNAIL_QUALITY};
+    imencode(".jpg", resizeLongEdge(design, 300), thumbJpeg, jpegParams);
+    gchar *encoded = g_base64_encode(thumbJpeg.data(), thumbJpeg.size());
+    thumbnail.base64 = encoded;
+    g_free(encoded);
+    thumbnail.version = "0123456789abcdef";
+
+    MatchInfo info;
+    info.design.id = 1234;
+    info.design.title = "a synthetic design";
+    info.design.artistName = "nobody";
+    info.design.artistUrl = "http://www.threadless.com/profile/0/nobody";
+    info.design.dateAdded = "2013-01-01";
+    info.designUrl = "http://www.threadless.com/product/1234";
+    info.match = scanResults[0];
+    info.thumbnail = &thumbnail;
+    info.width = 300;
+    info.height = 375;
+
+    printf("design %dx%d, query %dx%d, descriptors: coarse %d, refine %d, "
+        "training %d, designs %d\n\n", design.cols, design.rows, query.cols,
+        query.rows, coarseQuery.rows, refineQuery.rows, training.rows,
+        numDesigns);
+    printf("%-28s %10s %12s %12s %12s %12s %9s\n", "benchmark", "calls/sample",
+        "median us", "p99 us", "min us", "stddev us", "cv");
+
+
+    /*
+     * volatile sinks, so nothing we time can be optimized away
+     */
+    volatile int sink = 0;
+    std::vector<BenchResult> results;
+    auto bench = [&](const std::string &name, const std::function<void()> &fn) {
+        if (!filter.empty() && name.find(filter) == std::string::npos) {
+            return;
+        }
+        results.push_back(runBench(name, fn, warmup, repeat, minSample));
+        printResult(results.back());
+    };
+
+    for (int longEdge: {320, 640, 1024, 2048}) {
+        Mat image = resizeLongEdge(design, longEdge);
+        bench("compute_descriptors_" + std::to_string(longEdge), [&]() {
+            sink = computeDescriptors(image, coarseSifter).rows;
+        });
+    }
+    bench("compute_descriptors_refine", [&]() {
+        sink = computeDescriptors(query, refineSifter).rows;
+    });
+
+    bench("compare_image_to_design", [&]() {
+        sink = compareImageToDesign(coarseQuery, training, matcher,
+            tuning::RATIO_THRESHOLD).numMatches;
+    });
+    bench("compare_refine_to_design", [&]() {
+        sink = compareImageToDesign(refineQuery, training, matcher,
+            tuning::RATIO_THRESHOLD).numMatches;
+    });
+
+    bench("filter_matches", [&]() {
+        sink = filterMatches(coarseKnn, tuning::RATIO_THRESHOLD).numMatches;
+    });
+    bench("filter_matches_refine", [&]() {
+        sink = filterMatches(refineKnn, tuning::RATIO_THRESHOLD).numMatches;
+    });
+
+    /*
+     * topMatches sorts in place, so this includes copying the scan results
+     * back in each time, as findBestMatchesBatch has them fresh each time
+     */
+    std::vector<PotentialMatch> scratch;
+    bench("top_matches", [&]() {
+        scratch = scanResults;
+        sink = topMatches(scratch, tuning::NUM_MATCHES).size();
+    });
+
+    bench("match_json_inline", [&]() {
+        sink = info.json(ThumbnailMode::INLINE).size();
+    });
+    bench("match_json_url", [&]() {
+        sink = info.json(ThumbnailMode::URL).size();
+    });
+    bench("match_json_none", [&]() {
+        sink = info.json(ThumbnailMode::NONE).size();
+    });
+
+    bench("thumbnail_build", [&]() {
+        std::vector<unsigned char> jpeg;
+        imencode(".jpg", resizeLongEdge(design, 300), jpeg, jpegParams);
+        gchar *b64 = g_base64_encode(jpeg.data(), jpeg.size());
+        sink = strlen(b64);
+        g_free(b64);
+    });
+
+    (void)sink;
+
+
+    if (!jsonOut.empty()) {
+        std::ofstream handle(jsonOut);
+        handle << resultsJson(results, seed) << "\n";
+        if (!handle) {
+            std::cerr << "couldn't write " << jsonOut << "\n";
+            return 1;
+        }
+    }
+
+    return 0;
+}
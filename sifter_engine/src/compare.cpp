@@ -0,0 +1,522 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * compares benchmark results (sifter_bench --json, and any number of runs of
+ * sifter --test --test-out) with a baseline recorded the same way, and fails
+ * if anything got significantly worse.  "significantly" means both that
+ * the confidence interval of the change is entirely on the worse side of no
+ * change, so it's unlikely to be noise, and that the change itself is past
+ * a threshold, so it's big enough to matter.
+ *
+ * latencies are compared by their means, with Welch's t interval, from the
+ * per-sample (bench) or per-query (test) spread.  accuracy and recall are
+ * proportions of the test images, and get a normal interval on their
+ * difference.  throughput needs at least two runs on each side, since each
+ * run only gives one number.  memory is the peak RSS of the test runs,
+ * which doesn't vary enough between runs to need an interval, so it has a
+ * plain tolerance
+ */
+
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdio>
+
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/math/distributions/students_t.hpp>
+#include <boost/math/distributions/normal.hpp>
+
+namespace pt = boost::property_tree;
+
+
+/*
+ * a mean and how much it varies, over count measurements
+ */
+struct Summary {
+    double count = 0;
+    double mean = 0;
+    double stddev = 0;
+};
+
+/*
+ * combines the summaries of several runs of the same thing into one
+ */
+Summary pool(const std::vector<Summary> &runs) {
+    Summary pooled;
+    for (auto &run: runs) {
+        pooled.count += run.count;
+        pooled.mean += run.count * run.mean;
+    }
+    if (pooled.count == 0) {
+        return pooled;
+    }
+    pooled.mean /= pooled.count;
+
+    double squares = 0;
+    for (auto &run: runs) {
+        squares += (run.count - 1) * run.stddev * run.stddev
+            + run.count * (run.mean - pooled.mean) * (run.mean - pooled.mean);
+    }
+    pooled.stddev = pooled.count > 1
+        ? std::sqrt(squares / (pooled.count - 1)) : 0;
+    return pooled;
+}
+
+Summary summarize(const std::vector<double> &values) {
+    Summary summary;
+    summary.count = values.size();
+    if (values.empty()) {
+        return summary;
+    }
+    for (double v: values) {
+        summary.mean += v;
+    }
+    summary.mean /= values.size();
+
+    double squares = 0;
+    for (double v: values) {
+        squares += (v - summary.mean) * (v - summary.mean);
+    }
+    summary.stddev = values.size() > 1
+        ? std::sqrt(squares / (values.size() - 1)) : 0;
+    return summary;
+}
+
+
+enum Verdict {OK, IMPROVED, REGRESSED, UNTESTED};
+
+struct Comparison {
+    std::string metric;
+    double baseline = 0;
+    double current = 0;
+
+    /*
+     * the interval of current - baseline, if there is one
+     */
+    bool hasInterval = false;
+    double low = 0;
+    double high = 0;
+
+    Verdict verdict = UNTESTED;
+};
+
+
+/*
+ * everything one side of the comparison measured
+ */
+struct Results {
+    pt::ptree bench;
+    std::vector<pt::ptree> evaluations;
+};
+
+
+/*
+ * Welch's interval on the difference of two means.  lowerIsBetter says
+ * which way a regression goes, and threshold is how big a change, as a
+ * fraction of the baseline, has to be before it counts
+ */
+Comparison compareMeans(const std::string &metric, const Summary &baseline,
+        const Summary &current, bool lowerIsBetter, double threshold,
+        double confidence) {
+    Comparison c;
+    c.metric = metric;
+    c.baseline = baseline.mean;
+    c.current = current.mean;
+
+    if (baseline.count < 2 || current.count < 2) {
+        return c;
+    }
+
+    double vb = baseline.stddev * baseline.stddev / baseline.count;
+    double vc = current.stddev * current.stddev / current.count;
+    double se = std::sqrt(vb + vc);
+    double diff = current.mean - baseline.mean;
+
+    double margin = 0;
+    if (se > 0) {
+        double df = (vb + vc) * (vb + vc)
+            / (vb * vb / (baseline.count - 1) + vc * vc / (current.count - 1));
+        boost::math::students_t dist(df);
+        margin = boost::math::quantile(boost::math::complement(dist,
+            (1 - confidence) / 2)) * se;
+    }
+
+    c.hasInterval = true;
+    c.low = diff - margin;
+    c.high = diff + margin;
+
+    /*
+     * flipped, if need be, so that positive is worse
+     */
+    double limit = threshold * std::fabs(baseline.mean);
+    double worse = lowerIsBetter ? diff : -diff;
+    double worseLow = lowerIsBetter ? c.low : -c.high;
+    double worseHigh = lowerIsBetter ? c.high : -c.low;
+    c.verdict = worseLow > 0 && worse > limit ? REGRESSED
+        : worseHigh < 0 && worse < -limit ? IMPROVED : OK;
+    return c;
+}
+
+/*
+ * a normal interval on the difference of two proportions, each of n
+ * trials.  tolerance is in absolute terms, since accuracy already is a
+ * fraction
+ */
+Comparison compareProportions(const std::string &metric, double baseline,
+        double baselineN, double current, double currentN, double tolerance,
+        double confidence) {
+    Comparison c;
+    c.metric = metric;
+    c.baseline = baseline;
+    c.current = current;
+
+    if (baselineN < 1 || currentN < 1) {
+        return c;
+    }
+
+    double se = std::sqrt(baseline * (1 - baseline) / baselineN
+        + current * (1 - current) / currentN);
+    boost::math::normal normal;
+    double z = boost::math::quantile(boost::math::complement(normal,
+        (1 - confidence) / 2));
+    double diff = current - baseline;
+
+    c.hasInterval = true;
+    c.low = diff - z * se;
+    c.high = diff + z * se;
+    c.verdict = c.high < 0 && diff < -tolerance ? REGRESSED
+        : c.low > 0 && diff > tolerance ? IMPROVED : OK;
+    return c;
+}
+
+/*
+ * no interval, just how far current is from baseline, as a fraction
+ */
+Comparison compareTolerance(const std::string &metric, double baseline,
+        double current, double tolerance) {
+    Comparison c;
+    c.metric = metric;
+    c.baseline = baseline;
+    c.current = current;
+    if (baseline <= 0) {
+        return c;
+    }
+
+    double change = (current - baseline) / baseline;
+    c.verdict = change > tolerance ? REGRESSED
+        : change < -tolerance ? IMPROVED : OK;
+    return c;
+}
+
+
+Summary benchSummary(const pt::ptree &benchmark) {
+    std::vector<double> samples;
+    auto found = benchmark.get_child_optional("samples");
+    if (found) {
+        for (auto &sample: *found) {
+            samples.push_back(sample.second.get_value<double>());
+        }
+    }
+    return summarize(samples);
+}
+
+/*
+ * a Distribution from the evaluation JSON, pooled over every run
+ */
+Summary evaluationSummary(const std::vector<pt::ptree> &runs,
+        const std::string &path) {
+    std::vector<Summary> summaries;
+    for (auto &run: runs) {
+        auto found = run.get_child_optional(path);
+        if (!found) {
+            continue;
+        }
+        Summary summary;
+        summary.count = found->get<double>("count", 0);
+        summary.mean = found->get<double>("mean", 0);
+        summary.stddev = found->get<double>("stddev", 0);
+        summaries.push_back(summary);
+    }
+    return pool(summaries);
+}
+
+std::vector<double> evaluationValues(const std::vector<pt::ptree> &runs,
+        const std::string &path) {
+    std::vector<double> values;
+    for (auto &run: runs) {
+        auto found = run.get_optional<double>(path);
+        if (found) {
+            values.push_back(*found);
+        }
+    }
+    return values;
+}
+
+double meanOf(const std::vector<double> &values) {
+    return summarize(values).mean;
+}
+
+
+std::vector<Comparison> compare(const Results &baseline,
+        const Results &current, double threshold, double accuracyTolerance,
+        double memoryTolerance, double confidence) {
+    std::vector<Comparison> comparisons;
+
+
+    /*
+     * every microbenchmark the baseline has.  ones that have since gone
+     * (or been filtered out) can't be compared, and are left out
+     */
+    auto baselineBench = baseline.bench.get_child_optional("benchmarks");
+    auto currentBench = current.bench.get_child_optional("benchmarks");
+    if (baselineBench && currentBench) {
+        for (auto &b: *baselineBench) {
+            std::string name = b.second.get<std::string>("name", "");
+            for (auto &c: *currentBench) {
+                if (c.second.get<std::string>("name", "") != name) {
+                    continue;
+                }
+                comparisons.push_back(compareMeans("bench " + name,
+                    benchSummary(b.second), benchSummary(c.second), true,
+                    threshold, confidence));
+                break;
+            }
+        }
+    }
+
+
+    if (baseline.evaluations.empty() || current.evaluations.empty()) {
+        return comparisons;
+    }
+
+    const char *latencies[] = {"latency", "stages.decode",
+        "stages.coarse_extract", "stages.coarse_search",
+        "stages.refine_extract", "stages.refine_match"};
+    for (auto path: latencies) {
+        comparisons.push_back(compareMeans(std::string("test ") + path,
+            evaluationSummary(baseline.evaluations, path),
+            evaluationSummary(current.evaluations, path), true, threshold,
+            confidence));
+    }
+
+    comparisons.push_back(compareMeans("test throughput",
+        summarize(evaluationValues(baseline.evaluations, "throughput")),
+        summarize(evaluationValues(current.evaluations, "throughput")),
+        false, threshold, confidence));
+
+    /*
+     * repeated runs are over the same images, so they don't add trials;
+     * the number of images is the number of trials
+     */
+    double baselineImages = meanOf(evaluationValues(baseline.evaluations,
+        "images"));
+    double currentImages = meanOf(evaluationValues(current.evaluations,
+        "images"));
+    comparisons.push_back(compareProportions("test accuracy",
+        meanOf(evaluationValues(baseline.evaluations, "accuracy")),
+        baselineImages,
+        meanOf(evaluationValues(current.evaluations, "accuracy")),
+        currentImages, accuracyTolerance, confidence));
+
+    auto recall = baseline.evaluations[0].get_child_optional("recall");
+    if (recall) {
+        for (auto &k: *recall) {
+            std::string path = "recall." + k.first;
+            comparisons.push_back(compareProportions("test recall@" + k.first,
+                meanOf(evaluationValues(baseline.evaluations, path)),
+                baselineImages,
+                meanOf(evaluationValues(current.evaluations, path)),
+                currentImages, accuracyTolerance, confidence));
+        }
+    }
+
+    comparisons.push_back(compareTolerance("test max rss bytes",
+        meanOf(evaluationValues(baseline.evaluations, "max_rss_bytes")),
+        meanOf(evaluationValues(current.evaluations, "max_rss_bytes")),
+        memoryTolerance));
+
+    return comparisons;
+}
+
+
+void printTable(const std::vector<Comparison> &comparisons) {
+    printf("%-34s %14s %14s %9s %24s  %s\n", "metric", "baseline", "current",
+        "change", "interval of change", "verdict");
+
+    for (auto &c: comparisons) {
+        char change[32] = "";
+        if (c.baseline != 0) {
+            snprintf(change, sizeof(change), "%+.1f%%",
+                100 * (c.current - c.baseline) / std::fabs(c.baseline));
+        }
+
+        char interval[64] = "";
+        if (c.hasInterval) {
+            snprintf(interval, sizeof(interval), "[%+.4g, %+.4g]", c.low,
+                c.high);
+        }
+
+        const char *verdict = c.verdict == REGRESSED ? "REGRESSED"
+            : c.verdict == IMPROVED ? "improved"
+            : c.verdict == OK ? "ok" : "untested";
+
+        printf("%-34s %14.6g %14.6g %9s %24s  %s\n", c.metric.c_str(),
+            c.baseline, c.current, change, interval, verdict);
+    }
+}
+
+
+std::string readFile(const std::string &fileName) {
+    std::ifstream handle(fileName);
+    return std::string((std::istreambuf_iterator<char>(handle)),
+        std::istreambuf_iterator<char>());
+}
+
+
+int main(int argc, char** argv) {
+    std::string baselineFile;
+    std::string benchFile;
+    std::vector<std::string> evalFiles;
+    bool writeBaseline;
+    double threshold;
+    double accuracyTolerance;
+    double memoryTolerance;
+    double confidence;
+
+    namespace opt = boost::program_options;
+    opt::options_description desc("Options");
+    desc.add_options()
+        ("help", "help message")
+        ("baseline", opt::value<std::string>(&baselineFile),
+            "the baseline to compare with, or to write with --write-baseline")
+        ("bench", opt::value<std::string>(&benchFile),
+            "results of sifter_bench --json")
+        ("eval", opt::value<std::vector<std::string>>(&evalFiles),
+            "results of sifter --test --test-out.  give it once per run")
+        ("write-baseline", opt::bool_switch(&writeBaseline),
+            "record these results as the baseline, instead of comparing")
+        ("threshold", opt::value<double>(&threshold)->default_value(0.05),
+            "smallest change in a latency or throughput, as a fraction of "
+            "the baseline, that counts")
+        ("accuracy-tolerance",
+            opt::value<double>(&accuracyTolerance)->default_value(0.01),
+            "smallest drop in accuracy or recall that counts")
+        ("memory-tolerance",
+            opt::value<double>(&memoryTolerance)->default_value(0.10),
+            "largest growth in peak memory, as a fraction, that's allowed")
+        ("confidence", opt::value<double>(&confidence)->default_value(0.95),
+            "confidence level of the intervals")
+    ;
+
+    opt::variables_map options;
+    opt::store(opt::parse_command_line(argc, argv, desc), options);
+    opt::notify(options);
+
+    if (options.count("help")) {
+        std::cout << desc << "\n";
+        return 1;
+    }
+
+    if (baselineFile.empty() || (benchFile.empty() && evalFiles.empty())) {
+        std::cerr << "please give --baseline, and --bench and/or --eval "
+            "results\n";
+        return 2;
+    }
+
+
+    /*
+     * the baseline is just the results files, put together as they are
+     */
+    if (writeBaseline) {
+        std::ofstream handle(baselineFile);
+        handle << "{\"bench\": " << (benchFile.empty() ? "{}"
+            : readFile(benchFile)) << ",\n\"evaluations\": [";
+        for (size_t i=0; i<evalFiles.size(); i++) {
+            handle << (i ? ",\n" : "\n") << readFile(evalFiles[i]);
+        }
+        handle << "]}\n";
+        if (!handle) {
+            std::cerr << "couldn't write " << baselineFile << "\n";
+            return 2;
+        }
+        std::cout << "wrote baseline " << baselineFile << "\n";
+        return 0;
+    }
+
+    if (!boost::filesystem::exists(baselineFile)) {
+        std::cerr << "there's no baseline at " << baselineFile << " to compare "
+            "with.  record one with make perf-baseline, on a quiet machine, "
+            "the one the gate will run on\n";
+        return 2;
+    }
+
+    Results baseline, current;
+    try {
+        pt::ptree tree;
+        pt::read_json(baselineFile, tree);
+        baseline.bench = tree.get_child("bench", pt::ptree());
+        auto evaluations = tree.get_child_optional("evaluations");
+        if (evaluations) {
+            for (auto &e: *evaluations) {
+                baseline.evaluations.push_back(e.second);
+            }
+        }
+
+        if (!benchFile.empty()) {
+            pt::read_json(benchFile, current.bench);
+        }
+        for (auto &evalFile: evalFiles) {
+            pt::ptree evaluation;
+            pt::read_json(evalFile, evaluation);
+            current.evaluations.push_back(evaluation);
+        }
+    }
+    catch (const pt::json_parser_error &e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+
+    auto comparisons = compare(baseline, current, threshold,
+        accuracyTolerance, memoryTolerance, confidence);
+    printTable(comparisons);
+
+    int regressions = std::count_if(comparisons.begin(), comparisons.end(),
+        [](const Comparison &c) { return c.verdict == REGRESSED; });
+    if (regressions) {
+        std::cout << "\n" << regressions << " significant regression"
+            << (regressions == 1 ? "" : "s") << "\n";
+        return 1;
+    }
+    std::cout << "\nno significant regressions\n";
+    return 0;
+}
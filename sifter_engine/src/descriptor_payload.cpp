@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdint>
+#include <cstring>
+
+#include "descriptor_payload.h"
+
+
+namespace descriptor_payload {
+
+    const unsigned char VERSION = 1;
+
+
+    uint32_t readU32(const unsigned char *data) {
+        return uint32_t(data[0]) | uint32_t(data[1]) << 8
+            | uint32_t(data[2]) << 16 | uint32_t(data[3]) << 24;
+    }
+
+    float readF32(const unsigned char *data) {
+        uint32_t bits = readU32(data);
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+
+    /*
+     * reads a payload into a CV_32F matrix, which is what our designs'
+     * descriptors are and what the matcher wants.  uint8 rows lose nothing
+     * by this, since SIFT's values are whole numbers from 0 to 255 anyway.
+     * returns false, with error set, if the payload is malformed
+     */
+    bool parse(const unsigned char *data, size_t size, Payload &payload,
+            std::string &error) {
+        if (size < HEADER_SIZE || memcmp(data, "SFTD", 4) != 0) {
+            error = "not a descriptor payload";
+            return false;
+        }
+        if (data[4] != VERSION) {
+            error = "unsupported payload version";
+            return false;
+        }
+
+        int rowType = data[5];
+        int rowLength = data[6] | data[7] << 8;
+        if (rowType != FLOAT32 && rowType != UINT8) {
+            error = "unknown row type";
+            return false;
+        }
+        if (rowLength != ROW_LENGTH) {
+            error = "rows must have 128 values";
+            return false;
+        }
+
+        payload.params.numFeatures = int32_t(readU32(data + 8));
+        payload.params.octaves = int32_t(readU32(data + 12));
+        payload.params.contrastThreshold = readF32(data + 16);
+        payload.params.edgeThreshold = readF32(data + 20);
+        payload.params.sigma = readF32(data + 24);
+        uint32_t rows = readU32(data + 28);
+
+        size_t valueSize = rowType == FLOAT32 ? 4 : 1;
+        if (rows == 0) {
+            error = "no descriptors";
+            return false;
+        }
+        if (payload.params.numFeatures > 0
+                && rows > uint32_t(payload.params.numFeatures)) {
+            error = "more rows than numFeatures";
+            return false;
+        }
+        if ((size - HEADER_SIZE) / (ROW_LENGTH * valueSize) != rows
+                || (size - HEADER_SIZE) % (ROW_LENGTH * valueSize) != 0) {
+            error = "payload size doesn't match its row count";
+            return false;
+        }
+
+        const unsigned char *values = data + HEADER_SIZE;
+        payload.descriptors.create(rows, ROW_LENGTH, CV_32F);
+        for (uint32_t row=0; row<rows; row++) {
+            float *out = payload.descriptors.ptr<float>(row);
+            for (int col=0; col<ROW_LENGTH; col++) {
+                out[col] = rowType == FLOAT32 ? readF32(values)
+                    : float(*values);
+                values += valueSize;
+            }
+        }
+
+        if (!checkRange(payload.descriptors, true, nullptr, 0, 512)) {
+            error = "descriptor values out of range";
+            return false;
+        }
+        return true;
+    }
+
+    /*
+     * descriptors only compare meaningfully with ours if they came from an
+     * extractor set up the same way.  the feature count may be anywhere from
+     * our coarse extractor's to our refining one's: the initial scan takes
+     * the strongest of them, and refining uses all of them
+     */
+    bool compatible(const SiftParams &params, const SiftParams &coarse,
+            const SiftParams &refine, std::string &error) {
+        if (params.octaves != refine.octaves
+                || params.contrastThreshold != refine.contrastThreshold
+                || params.edgeThreshold != refine.edgeThreshold
+                || params.sigma != refine.sigma) {
+            error = "SIFT parameters don't match ours (" + refine.str()
+                + ")";
+            return false;
+        }
+        if (params.numFeatures < coarse.numFeatures
+                || params.numFeatures > refine.numFeatures) {
+            error = "numFeatures must be from "
+                + std::to_string(coarse.numFeatures) + " to "
+                + std::to_string(refine.numFeatures);
+            return false;
+        }
+        return true;
+    }
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "design_store.h"
+#include "logging.h"
+
+
+namespace fs = boost::filesystem;
+
+
+const char STORE_MAGIC[8] = {'S', 'I', 'F', 'T', 'M', 'E', 'T', 'A'};
+const uint32_t STORE_VERSION = 1;
+const uint32_t NO_RECORD = 0xffffffff;
+
+
+struct DesignStore::Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t numRecords;
+    uint32_t maxId;
+    uint32_t stringsSize;
+};
+
+struct DesignStore::Record {
+    struct Field {
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    uint32_t id;
+    Field artistName;
+    Field artistUrl;
+    Field dateAdded;
+    Field title;
+};
+
+
+/*
+ * reads our yaml design info file and writes it back out in the flat format
+ * described in design_store.h.  strings are deduplicated as they go into the
+ * pool, since the same artists show up over and over
+ */
+bool DesignStore::build(const path &yamlFile, const path &storeFile) {
+    cv::FileStorage handle;
+    if (!handle.open(yamlFile.string(), cv::FileStorage::READ)) {
+        dlog("couldn't open " << yamlFile, logging::HIGH);
+        return false;
+    }
+
+    std::vector<Record> records;
+    std::string pool;
+    std::map<std::string, uint32_t> pooled;
+    uint32_t maxId = 0;
+
+    auto addString = [&](const cv::FileNode &node) {
+        std::string value;
+        node >> value;
+
+        Record::Field field = {0, uint32_t(value.size())};
+        auto existing = pooled.find(value);
+        if (existing != pooled.end()) {
+            field.offset = existing->second;
+        }
+        else {
+            field.offset = pool.size();
+            pooled[value] = field.offset;
+            pool += value;
+        }
+        return field;
+    };
+
+    cv::FileNode mapping = handle["product_mapping"];
+    for (auto entry: mapping) {
+        Record record;
+        record.id = std::stoi(entry.name().substr(1, std::string::npos));
+        record.artistName = addString(entry["artist"]);
+        record.title = addString(entry["title"]);
+        record.dateAdded = addString(entry["added"]);
+        record.artistUrl = addString(entry["url"]);
+
+        maxId = std::max(maxId, record.id);
+        records.push_back(record);
+    }
+    handle.release();
+
+    std::vector<uint32_t> index(maxId + 1, NO_RECORD);
+    for (size_t i=0; i<records.size(); i++) {
+        index[records[i].id] = i;
+    }
+
+    Header header;
+    memcpy(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+    header.version = STORE_VERSION;
+    header.numRecords = records.size();
+    header.maxId = maxId;
+    header.stringsSize = pool.size();
+
+    /*
+     * written aside under a name of its own, and renamed into place, so that
+     * a reader never maps a half-written store, and two builders never write
+     * the same file
+     */
+    path tmpFile = storeFile.parent_path()/fs::unique_path(
+        storeFile.filename().string() + ".%%%%-%%%%-%%%%.tmp");
+    {
+        std::ofstream out(tmpFile.string(), std::ofstream::binary);
+        out.write((const char *)&header, sizeof(header));
+        out.write((const char *)index.data(), index.size() * sizeof(uint32_t));
+        out.write((const char *)records.data(), records.size() * sizeof(Record));
+        out.write(pool.data(), pool.size());
+        if (!out) {
+            dlog("couldn't write " << tmpFile, logging::HIGH);
+            boost::system::error_code ignored;
+            fs::remove(tmpFile, ignored);
+            return false;
+        }
+    }
+
+    boost::system::error_code ec;
+    fs::rename(tmpFile, storeFile, ec);
+    if (ec) {
+        dlog("couldn't move " << tmpFile << " to " << storeFile << ": "
+            << ec.message(), logging::HIGH);
+        boost::system::error_code ignored;
+        fs::remove(tmpFile, ignored);
+        return false;
+    }
+
+    dlog("built design store " << storeFile << " with " << records.size()
+        << " designs", logging::HIGH);
+    return true;
+}
+
+
+DesignStore::~DesignStore() {
+    close();
+}
+
+bool DesignStore::open(const path &storeFile) {
+    close();
+
+    int fd = ::open(storeFile.c_str(), O_RDONLY);
+    if (fd < 0) {
+        dlog("couldn't open " << storeFile, logging::HIGH);
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(Header)) {
+        ::close(fd);
+        dlog(storeFile << " is truncated", logging::HIGH);
+        return false;
+    }
+
+    mappingSize = info.st_size;
+    mapping = mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        dlog("couldn't mmap " << storeFile, logging::HIGH);
+        return false;
+    }
+
+    const char *base = static_cast<const char *>(mapping);
+    header = reinterpret_cast<const Header *>(base);
+
+    size_t indexSize = (size_t(header->maxId) + 1) * sizeof(uint32_t);
+    size_t recordsSize = size_t(header->numRecords) * sizeof(Record);
+    size_t expected = sizeof(Header) + indexSize + recordsSize
+        + header->stringsSize;
+
+    if (memcmp(header->magic, STORE_MAGIC, sizeof(STORE_MAGIC)) != 0
+            || header->version != STORE_VERSION
+            || mappingSize != expected) {
+        dlog(storeFile << " isn't a valid design store", logging::HIGH);
+        close();
+        return false;
+    }
+
+    index = reinterpret_cast<const uint32_t *>(base + sizeof(Header));
+    records = reinterpret_cast<const Record *>(base + sizeof(Header)
+        + indexSize);
+    strings = base + sizeof(Header) + indexSize + recordsSize;
+
+    dlog("opened design store " << storeFile << " with " << size()
+        << " designs", logging::HIGH);
+    return true;
+}
+
+void DesignStore::close() {
+    if (mapping) {
+        munmap(mapping, mappingSize);
+    }
+    mapping = nullptr;
+    mappingSize = 0;
+    header = nullptr;
+    index = nullptr;
+    records = nullptr;
+    strings = nullptr;
+}
+
+size_t DesignStore::size() const {
+    return header ? header->numRecords : 0;
+}
+
+boost::string_ref DesignStore::string(uint32_t offset, uint32_t length) const {
+    if (size_t(offset) + length > header->stringsSize) {
+        return boost::string_ref();
+    }
+    return boost::string_ref(strings + offset, length);
+}
+
+/*
+ * fills in info for the design with this id, pointing its strings into our
+ * mapping.  returns false, leaving info alone, if we don't know the design
+ */
+bool DesignStore::lookup(int id, DesignInfo &info) const {
+    if (!header || id < 0 || uint32_t(id) > header->maxId) {
+        return false;
+    }
+
+    uint32_t recordNum = index[id];
+    if (recordNum >= header->numRecords) {
+        return false;
+    }
+
+    const Record &record = records[recordNum];
+    info.id = record.id;
+    info.artistName = string(record.artistName.offset, record.artistName.length);
+    info.artistUrl = string(record.artistUrl.offset, record.artistUrl.length);
+    info.dateAdded = string(record.dateAdded.offset, record.dateAdded.length);
+    info.title = string(record.title.offset, record.title.length);
+    return true;
+}
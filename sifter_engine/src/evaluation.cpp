@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+#include <thread>
+
+#include <sys/resource.h>
+
+#include "evaluation.h"
+#include "image.h"
+#include "trace.h"
+#include "logging.h"
+
+
+/*
+ * percentile of sorted values, by nearest rank
+ */
+double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t rank = size_t(std::ceil(p / 100.0 * sorted.size()));
+    rank = std::max(size_t(1), std::min(rank, sorted.size()));
+    return sorted[rank - 1];
+}
+
+
+Distribution Distribution::of(std::vector<double> values) {
+    Distribution dist;
+    dist.count = values.size();
+    if (values.empty()) {
+        return dist;
+    }
+
+    std::sort(values.begin(), values.end());
+    dist.min = values.front();
+    dist.max = values.back();
+    dist.p10 = percentile(values, 10);
+    dist.p50 = percentile(values, 50);
+    dist.p90 = percentile(values, 90);
+    dist.p99 = percentile(values, 99);
+
+    double sum = 0;
+    for (double v: values) {
+        sum += v;
+    }
+    dist.mean = sum / values.size();
+
+    double squares = 0;
+    for (double v: values) {
+        squares += (v - dist.mean) * (v - dist.mean);
+    }
+    dist.stddev = values.size() > 1
+        ? std::sqrt(squares / (values.size() - 1)) : 0;
+    return dist;
+}
+
+std::string Distribution::json() const {
+    std::stringstream buf;
+    buf << std::setprecision(6);
+    buf << "{\"count\": " << count
+        << ", \"mean\": " << mean
+        << ", \"stddev\": " << stddev
+        << ", \"min\": " << min
+        << ", \"p10\": " << p10
+        << ", \"p50\": " << p50
+        << ", \"p90\": " << p90
+        << ", \"p99\": " << p99
+        << ", \"max\": " << max
+        << "}";
+    return buf.str();
+}
+
+
+bool QueryOutcome::correct() const {
+    return guess.id == correctId;
+}
+
+
+double Evaluation::accuracy() const {
+    if (outcomes.empty()) {
+        return 0;
+    }
+    size_t correct = std::count_if(outcomes.begin(), outcomes.end(),
+        [](const QueryOutcome &o) { return o.correct(); });
+    return correct / double(outcomes.size());
+}
+
+/*
+ * how often the right design was in the top k of the initial scan's
+ * shortlist.  refining can only pick from the shortlist, so this is the
+ * best the final accuracy could be
+ */
+double Evaluation::recall(int k) const {
+    if (outcomes.empty()) {
+        return 0;
+    }
+    size_t found = std::count_if(outcomes.begin(), outcomes.end(),
+        [k](const QueryOutcome &o) {
+            return o.shortlistRank >= 0 && o.shortlistRank < k;
+        });
+    return found / double(outcomes.size());
+}
+
+Distribution Evaluation::latency() const {
+    std::vector<double> values;
+    for (auto &o: outcomes) {
+        values.push_back(o.elapsed);
+    }
+    return Distribution::of(values);
+}
+
+
+std::string Evaluation::json(const std::vector<int> &recallAt) const {
+    std::vector<double> decode, coarseExtract, coarseSearch, refineExtract,
+        refineMatch;
+    std::vector<double> correctStdAway, incorrectStdAway;
+    std::vector<double> correctConfidence, incorrectConfidence;
+    int partial = 0;
+
+    for (auto &o: outcomes) {
+        decode.push_back(o.context.decodeTime);
+        coarseExtract.push_back(o.context.coarseExtractTime);
+        coarseSearch.push_back(o.context.coarseSearchTime);
+        refineExtract.push_back(o.context.refineExtractTime);
+        refineMatch.push_back(o.context.refineMatchTime);
+        partial += o.context.partial;
+
+        if (o.correct()) {
+            correctStdAway.push_back(o.guess.stdAway);
+            correctConfidence.push_back(o.guess.confidence);
+        }
+        else {
+            incorrectStdAway.push_back(o.guess.stdAway);
+            incorrectConfidence.push_back(o.guess.confidence);
+        }
+    }
+
+    std::stringstream buf;
+    buf << std::setprecision(6);
+    buf << "{\"images\": " << outcomes.size()
+        << ", \"parallelism\": " << parallelism
+        << ", \"wall_time\": " << wallTime
+        << ", \"throughput\": " << (wallTime > 0 ? outcomes.size() / wallTime : 0)
+        << ", \"max_rss_bytes\": " << maxRss
+        << ", \"accuracy\": " << accuracy()
+        << ", \"partial\": " << partial
+        << ", \"recall\": {";
+    for (size_t i=0; i<recallAt.size(); i++) {
+        buf << (i ? ", " : "") << "\"" << recallAt[i] << "\": "
+            << recall(recallAt[i]);
+    }
+    buf << "}"
+        << ", \"latency\": " << latency().json()
+        << ", \"stages\": {"
+        << "\"decode\": " << Distribution::of(decode).json()
+        << ", \"coarse_extract\": " << Distribution::of(coarseExtract).json()
+        << ", \"coarse_search\": " << Distribution::of(coarseSearch).json()
+        << ", \"refine_extract\": " << Distribution::of(refineExtract).json()
+        << ", \"refine_match\": " << Distribution::of(refineMatch).json()
+        << "}"
+        << ", \"std_away\": {"
+        << "\"correct\": " << Distribution::of(correctStdAway).json()
+        << ", \"incorrect\": " << Distribution::of(incorrectStdAway).json()
+        << "}"
+        << ", \"confidence\": {"
+        << "\"correct\": " << Distribution::of(correctConfidence).json()
+        << ", \"incorrect\": " << Distribution::of(incorrectConfidence).json()
+        << "}"
+        << ", \"bad_guesses\": [";
+
+    bool first = true;
+    for (auto &o: outcomes) {
+        if (o.correct()) {
+            continue;
+        }
+        buf << (first ? "" : ", ")
+            << "{\"image\": " << o.correctId
+            << ", \"guess\": " << o.guess.id
+            << ", \"std_away\": " << o.guess.stdAway
+            << ", \"shortlist_rank\": " << o.shortlistRank
+            << "}";
+        first = false;
+    }
+    buf << "]}";
+    return buf.str();
+}
+
+
+/*
+ * matches every image in testImagesDir, parallelism at a time, and measures
+ * how it went.  the images have been pre-cropped and flipped, and each is
+ * named by the design it's of.  limit, if not 0, takes only the first that
+ * many, in filename order
+ */
+Evaluation evaluate(const path &testImagesDir,
+        const std::vector<Mat> &descriptors, int numBestMatches,
+        float distanceRatioThreshold, SIFT &sifter, SIFT &refineSifter,
+        int targetLongEdge, bool multithreaded, int limit, int parallelism) {
+
+    std::vector<path> images;
+    for (auto it = recDirIt(testImagesDir); it != recDirIt(); it++) {
+        path imagePath = (*it).path();
+        if (imagePath.extension().string() == ".jpg") {
+            images.push_back(imagePath);
+        }
+    }
+    std::sort(images.begin(), images.end());
+    if (limit > 0 && size_t(limit) < images.size()) {
+        images.resize(limit);
+    }
+
+    Evaluation evaluation;
+    evaluation.parallelism = std::max(1, parallelism);
+    evaluation.outcomes.resize(images.size());
+
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        size_t i;
+        while ((i = next.fetch_add(1)) < images.size()) {
+            QueryOutcome &outcome = evaluation.outcomes[i];
+            outcome.correctId = std::stoi(images[i].stem().string());
+
+            std::ifstream handle(images[i].string(), std::ifstream::binary);
+            std::vector<unsigned char> bytes(
+                (std::istreambuf_iterator<char>(handle)),
+                std::istreambuf_iterator<char>());
+            tracing::Scope scope(tracing::newTrace());
+            tracing::Span span("test_image", outcome.correctId);
+
+            double start = logging::timestamp();
+            Mat image = decodeGrayscale(bytes.data(), bytes.size(),
+                targetLongEdge);
+            outcome.context.decodeTime = logging::timestamp() - start;
+
+            MatchInfo guess = findBestMatch(image, descriptors,
+                numBestMatches, distanceRatioThreshold, sifter, refineSifter,
+                multithreaded, outcome.context);
+            outcome.elapsed = logging::timestamp() - start;
+            outcome.guess = guess.match;
+
+            auto &shortlist = outcome.context.shortlist;
+            for (size_t rank=0; rank<shortlist.size(); rank++) {
+                if (shortlist[rank].id == outcome.correctId) {
+                    outcome.shortlistRank = rank;
+                    break;
+                }
+            }
+
+            dlog("test image " << outcome.correctId << " guessed "
+                << outcome.guess.id << " in " << outcome.elapsed
+                << " seconds", logging::MEDIUM);
+        }
+    };
+
+    double start = logging::timestamp();
+    std::vector<std::thread> threads;
+    for (int t=1; t<evaluation.parallelism; t++) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (auto &thread: threads) {
+        thread.join();
+    }
+    evaluation.wallTime = logging::timestamp() - start;
+
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        evaluation.maxRss = usage.ru_maxrss * 1024L;
+    }
+
+    return evaluation;
+}
@@ -0,0 +1,1007 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <strings.h>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "event_server.h"
+#include "web_server.h"
+#include "websocket.h"
+#include "match_session.h"
+#include "metrics.h"
+#include "logging.h"
+
+
+/*
+ * epoll data for our two sockets that aren't connections.  connection ids
+ * start after them
+ */
+const uint64_t LISTEN_ID = 0;
+const uint64_t WAKE_ID = 1;
+
+/*
+ * the most we'll buffer of a request's head before deciding it's not going
+ * to end
+ */
+const size_t MAX_HEAD_SIZE = 16 * 1024;
+
+/*
+ * we stop reading from a connection whose responses have piled up past
+ * this, until it catches up on reading them
+ */
+const size_t MAX_PENDING_OUTPUT = 1024 * 1024;
+
+/*
+ * what we set aside for a body up front.  the rest is allocated as it
+ * arrives, so a head claiming a large body costs nothing until it's sent
+ */
+const size_t BODY_RESERVE = 64 * 1024;
+
+const int MAX_EVENTS = 256;
+
+
+/*
+ * a connection's match session, shared between the event thread, which
+ * receives frames, and whichever handler thread is matching them
+ */
+struct EventServer::Session {
+    Session(Server *server, ThumbnailMode thumbnailMode):
+        matcher(server, thumbnailMode) {
+    }
+
+    MatchSession matcher;
+
+    std::mutex lock;
+    std::string pending;
+    bool hasPending = false;
+    bool busy = false;
+    bool closed = false;
+    uint64_t dropped = 0;
+};
+
+
+/*
+ * for responses written on the event thread: chunks go straight onto the
+ * connection's output
+ */
+class InlineResponder: public Responder {
+public:
+    InlineResponder(std::vector<EventServer::Chunk> &chunks):
+        chunks(chunks) {
+    }
+
+    using Responder::write;
+
+    void write(const void *data, size_t size) {
+        EventServer::Chunk chunk;
+        chunk.owned.assign(static_cast<const char *>(data), size);
+        chunk.size = size;
+        chunks.push_back(std::move(chunk));
+    }
+
+    void writeStatic(const void *data, size_t size) {
+        EventServer::Chunk chunk;
+        chunk.borrowed = static_cast<const char *>(data);
+        chunk.size = size;
+        chunks.push_back(std::move(chunk));
+    }
+
+private:
+    std::vector<EventServer::Chunk> &chunks;
+};
+
+
+/*
+ * for responses written on a handler thread: chunks are collected, and
+ * handed over to the event thread on flush() and once the handler is done
+ */
+class QueuedResponder: public Responder {
+public:
+    QueuedResponder(EventServer *events, uint64_t id): events(events),
+        id(id), out(chunks) {
+    }
+
+    void write(const void *data, size_t size) {
+        out.write(data, size);
+    }
+
+    void writeStatic(const void *data, size_t size) {
+        out.writeStatic(data, size);
+    }
+
+    void flush() {
+        post(false, false);
+    }
+
+    void finish(bool close) {
+        post(true, close);
+    }
+
+    bool wroteAnything() const {
+        return wrote;
+    }
+
+private:
+    void post(bool done, bool close) {
+        wrote = wrote || !chunks.empty();
+        events->post(EventServer::Completion{id, std::move(chunks), done,
+            close});
+        chunks.clear();
+    }
+
+    EventServer *events;
+    uint64_t id;
+    std::vector<EventServer::Chunk> chunks;
+    InlineResponder out;
+    bool wrote = false;
+};
+
+
+EventServer::EventServer(Server *server, int maxConnections,
+        double idleTimeout, size_t maxBufferedBytes, int numHandlers):
+        server(server), maxConnections(maxConnections),
+        idleTimeout(idleTimeout), maxBufferedBytes(maxBufferedBytes),
+        numHandlers(std::max(numHandlers, 1)),
+        nextId(WAKE_ID + 1) {
+    stopping = false;
+}
+
+EventServer::~EventServer() {
+    stop();
+}
+
+bool EventServer::start(int port) {
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        return false;
+    }
+
+    int on = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if (bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0
+            || listen(listenFd, SOMAXCONN) < 0) {
+        dlog("event server couldn't listen on " << port << ": "
+            << strerror(errno), logging::HIGH);
+        close(listenFd);
+        listenFd = -1;
+        return false;
+    }
+
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = LISTEN_ID;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+    event.data.u64 = WAKE_ID;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+
+    for (int i=0; i<numHandlers; i++) {
+        handlers.emplace_back(&EventServer::handlerLoop, this);
+    }
+    eventThread = std::thread(&EventServer::loop, this);
+
+    dlog("event server listening on " << port << " with " << numHandlers
+        << " handler threads", logging::HIGH);
+    return true;
+}
+
+/*
+ * stops the event loop and the handler threads.  handlers finish whatever
+ * they're in the middle of first
+ */
+void EventServer::stop() {
+    if (stopping.exchange(true)) {
+        return;
+    }
+
+    if (wakeFd >= 0) {
+        uint64_t one = 1;
+        if (::write(wakeFd, &one, sizeof(one)) < 0) {
+            dlog("couldn't wake event thread", logging::HIGH);
+        }
+    }
+    if (eventThread.joinable()) {
+        eventThread.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(jobLock);
+        jobs.clear();
+    }
+    jobReady.notify_all();
+    for (auto &handler: handlers) {
+        handler.join();
+    }
+
+    for (auto &entry: connections) {
+        close(entry.second->fd);
+    }
+    connections.clear();
+
+    for (int fd: {listenFd, epollFd, wakeFd}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+
+void EventServer::loop() {
+    epoll_event events[MAX_EVENTS];
+    double lastSweep = logging::timestamp();
+
+    while (!stopping) {
+        int ready = epoll_wait(epollFd, events, MAX_EVENTS, 1000);
+        if (ready < 0 && errno != EINTR) {
+            dlog("epoll_wait failed: " << strerror(errno), logging::HIGH);
+            break;
+        }
+
+        for (int i=0; i<ready; i++) {
+            uint64_t id = events[i].data.u64;
+            uint32_t flags = events[i].events;
+
+            if (id == LISTEN_ID) {
+                acceptConnections();
+                continue;
+            }
+            if (id == WAKE_ID) {
+                uint64_t count;
+                while (read(wakeFd, &count, sizeof(count)) > 0) {
+                }
+                drainCompletions();
+                continue;
+            }
+
+            auto found = connections.find(id);
+            if (found == connections.end()) {
+                continue;
+            }
+            Connection &conn = *found->second;
+
+            if (flags & (EPOLLERR | EPOLLHUP)) {
+                closeConnection(id);
+                continue;
+            }
+            if (flags & EPOLLOUT) {
+                writeTo(conn);
+                if (connections.find(id) == connections.end()) {
+                    continue;
+                }
+            }
+            if (flags & EPOLLIN) {
+                readFrom(conn);
+            }
+        }
+
+        double now = logging::timestamp();
+        if (now - lastSweep >= 1) {
+            sweepIdle();
+            lastSweep = now;
+        }
+    }
+}
+
+void EventServer::acceptConnections() {
+    while (true) {
+        int fd = accept4(listenFd, nullptr, nullptr,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                dlog("accept failed: " << strerror(errno), logging::MEDIUM);
+            }
+            return;
+        }
+
+        if (int(connections.size()) >= maxConnections) {
+            dlog("at " << maxConnections << " connections, refusing another",
+                logging::MEDIUM);
+            close(fd);
+            continue;
+        }
+
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        std::unique_ptr<Connection> conn(new Connection);
+        conn->fd = fd;
+        conn->id = nextId++;
+        conn->lastActivity = logging::timestamp();
+
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = conn->id;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        conn->events = EPOLLIN;
+
+        connections[conn->id] = std::move(conn);
+    }
+}
+
+/*
+ * reads whatever the client has sent.  body bytes go straight onto the
+ * request's body once its head is done with, rather than through our input
+ * buffer
+ */
+void EventServer::readFrom(Connection &conn) {
+    uint64_t id = conn.id;
+    char buffer[64 * 1024];
+
+    while (conn.state == State::READING_HEAD
+            || conn.state == State::READING_BODY
+            || conn.state == State::WEBSOCKET) {
+        ssize_t n;
+        if (conn.state == State::READING_BODY && conn.input.empty()) {
+            size_t wanted = std::min(sizeof(buffer),
+                conn.bodyLength - conn.request->body.size());
+            n = recv(conn.fd, buffer, wanted, 0);
+            if (n > 0 && !appendBody(conn, buffer, n)) {
+                return;
+            }
+        }
+        else {
+            n = recv(conn.fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                conn.input.append(buffer, n);
+            }
+        }
+
+        if (n == 0) {
+            closeConnection(id);
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                closeConnection(id);
+            }
+            break;
+        }
+
+        conn.lastActivity = logging::timestamp();
+        processInput(conn);
+        if (connections.find(id) == connections.end()) {
+            return;
+        }
+    }
+}
+
+/*
+ * works through whatever input we have: request heads, bodies, and any
+ * pipelined requests after them, until we run out or a request is handed
+ * off to a handler thread
+ */
+void EventServer::processInput(Connection &conn) {
+    uint64_t id = conn.id;
+
+    while (true) {
+        if (conn.state == State::READING_HEAD) {
+            if (conn.input.empty()) {
+                break;
+            }
+
+            std::shared_ptr<HttpRequest> request(new HttpRequest);
+            size_t headLength = 0;
+            ParseResult result = parseRequestHead(conn.input.data(),
+                conn.input.size(), *request, headLength);
+
+            if (result == ParseResult::INCOMPLETE) {
+                if (conn.input.size() > MAX_HEAD_SIZE) {
+                    std::vector<Chunk> chunks;
+                    InlineResponder out(chunks);
+                    server->error(out, 431, "Request Header Fields Too Large");
+                    conn.keepAlive = false;
+                    conn.state = State::CLOSING;
+                    queueOutput(conn, chunks);
+                }
+                break;
+            }
+            if (result == ParseResult::MALFORMED) {
+                std::vector<Chunk> chunks;
+                InlineResponder out(chunks);
+                server->error(out, 400, "Bad Request");
+                conn.keepAlive = false;
+                conn.state = State::CLOSING;
+                queueOutput(conn, chunks);
+                break;
+            }
+
+            conn.input.erase(0, headLength);
+            conn.keepAlive = request->keepAlive();
+            request->headArrival = logging::timestamp();
+
+            /*
+             * a request we won't take the body of gets its answer now, and
+             * the connection closes after it, since the body is still on
+             * its way and we'd have to read it all just to skip it
+             */
+            std::vector<Chunk> chunks;
+            InlineResponder out(chunks);
+            size_t length = 0;
+            if (!admitRequest(server, *request, out, length)) {
+                conn.keepAlive = false;
+                conn.state = State::CLOSING;
+                queueOutput(conn, chunks);
+                break;
+            }
+
+            conn.request = request;
+            conn.bodyLength = length;
+            conn.bodyBuffered = 0;
+            conn.state = State::READING_BODY;
+            if (length > 0 && bufferedBodyBytes >= maxBufferedBytes) {
+                rejectBody(conn);
+                break;
+            }
+            request->body.reserve(std::min(length, BODY_RESERVE));
+
+            const char *expect = request->header("Expect");
+            if (expect && strcasecmp(expect, "100-continue") == 0) {
+                out.write(std::string("HTTP/1.1 100 Continue\r\n\r\n"));
+                queueOutput(conn, chunks);
+            }
+        }
+
+        if (conn.state == State::READING_BODY) {
+            size_t take = std::min(conn.input.size(),
+                conn.bodyLength - conn.request->body.size());
+            if (take > 0 && !appendBody(conn, conn.input.data(), take)) {
+                break;
+            }
+            conn.input.erase(0, take);
+
+            if (conn.request->body.size() < conn.bodyLength) {
+                break;
+            }
+
+            releaseBody(conn);
+            dispatch(conn);
+            if (connections.find(id) == connections.end()
+                    || (conn.state != State::READING_HEAD
+                        && conn.state != State::WEBSOCKET)) {
+                break;
+            }
+            continue;
+        }
+
+        if (conn.state == State::WEBSOCKET) {
+            processFrames(conn);
+        }
+
+        break;
+    }
+
+    if (connections.find(id) != connections.end()) {
+        updateInterest(conn);
+    }
+}
+
+/*
+ * adds to the body of the request being read.  it's grown no further than
+ * the length its head claimed, and if it would take us past what we buffer
+ * across all connections, the request is turned away instead and false
+ * returned
+ */
+bool EventServer::appendBody(Connection &conn, const char *data,
+        size_t size) {
+    if (bufferedBodyBytes + size > maxBufferedBytes) {
+        rejectBody(conn);
+        return false;
+    }
+
+    auto &body = conn.request->body;
+    if (body.size() + size > body.capacity()) {
+        body.reserve(std::min(conn.bodyLength,
+            std::max(body.capacity() * 2, body.size() + size)));
+    }
+    body.insert(body.end(), data, data + size);
+
+    conn.bodyBuffered += size;
+    bufferedBodyBytes += size;
+    return true;
+}
+
+/*
+ * answers a request whose body we've no room for with a 503.  the rest of
+ * the body is still on its way, so the connection closes after it
+ */
+void EventServer::rejectBody(Connection &conn) {
+    dlog("buffering " << bufferedBodyBytes << " body bytes, turning away "
+        << "a " << conn.bodyLength << " byte request on connection "
+        << conn.id, logging::MEDIUM);
+
+    releaseBody(conn);
+    conn.request.reset();
+    conn.input.clear();
+
+    std::vector<Chunk> chunks;
+    InlineResponder out(chunks);
+    server->errorUnavailable(out, 1);
+    conn.keepAlive = false;
+    conn.state = State::CLOSING;
+    queueOutput(conn, chunks);
+}
+
+/*
+ * stops counting a connection's body against our limit, once it's complete
+ * and handed off, or the connection is gone
+ */
+void EventServer::releaseBody(Connection &conn) {
+    bufferedBodyBytes -= conn.bodyBuffered;
+    conn.bodyBuffered = 0;
+}
+
+/*
+ * handles a fully received request: health checks and counters right here,
+ * anything that may block or take a while, like matches, thumbnails and
+ * flight dumps, on a handler thread
+ */
+void EventServer::dispatch(Connection &conn) {
+    std::shared_ptr<HttpRequest> request = conn.request;
+    request->arrival = logging::timestamp();
+
+    if (isSessionRequest(*request)) {
+        upgrade(conn);
+        return;
+    }
+
+    if (!isInlineRequest(*request)) {
+        conn.state = State::HANDLING;
+        uint64_t id = conn.id;
+
+        {
+            std::lock_guard<std::mutex> guard(jobLock);
+            jobs.push_back([this, id, request]() {
+                QueuedResponder out(this, id);
+                bool failed = false;
+                try {
+                    handleRequest(server, *request, out);
+                }
+                catch (const std::exception &e) {
+                    dlog("handler failed: " << e.what(), logging::HIGH);
+                    failed = true;
+                    if (!out.wroteAnything()) {
+                        server->error(out, 500, "Internal Server Error");
+                    }
+                }
+                out.finish(failed);
+            });
+        }
+        jobReady.notify_one();
+        return;
+    }
+
+    std::vector<Chunk> chunks;
+    InlineResponder out(chunks);
+    try {
+        handleRequest(server, *request, out);
+    }
+    catch (const std::exception &e) {
+        dlog("handler failed: " << e.what(), logging::HIGH);
+        chunks.clear();
+        server->error(out, 500, "Internal Server Error");
+        conn.keepAlive = false;
+    }
+    queueOutput(conn, chunks);
+    finishResponse(conn);
+}
+
+/*
+ * a response is done: on to the next request, if the connection is staying
+ * open
+ */
+void EventServer::finishResponse(Connection &conn) {
+    conn.request.reset();
+    conn.bodyLength = 0;
+    conn.state = conn.keepAlive ? State::READING_HEAD : State::CLOSING;
+
+    if (conn.state == State::CLOSING && conn.output.empty()) {
+        closeConnection(conn.id);
+    }
+}
+
+/*
+ * adds chunks to a connection's output.  they're written from the event
+ * loop, which epoll will have us back in as soon as the socket can take
+ * them, so that nothing that queues output has to cope with the connection
+ * going away underneath it
+ */
+void EventServer::queueOutput(Connection &conn, std::vector<Chunk> &chunks) {
+    for (auto &chunk: chunks) {
+        conn.outputBytes += chunk.size;
+        conn.output.push_back(std::move(chunk));
+    }
+    chunks.clear();
+    updateInterest(conn);
+}
+
+/*
+ * sends as much of our output as the socket will take right now.  the rest
+ * goes out when epoll tells us there's room
+ */
+void EventServer::writeTo(Connection &conn) {
+    while (!conn.output.empty()) {
+        const Chunk &chunk = conn.output.front();
+        ssize_t n = send(conn.fd, chunk.data() + conn.outputOffset,
+            chunk.size - conn.outputOffset, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                closeConnection(conn.id);
+                return;
+            }
+            break;
+        }
+
+        conn.lastActivity = logging::timestamp();
+        metrics::addBytesOut(n);
+        conn.outputOffset += n;
+        conn.outputBytes -= n;
+        if (conn.outputOffset == chunk.size) {
+            conn.output.pop_front();
+            conn.outputOffset = 0;
+        }
+    }
+
+    if (conn.output.empty() && conn.state == State::CLOSING) {
+        closeConnection(conn.id);
+        return;
+    }
+    updateInterest(conn);
+}
+
+/*
+ * we want to read when we're expecting a request and aren't too far behind
+ * on writing, and to write whenever there's something to
+ */
+void EventServer::updateInterest(Connection &conn) {
+    uint32_t wanted = 0;
+    bool reading = conn.state == State::READING_HEAD
+        || conn.state == State::READING_BODY
+        || conn.state == State::WEBSOCKET;
+    if (reading && conn.outputBytes < MAX_PENDING_OUTPUT) {
+        wanted |= EPOLLIN;
+    }
+    if (!conn.output.empty()) {
+        wanted |= EPOLLOUT;
+    }
+
+    if (wanted != conn.events) {
+        epoll_event event;
+        event.events = wanted;
+        event.data.u64 = conn.id;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &event);
+        conn.events = wanted;
+    }
+}
+
+void EventServer::closeConnection(uint64_t id) {
+    auto found = connections.find(id);
+    if (found == connections.end()) {
+        return;
+    }
+    auto &session = found->second->session;
+    if (session) {
+        std::lock_guard<std::mutex> guard(session->lock);
+        session->closed = true;
+        dlog("match session on connection " << id << " ended, "
+            << session->dropped << " frames skipped", logging::MEDIUM);
+    }
+
+    releaseBody(*found->second);
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, found->second->fd, nullptr);
+    close(found->second->fd);
+    connections.erase(found);
+}
+
+/*
+ * called from handler threads.  wakes the event thread up to send what
+ * they've written
+ */
+void EventServer::post(Completion &&completion) {
+    {
+        std::lock_guard<std::mutex> guard(completionLock);
+        completions.push_back(std::move(completion));
+    }
+    uint64_t one = 1;
+    if (::write(wakeFd, &one, sizeof(one)) < 0) {
+        dlog("couldn't wake event thread", logging::HIGH);
+    }
+}
+
+void EventServer::drainCompletions() {
+    std::vector<Completion> ready;
+    {
+        std::lock_guard<std::mutex> guard(completionLock);
+        ready.swap(completions);
+    }
+
+    for (auto &completion: ready) {
+        auto found = connections.find(completion.id);
+        if (found == connections.end()) {
+            continue;
+        }
+        Connection &conn = *found->second;
+
+        if (completion.close) {
+            conn.keepAlive = false;
+        }
+        queueOutput(conn, completion.chunks);
+        if (!completion.done) {
+            continue;
+        }
+
+        finishResponse(conn);
+        if (connections.find(completion.id) != connections.end()) {
+            processInput(conn);
+        }
+    }
+}
+
+/*
+ * closes connections that have gone quiet, whether they're idling between
+ * requests or stalled partway through one.  a connection waiting on its
+ * handler (or a session on its frame being matched) isn't idle, however
+ * long the match takes
+ */
+void EventServer::sweepIdle() {
+    double now = logging::timestamp();
+    std::vector<uint64_t> idle;
+    for (auto &entry: connections) {
+        Connection &conn = *entry.second;
+        if (conn.state == State::HANDLING) {
+            continue;
+        }
+        if (conn.session) {
+            std::lock_guard<std::mutex> guard(conn.session->lock);
+            if (conn.session->busy) {
+                continue;
+            }
+        }
+        if (now - conn.lastActivity > idleTimeout) {
+            idle.push_back(entry.first);
+        }
+    }
+    for (uint64_t id: idle) {
+        closeConnection(id);
+    }
+}
+
+/*
+ * switches a connection over to a WebSocket match session.  sessions send
+ * thumbnail URLs unless they ask otherwise, since inlining a thumbnail in
+ * every frame's result would be a lot to push down a phone's connection
+ */
+void EventServer::upgrade(Connection &conn) {
+    const HttpRequest &request = *conn.request;
+
+    ThumbnailMode thumbnailMode = ThumbnailMode::URL;
+    std::string mode;
+    if (queryParameter(request.queryString, "thumbnail", mode)) {
+        thumbnailMode = requestedThumbnailMode(request);
+    }
+
+    std::vector<Chunk> chunks;
+    InlineResponder out(chunks);
+    out.write(websocket::handshake(request.header("Sec-WebSocket-Key")));
+    queueOutput(conn, chunks);
+
+    conn.session = std::make_shared<Session>(server, thumbnailMode);
+    conn.request.reset();
+    conn.state = State::WEBSOCKET;
+
+    dlog("connection " << conn.id << " started a match session",
+        logging::MEDIUM);
+}
+
+/*
+ * works through whatever frames we've received on a session.  pings are
+ * answered here, and complete messages (which may have come in several
+ * frames) go off to be matched
+ */
+void EventServer::processFrames(Connection &conn) {
+    size_t maxPayload = server->getDecodeLimits().maxBytes;
+
+    while (conn.state == State::WEBSOCKET) {
+        websocket::Frame frame;
+        size_t frameLength = 0;
+        ParseResult result = websocket::decode(conn.input.data(),
+            conn.input.size(), maxPayload, frame, frameLength);
+
+        if (result == ParseResult::INCOMPLETE) {
+            break;
+        }
+        if (result == ParseResult::MALFORMED) {
+            closeWebSocket(conn, 1002);
+            break;
+        }
+        conn.input.erase(0, frameLength);
+
+        std::vector<Chunk> chunks;
+        InlineResponder out(chunks);
+
+        switch (frame.opcode) {
+        case websocket::PING:
+            out.write(websocket::encode(websocket::PONG,
+                frame.payload.data(), frame.payload.size()));
+            queueOutput(conn, chunks);
+            break;
+
+        case websocket::PONG:
+            break;
+
+        case websocket::CLOSE:
+            closeWebSocket(conn, 1000);
+            break;
+
+        case websocket::TEXT:
+        case websocket::BINARY:
+        case websocket::CONTINUATION:
+            if (frame.opcode == websocket::CONTINUATION) {
+                conn.message += frame.payload;
+            }
+            else {
+                conn.message = std::move(frame.payload);
+            }
+
+            if (conn.message.size() > maxPayload) {
+                closeWebSocket(conn, 1009);
+            }
+            else if (frame.fin) {
+                submitFrame(conn, conn.message);
+            }
+            break;
+
+        default:
+            closeWebSocket(conn, 1002);
+            break;
+        }
+    }
+}
+
+/*
+ * sends a close frame with status, and closes the connection once it's out
+ */
+void EventServer::closeWebSocket(Connection &conn, int status) {
+    char payload[2] = {char(status >> 8), char(status & 0xff)};
+
+    std::vector<Chunk> chunks;
+    InlineResponder out(chunks);
+    out.write(websocket::encode(websocket::CLOSE, payload, sizeof(payload)));
+    conn.state = State::CLOSING;
+    queueOutput(conn, chunks);
+
+    std::lock_guard<std::mutex> guard(conn.session->lock);
+    conn.session->closed = true;
+}
+
+/*
+ * hands a frame to the session.  if it's already matching one, the new
+ * frame waits, replacing any that was already waiting: by the time we got
+ * to an older frame, the camera has moved on
+ */
+void EventServer::submitFrame(Connection &conn, std::string &frame) {
+    std::shared_ptr<Session> session = conn.session;
+
+    {
+        std::lock_guard<std::mutex> guard(session->lock);
+        if (session->hasPending) {
+            session->dropped++;
+        }
+        session->pending.swap(frame);
+        session->hasPending = true;
+        frame.clear();
+
+        if (session->busy) {
+            return;
+        }
+        session->busy = true;
+    }
+
+    uint64_t id = conn.id;
+    {
+        std::lock_guard<std::mutex> guard(jobLock);
+        jobs.push_back([this, id, session]() {
+            runSession(id, session);
+        });
+    }
+    jobReady.notify_one();
+}
+
+/*
+ * on a handler thread: matches the session's waiting frames until there
+ * are none left, pushing each result back as soon as we have it
+ */
+void EventServer::runSession(uint64_t id, std::shared_ptr<Session> session) {
+    while (true) {
+        std::string frame;
+        {
+            std::lock_guard<std::mutex> guard(session->lock);
+            if (session->closed || !session->hasPending) {
+                session->busy = false;
+                return;
+            }
+            frame.swap(session->pending);
+            session->hasPending = false;
+        }
+
+        std::string json;
+        try {
+            json = session->matcher.processFrame(
+                reinterpret_cast<const unsigned char *>(frame.data()),
+                frame.size());
+        }
+        catch (const std::exception &e) {
+            dlog("session frame failed: " << e.what(), logging::HIGH);
+            json = "{\"error\": \"internal error\"}";
+        }
+
+        Completion completion{id, {}, false, false};
+        InlineResponder out(completion.chunks);
+        out.write(websocket::encode(websocket::TEXT, json.data(),
+            json.size()));
+        post(std::move(completion));
+    }
+}
+
+void EventServer::handlerLoop() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> guard(jobLock);
+            jobReady.wait(guard, [this]() {
+                return stopping || !jobs.empty();
+            });
+            if (jobs.empty()) {
+                return;
+            }
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+        job();
+    }
+}
@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include "flight_recorder.h"
+#include "descriptor_payload.h"
+#include "image.h"
+#include "logging.h"
+
+
+/*
+ * how many recent latencies the threshold is worked out from, how many we
+ * need before we trust it, and how often it's worked out again
+ */
+const size_t LATENCY_WINDOW = 1024;
+const uint64_t MIN_SAMPLES = 100;
+const uint64_t RECOMPUTE_EVERY = 32;
+
+
+std::string FlightRecord::json() const {
+    std::stringstream buf;
+    buf << std::fixed << std::setprecision(6);
+    buf << "{\"id\": " << id
+        << ", \"kind\": \"" << kind << "\""
+        << ", \"arrival\": " << arrival
+        << ", \"latency\": " << latency
+        << ", \"threshold\": " << threshold
+        << ", \"budget\": " << budget
+        << ", \"stages\": {\"receive\": " << receiveTime
+        << ", \"decode\": " << context.decodeTime
+        << ", \"coarse_extract\": " << context.coarseExtractTime
+        << ", \"coarse_search\": " << context.coarseSearchTime
+        << ", \"refine_extract\": " << context.refineExtractTime
+        << ", \"refine_match\": " << context.refineMatchTime << "}"
+        << ", \"partial\": " << (context.partial ? "true" : "false")
+        << ", \"scanned\": " << context.scanned
+        << ", \"shortlist\": [";
+    for (size_t i=0; i<context.shortlist.size(); i++) {
+        const PotentialMatch &match = context.shortlist[i];
+        buf << (i ? ", " : "") << "{\"id\": " << match.id
+            << ", \"matches\": " << match.details.numMatches << "}";
+    }
+    buf << "], \"load\": {\"queued\": " << load.queued
+        << ", \"running\": " << load.running
+        << ", \"in_flight\": " << load.inFlight << "}"
+        << ", \"thread\": \"" << thread << "\""
+        << ", \"match\": {\"id\": " << matchId
+        << ", \"confidence\": " << confidence
+        << ", \"cached\": " << (cached ? "true" : "false") << "}}";
+    return buf.str();
+}
+
+
+FlightRecorder::FlightRecorder(size_t capacity, double percentile,
+        const path &dumpDir, const std::string &params):
+        capacity(capacity), percentile(percentile), dumpDir(dumpDir),
+        params(params), samples(LATENCY_WINDOW, 0) {
+}
+
+/*
+ * adds a request's latency to our recent ones, and returns true if it's
+ * slower than our percentile of them, with slowerThan set to what it beat
+ */
+bool FlightRecorder::isSlow(double latency, double &slowerThan) {
+    uint64_t seen;
+    {
+        std::lock_guard<std::mutex> guard(samplesLock);
+        samples[numSamples % LATENCY_WINDOW] = latency;
+        seen = ++numSamples;
+
+        /*
+         * worked out as soon as we have enough latencies to go on, so that
+         * nothing's judged against a threshold we haven't set yet
+         */
+        if (seen == MIN_SAMPLES
+                || (seen > MIN_SAMPLES && seen % RECOMPUTE_EVERY == 0)) {
+            std::vector<double> recent(samples.begin(), samples.begin()
+                + std::min<uint64_t>(seen, LATENCY_WINDOW));
+            size_t rank = std::min(recent.size() - 1,
+                size_t(recent.size() * percentile / 100));
+            std::nth_element(recent.begin(), recent.begin() + rank,
+                recent.end());
+            threshold = recent[rank];
+        }
+    }
+
+    slowerThan = threshold;
+    return seen > MIN_SAMPLES && slowerThan > 0 && latency > slowerThan;
+}
+
+void FlightRecorder::keep(FlightRecord &&record) {
+    std::lock_guard<std::mutex> guard(recordsLock);
+    record.id = nextId++;
+    records.push_back(std::move(record));
+    if (records.size() > capacity) {
+        records.pop_front();
+    }
+
+    dlog("kept a " << records.back().latency << "s request in the flight "
+        "recorder", logging::MEDIUM);
+}
+
+/*
+ * writes every record we have to the dump directory: its details as
+ * <id>.json, and its upload as <id>.upload.  returns how many were written
+ */
+size_t FlightRecorder::dump(std::string &error) {
+    std::deque<FlightRecord> snapshot;
+    {
+        std::lock_guard<std::mutex> guard(recordsLock);
+        snapshot = records;
+    }
+
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(dumpDir, ec);
+    if (ec) {
+        error = "couldn't create " + dumpDir.string() + ": " + ec.message();
+        return 0;
+    }
+
+    for (auto &record: snapshot) {
+        path base = dumpDir/std::to_string(record.id);
+
+        std::ofstream upload(base.string() + ".upload", std::ofstream::binary);
+        upload.write(reinterpret_cast<const char *>(record.upload.data()),
+            record.upload.size());
+
+        std::string json = record.json();
+        json.insert(json.size() - 1, ", \"params\": \"" + params + "\"");
+        std::ofstream details(base.string() + ".json");
+        details << json << "\n";
+
+        if (!upload || !details) {
+            error = "couldn't write " + base.string();
+            return 0;
+        }
+    }
+    return snapshot.size();
+}
+
+/*
+ * what we're holding on to, without the uploads
+ */
+std::string FlightRecorder::listJson() {
+    std::lock_guard<std::mutex> guard(recordsLock);
+    std::stringstream buf;
+    buf << "{\"threshold\": " << threshold << ", \"records\": [";
+    bool first = true;
+    for (auto &record: records) {
+        buf << (first ? "" : ", ") << record.json();
+        first = false;
+    }
+    buf << "]}";
+    return buf.str();
+}
+
+const path &FlightRecorder::getDumpDir() const {
+    return dumpDir;
+}
+
+
+/*
+ * runs every dumped record through the engine again, with the same
+ * deadline budget, and logs how the replay compares with what was
+ * recorded.  a replay on an idle machine that's much faster than the
+ * record points at contention rather than at the query itself
+ */
+void replayFlights(const path &dumpDir, const std::vector<Mat> &descriptors,
+        int numBestMatches, float distanceRatioThreshold, SIFT &sifter,
+        SIFT &refineSifter, const SiftParams &coarseParams, int targetLongEdge,
+        const std::string &params, bool multithreaded) {
+
+    std::vector<path> recordFiles;
+    for (dirIt it(dumpDir); it != dirIt(); ++it) {
+        if (it->path().extension() == ".json") {
+            recordFiles.push_back(it->path());
+        }
+    }
+    std::sort(recordFiles.begin(), recordFiles.end());
+
+    for (auto &recordFile: recordFiles) {
+        boost::property_tree::ptree record;
+        try {
+            boost::property_tree::read_json(recordFile.string(), record);
+        }
+        catch (const boost::property_tree::json_parser_error &e) {
+            alog("skipping " << recordFile << ": " << e.what(),
+                logging::HIGH);
+            continue;
+        }
+
+        auto stages = record.get_child_optional("stages");
+        if (!stages) {
+            alog("skipping " << recordFile << ": it has no stage timings",
+                logging::HIGH);
+            continue;
+        }
+
+        if (record.get<std::string>("params", "") != params) {
+            alog(recordFile << " was recorded with different parameters ("
+                << record.get<std::string>("params", "") << "), so timings "
+                "won't compare", logging::HIGH);
+        }
+
+        path uploadFile = recordFile;
+        uploadFile.replace_extension(".upload");
+        std::ifstream handle(uploadFile.string(), std::ifstream::binary);
+        std::vector<unsigned char> upload(
+            (std::istreambuf_iterator<char>(handle)),
+            std::istreambuf_iterator<char>());
+
+        SearchContext context;
+        double budget = record.get<double>("budget", 0);
+        double start = logging::timestamp();
+        if (budget > 0) {
+            context.deadline = start + budget;
+        }
+
+        MatchInfo info;
+        if (record.get<std::string>("kind", "") == "descriptors") {
+            descriptor_payload::Payload payload;
+            std::string error;
+            if (!descriptor_payload::parse(upload.data(), upload.size(),
+                    payload, error)) {
+                alog("skipping " << uploadFile << ": " << error,
+                    logging::HIGH);
+                continue;
+            }
+            Mat coarseQuery = payload.descriptors.rowRange(0,
+                std::min(payload.descriptors.rows, coarseParams.numFeatures));
+            info = findBestMatchForDescriptors(coarseQuery,
+                payload.descriptors, descriptors, numBestMatches,
+                distanceRatioThreshold, multithreaded, context);
+        }
+        else {
+            double decodeStart = logging::timestamp();
+            Mat image = decodeGrayscale(upload.data(), upload.size(),
+                targetLongEdge);
+            context.decodeTime = logging::timestamp() - decodeStart;
+            if (image.empty()) {
+                alog("skipping " << uploadFile << ": couldn't decode it",
+                    logging::HIGH);
+                continue;
+            }
+            info = findBestMatch(image, descriptors, numBestMatches,
+                distanceRatioThreshold, sifter, refineSifter, multithreaded,
+                context);
+        }
+        double elapsed = logging::timestamp() - start;
+
+        alog(recordFile.stem().string() << ": recorded "
+            << record.get<double>("latency", 0) << "s (decode "
+            << stages->get<double>("decode", 0) << ", coarse "
+            << stages->get<double>("coarse_extract", 0) << "+"
+            << stages->get<double>("coarse_search", 0) << ", refine "
+            << stages->get<double>("refine_extract", 0) << "+"
+            << stages->get<double>("refine_match", 0) << ", queued "
+            << record.get<int>("load.queued", 0) << ", in flight "
+            << record.get<int>("load.in_flight", 0) << "), replayed "
+            << elapsed << "s (decode " << context.decodeTime << ", coarse "
+            << context.coarseExtractTime << "+" << context.coarseSearchTime
+            << ", refine " << context.refineExtractTime << "+"
+            << context.refineMatchTime << "), match "
+            << record.get<int>("match.id", -1) << " then, "
+            << info.match.id << " now"
+            << (info.partial ? ", partial" : ""), logging::HIGH);
+    }
+}
@@ -0,0 +1,629 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <tbb/tbb.h>
+
+#include "generate.h"
+#include "hash.h"
+#include "logging.h"
+#include "work_queue.h"
+
+
+namespace fs = boost::filesystem;
+
+
+/*
+ * the manifest lives alongside the descriptors it describes
+ */
+const char *MANIFEST_NAME = "manifest.txt";
+
+/*
+ * how often, in seconds, we log progress and checkpoint the manifest while
+ * generating.  checkpointing is what makes an interrupted run resumable
+ */
+const double PROGRESS_INTERVAL = 5.0;
+const double CHECKPOINT_INTERVAL = 30.0;
+
+
+struct GenerateJob {
+    path imagePath;
+    std::string name;
+    DescriptorManifest::Entry entry;
+};
+
+
+std::string DescriptorManifest::formatEntry(const std::string &name,
+        const Entry &entry) {
+    std::stringstream buf;
+    buf << hashing::hex(entry.hash) << " " << entry.size << " " << entry.mtime
+        << " " << name;
+    return buf.str();
+}
+
+bool DescriptorManifest::parseEntry(const std::string &line, std::string &name,
+        Entry &entry) {
+    std::istringstream fields(line);
+    std::string hash;
+
+    fields >> hash >> entry.size >> entry.mtime;
+    fields.ignore(1);
+    std::getline(fields, name);
+    if (name.empty()) {
+        return false;
+    }
+
+    entry.hash = std::stoull(hash, nullptr, 16);
+    return true;
+}
+
+
+bool DescriptorManifest::load(const path &fileName) {
+    std::ifstream handle(fileName.string());
+    if (!handle) {
+        return false;
+    }
+
+    std::string line;
+    std::getline(handle, line);
+    if (line.compare(0, 7, "params ") != 0) {
+        return false;
+    }
+    params = line.substr(7);
+
+    while (std::getline(handle, line)) {
+        std::string name;
+        Entry entry;
+        if (parseEntry(line, name, entry)) {
+            entries[name] = entry;
+        }
+    }
+    return true;
+}
+
+/*
+ * written to a temporary file and renamed into place, so a crash mid-save
+ * leaves the previous checkpoint intact
+ */
+void DescriptorManifest::save(const path &fileName) const {
+    path tmpFile = fileName.string() + ".tmp";
+    {
+        std::ofstream handle(tmpFile.string());
+        handle << "params " << params << "\n";
+        for (auto &entry: entries) {
+            handle << formatEntry(entry.first, entry.second) << "\n";
+        }
+    }
+    fs::rename(tmpFile, fileName);
+}
+
+
+std::vector<path> findImages(const path &imageDirectory) {
+    std::vector<path> images;
+    std::string validExt = ".jpg";
+
+    for (auto it = recDirIt(imageDirectory); it != recDirIt(); it++) {
+        path imagePath = (*it).path();
+        if (imagePath.extension().string() == validExt) {
+            images.push_back(imagePath);
+        }
+    }
+    std::sort(images.begin(), images.end());
+    return images;
+}
+
+
+std::string formatDuration(double seconds) {
+    int total = int(seconds);
+    std::stringstream buf;
+    if (total >= 3600) {
+        buf << total / 3600 << "h";
+    }
+    if (total >= 60) {
+        buf << (total % 3600) / 60 << "m";
+    }
+    buf << total % 60 << "s";
+    return buf.str();
+}
+
+
+void generateKeypointsAndDescriptors(const path& imagePath,
+        const path& descriptorFile, SIFT &sifter) {
+
+    Mat descriptors;
+    std::vector<KeyPoint> keypoints;
+
+    computeKeypointsAndDescriptors(imagePath, keypoints, descriptors, sifter);
+
+    /*
+     * a descriptor file that exists is assumed to be complete, so we never
+     * want a crash to leave a truncated one behind.  the temporary name is
+     * unique because a requeued work unit can briefly have two workers
+     * writing the same descriptors
+     */
+    path tmpFile = descriptorFile.string()
+        + fs::unique_path(".%%%%-%%%%-%%%%.tmp").string();
+    saveDescriptorsAndKeypoints(tmpFile, descriptors, keypoints);
+    fs::rename(tmpFile, descriptorFile);
+}
+
+
+/*
+ * works out which images in imageDir need their descriptors (re)generated.
+ * manifest is left holding only the entries that are still good, and is saved,
+ * so stale images are only added back once they've been regenerated.  images
+ * that have disappeared drop out of it too
+ */
+std::vector<GenerateJob> planGeneration(const path &imageDir,
+        const path &outputDir, const SiftParams &params, bool multithreaded,
+        DescriptorManifest &manifest) {
+    if (!fs::exists(outputDir)) {
+        fs::create_directories(outputDir);
+    }
+
+    path manifestFile = outputDir/MANIFEST_NAME;
+    bool haveManifest = manifest.load(manifestFile);
+
+    /*
+     * descriptor directories from before we kept a manifest were generated
+     * by trusting any descriptor file that already existed, so we adopt those
+     * files instead of throwing hours of work away
+     */
+    bool adoptExisting = !haveManifest;
+    if (haveManifest && manifest.params != params.str()) {
+        dlog("SIFT parameters changed from \"" << manifest.params << "\" to \""
+            << params.str() << "\", regenerating everything", logging::HIGH);
+        manifest.entries.clear();
+    }
+
+
+    /*
+     * we only rehash an image if its size or mtime changed, and only
+     * regenerate it if its contents did
+     */
+    std::vector<path> images = findImages(imageDir);
+    std::vector<GenerateJob> jobs(images.size());
+    std::vector<char> stale(images.size(), 0);
+
+    auto inspect = [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t i=r.begin(); i!=r.end(); i++) {
+            GenerateJob &job = jobs[i];
+            job.imagePath = images[i];
+            job.name = images[i].filename().string();
+            job.entry.size = fs::file_size(job.imagePath);
+            job.entry.mtime = fs::last_write_time(job.imagePath);
+
+            bool exists = fs::exists(outputDir/(job.name + ".sift"));
+            auto previous = manifest.entries.find(job.name);
+            bool known = exists && previous != manifest.entries.end();
+
+            if (known && previous->second.size == job.entry.size
+                    && previous->second.mtime == job.entry.mtime) {
+                job.entry.hash = previous->second.hash;
+                continue;
+            }
+
+            job.entry.hash = hashing::hashFile(job.imagePath.string());
+            if (known && previous->second.hash == job.entry.hash) {
+                continue;
+            }
+            if (exists && adoptExisting) {
+                continue;
+            }
+            stale[i] = 1;
+        }
+    };
+
+    tbb::blocked_range<size_t> imageRange(0, images.size());
+    if (multithreaded) {
+        tbb::parallel_for(imageRange, inspect);
+    }
+    else {
+        inspect(imageRange);
+    }
+
+
+    std::vector<GenerateJob> work;
+    manifest.params = params.str();
+    manifest.entries.clear();
+    for (size_t i=0; i<jobs.size(); i++) {
+        if (stale[i]) {
+            work.push_back(jobs[i]);
+        }
+        else {
+            manifest.entries[jobs[i].name] = jobs[i].entry;
+        }
+    }
+    manifest.save(manifestFile);
+
+    dlog(images.size() << " images, " << work.size() << " need generating",
+        logging::HIGH);
+
+    return work;
+}
+
+
+/*
+ * generates descriptors for every job, spread across all cores with one
+ * extractor per thread.  finished is called from whichever thread finished
+ * the job, so it needs to be thread safe
+ */
+void processJobs(const std::vector<GenerateJob> &work, const path &outputDir,
+        const SiftParams &params, bool multithreaded,
+        std::function<void(const GenerateJob &)> finished) {
+
+    tbb::enumerable_thread_specific<SIFT> sifters([&params]() {
+        return params.create();
+    });
+
+    auto generate = [&](const tbb::blocked_range<size_t> &r) {
+        SIFT &sifter = sifters.local();
+
+        for (size_t i=r.begin(); i!=r.end(); i++) {
+            const GenerateJob &job = work[i];
+            generateKeypointsAndDescriptors(job.imagePath,
+                outputDir/(job.name + ".sift"), sifter);
+            finished(job);
+        }
+    };
+
+    tbb::blocked_range<size_t> workRange(0, work.size(), 1);
+    if (multithreaded) {
+        tbb::parallel_for(workRange, generate);
+    }
+    else {
+        generate(workRange);
+    }
+}
+
+
+/*
+ * where descriptors generated with a given cap and blur sigma live, under
+ * base.  the other SIFT parameters have never changed, so they aren't part
+ * of the name
+ */
+path descriptorDirectory(const path &base, int maxTrainDescriptors,
+        float sigma) {
+    std::stringstream name;
+    name << "descriptors-" << maxTrainDescriptors << "-"
+        << std::setprecision(2) << sigma;
+    return base/name.str();
+}
+
+
+/*
+ * takes a directory of training designs and computes keypoints and descriptors
+ * for all of those images.  only images that are new, have changed since the
+ * last run, or were generated with different SIFT parameters are processed,
+ * and the processing is spread across all cores, each with its own extractor
+ */
+void generateDescriptors(const path &imageDir, const path &outputDir,
+        const SiftParams &params, bool multithreaded) {
+
+    path manifestFile = outputDir/MANIFEST_NAME;
+    DescriptorManifest manifest;
+    std::vector<GenerateJob> work = planGeneration(imageDir, outputDir, params,
+        multithreaded, manifest);
+
+    std::mutex manifestLock;
+    std::mutex progressLock;
+    std::atomic_int done(0);
+    int total = work.size();
+    double start = logging::timestamp();
+    double lastProgress = start;
+    double lastCheckpoint = start;
+
+    /*
+     * whichever thread happens to finish an image when a report is due does
+     * the reporting; everyone else carries on
+     */
+    auto reportProgress = [&](int completed) {
+        std::unique_lock<std::mutex> lock(progressLock, std::try_to_lock);
+        if (!lock.owns_lock()) {
+            return;
+        }
+
+        double now = logging::timestamp();
+        if (now - lastProgress >= PROGRESS_INTERVAL) {
+            double rate = completed / (now - start);
+            alog("generated " << completed << "/" << total << " ("
+                << std::setprecision(1) << (100.0 * completed / total)
+                << "%), " << std::setprecision(2) << rate << " images/s, eta "
+                << formatDuration((total - completed) / rate), logging::HIGH);
+            lastProgress = now;
+        }
+        if (now - lastCheckpoint >= CHECKPOINT_INTERVAL) {
+            std::lock_guard<std::mutex> manifestGuard(manifestLock);
+            manifest.save(manifestFile);
+            lastCheckpoint = now;
+        }
+    };
+
+    processJobs(work, outputDir, params, multithreaded,
+            [&](const GenerateJob &job) {
+        {
+            std::lock_guard<std::mutex> manifestGuard(manifestLock);
+            manifest.entries[job.name] = job.entry;
+        }
+        reportProgress(++done);
+    });
+
+    manifest.save(manifestFile);
+
+    alog("generated " << total << " descriptor files in "
+        << formatDuration(logging::timestamp() - start) << ", "
+        << (manifest.entries.size() - total) << " were up to date",
+        logging::HIGH);
+}
+
+
+/*
+ * folds the results of every finished work unit in the spool into the
+ * manifest
+ */
+void mergeSpoolResults(const WorkQueue &queue, DescriptorManifest &manifest) {
+    for (auto &unit: queue.doneUnits()) {
+        for (auto &line: queue.results(unit)) {
+            std::string name;
+            DescriptorManifest::Entry entry;
+            if (DescriptorManifest::parseEntry(line, name, entry)) {
+                manifest.entries[name] = entry;
+            }
+        }
+    }
+}
+
+std::string spoolParams(const WorkQueue &queue) {
+    for (auto &line: queue.header()) {
+        if (line.compare(0, 7, "params ") == 0) {
+            return line.substr(7);
+        }
+    }
+    return "";
+}
+
+pid_t launchWorker(const std::vector<std::string> &command) {
+    std::vector<char *> args;
+    for (auto &arg: command) {
+        args.push_back(const_cast<char *>(arg.c_str()));
+    }
+    args.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(args[0], args.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+
+/*
+ * plans the same work generateDescriptors would do, but rather than doing it
+ * ourselves, splits it into units in a spool directory for any number of
+ * --worker processes to pick up.  we wait for all of the units to finish,
+ * requeueing any whose worker stopped heartbeating, then merge the results
+ * into the manifest
+ */
+void coordinateGeneration(const path &imageDir, const path &outputDir,
+        const SiftParams &params, const SpoolOptions &spool,
+        bool multithreaded) {
+
+    WorkQueue queue(spool.spoolDir, spool.leaseSeconds);
+    path manifestFile = outputDir/MANIFEST_NAME;
+
+    /*
+     * a previous coordinator may have died with finished units still sitting
+     * in the spool.  that work is good, so keep it
+     */
+    if (queue.exists() && spoolParams(queue) == params.str()) {
+        DescriptorManifest previous;
+        if (previous.load(manifestFile) && previous.params == params.str()) {
+            mergeSpoolResults(queue, previous);
+            previous.save(manifestFile);
+        }
+    }
+
+    DescriptorManifest manifest;
+    std::vector<GenerateJob> work = planGeneration(imageDir, outputDir, params,
+        multithreaded, manifest);
+    if (work.empty()) {
+        alog("all descriptors are up to date", logging::HIGH);
+        return;
+    }
+
+    queue.create({"params " + params.str()});
+
+    std::string imagePrefix = imageDir.string() + "/";
+    int numUnits = 0;
+    for (size_t i=0; i<work.size(); i+=spool.unitSize) {
+        std::vector<std::string> lines;
+        for (size_t j=i; j<std::min(work.size(), i+spool.unitSize); j++) {
+            std::string relative = work[j].imagePath.string()
+                .substr(imagePrefix.size());
+            lines.push_back(DescriptorManifest::formatEntry(relative,
+                work[j].entry));
+        }
+
+        char unit[32];
+        snprintf(unit, sizeof(unit), "unit-%06d", numUnits++);
+        queue.add(unit, lines);
+    }
+    alog("spooled " << work.size() << " images as " << numUnits
+        << " units in " << spool.spoolDir, logging::HIGH);
+
+
+    std::vector<pid_t> localWorkers;
+    for (int i=0; i<spool.localWorkers; i++) {
+        localWorkers.push_back(launchWorker(spool.workerCommand));
+    }
+
+
+    double start = logging::timestamp();
+    double lastProgress = start;
+    int numDone = 0;
+    bool warnedNoWorkers = false;
+
+    while (numDone < numUnits) {
+        sleep(1);
+        queue.reapExpired();
+        numDone = queue.doneUnits().size();
+
+        for (auto &pid: localWorkers) {
+            if (pid > 0 && waitpid(pid, nullptr, WNOHANG) == pid) {
+                pid = 0;
+            }
+        }
+        bool localRunning = std::any_of(localWorkers.begin(),
+            localWorkers.end(), [](pid_t pid) { return pid > 0; });
+        if (!localWorkers.empty() && !localRunning && numDone < numUnits
+                && !warnedNoWorkers) {
+            alog("all local workers have exited with " << (numUnits - numDone)
+                << " units left, waiting on remote workers", logging::HIGH);
+            warnedNoWorkers = true;
+        }
+
+        double now = logging::timestamp();
+        if (numDone > 0 && now - lastProgress >= PROGRESS_INTERVAL) {
+            double rate = numDone / (now - start);
+            alog(numDone << "/" << numUnits << " units done, "
+                << queue.numClaimed() << " in progress, eta "
+                << formatDuration((numUnits - numDone) / rate), logging::HIGH);
+            lastProgress = now;
+        }
+    }
+
+    mergeSpoolResults(queue, manifest);
+    manifest.save(manifestFile);
+    queue.destroy();
+
+    for (auto pid: localWorkers) {
+        if (pid > 0) {
+            waitpid(pid, nullptr, 0);
+        }
+    }
+
+    alog("generated " << work.size() << " descriptor files in "
+        << formatDuration(logging::timestamp() - start), logging::HIGH);
+}
+
+
+/*
+ * claims units from the spool and generates their descriptors until there's
+ * nothing left.  while we're working on a unit, a background thread keeps
+ * our lease on it alive
+ */
+bool runGenerationWorker(const path &imageDir, const path &outputDir,
+        const SiftParams &params, const SpoolOptions &spool,
+        bool multithreaded) {
+
+    WorkQueue queue(spool.spoolDir, spool.leaseSeconds);
+
+    if (!queue.exists()) {
+        alog("no generation job in " << spool.spoolDir, logging::HIGH);
+        return false;
+    }
+    if (spoolParams(queue) != params.str()) {
+        alog("spooled job uses SIFT parameters \"" << spoolParams(queue)
+            << "\", but we have \"" << params.str() << "\"", logging::HIGH);
+        return false;
+    }
+
+    int unitsDone = 0;
+    while (queue.exists()) {
+        queue.reapExpired();
+
+        std::string unit;
+        std::vector<std::string> lines;
+        if (!queue.claim(unit, lines)) {
+            if (queue.numPending() == 0 && queue.numClaimed() == 0) {
+                break;
+            }
+            sleep(1);
+            continue;
+        }
+
+        std::vector<GenerateJob> work;
+        for (auto &line: lines) {
+            GenerateJob job;
+            std::string relative;
+            if (DescriptorManifest::parseEntry(line, relative, job.entry)) {
+                job.imagePath = imageDir/relative;
+                job.name = job.imagePath.filename().string();
+                work.push_back(job);
+            }
+        }
+
+
+        std::mutex heartbeatLock;
+        std::condition_variable stopHeartbeat;
+        bool finished = false;
+        std::thread heartbeat([&]() {
+            std::unique_lock<std::mutex> lock(heartbeatLock);
+            auto interval = std::chrono::milliseconds(
+                int(spool.leaseSeconds * 1000 / 3));
+            while (!stopHeartbeat.wait_for(lock, interval,
+                    [&]() { return finished; })) {
+                queue.heartbeat(unit);
+            }
+        });
+
+        std::mutex resultsLock;
+        std::vector<std::string> results;
+        processJobs(work, outputDir, params, multithreaded,
+                [&](const GenerateJob &job) {
+            std::lock_guard<std::mutex> guard(resultsLock);
+            results.push_back(DescriptorManifest::formatEntry(job.name,
+                job.entry));
+        });
+
+        {
+            std::lock_guard<std::mutex> guard(heartbeatLock);
+            finished = true;
+        }
+        stopHeartbeat.notify_one();
+        heartbeat.join();
+
+        if (queue.complete(unit, results)) {
+            unitsDone++;
+            dlog(queue.owner() << " finished " << unit << " (" << work.size()
+                << " images)", logging::HIGH);
+        }
+    }
+
+    alog(queue.owner() << " finished " << unitsDone << " units", logging::HIGH);
+    return true;
+}
@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <strings.h>
+
+#include "http.h"
+
+
+/*
+ * header names are case insensitive.  returns nullptr if there's no such
+ * header
+ */
+const char *HttpRequest::header(const std::string &name) const {
+    for (auto &header: headers) {
+        if (strcasecmp(header.first.c_str(), name.c_str()) == 0) {
+            return header.second.c_str();
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * HTTP/1.1 connections stay open unless the client says otherwise, and
+ * HTTP/1.0 ones close unless it asks for them not to
+ */
+bool HttpRequest::keepAlive() const {
+    const char *connection = header("Connection");
+    if (connection && strcasecmp(connection, "close") == 0) {
+        return false;
+    }
+    if (version == "1.0") {
+        return connection && strcasecmp(connection, "keep-alive") == 0;
+    }
+    return true;
+}
+
+
+ChunkedWriter::ChunkedWriter(Responder &out): out(out) {
+}
+
+void ChunkedWriter::write(const std::string &data) {
+    if (data.empty()) {
+        return;
+    }
+
+    char size[20];
+    snprintf(size, sizeof(size), "%zx\r\n", data.size());
+    out.write(size + data + "\r\n");
+    out.flush();
+}
+
+void ChunkedWriter::finish() {
+    out.write(std::string("0\r\n\r\n"));
+}
+
+
+std::string trim(const std::string &str) {
+    size_t begin = str.find_first_not_of(" \t");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    size_t end = str.find_last_not_of(" \t");
+    return str.substr(begin, end - begin + 1);
+}
+
+
+/*
+ * parses a request line and headers from the start of data.  on COMPLETE,
+ * request has them, and headLength is how many bytes of data they took up,
+ * so that the body (or the next pipelined request) starts right after
+ */
+ParseResult parseRequestHead(const char *data, size_t size,
+        HttpRequest &request, size_t &headLength) {
+
+    const char *headEnd = "\r\n\r\n";
+    const char *end = std::search(data, data + size, headEnd, headEnd + 4);
+    if (end == data + size) {
+        return ParseResult::INCOMPLETE;
+    }
+    headLength = end - data + 4;
+
+    std::string head(data, end);
+    size_t lineEnd = head.find("\r\n");
+    std::string requestLine = head.substr(0, lineEnd);
+
+    size_t methodEnd = requestLine.find(' ');
+    size_t uriEnd = requestLine.rfind(' ');
+    if (methodEnd == std::string::npos || uriEnd == methodEnd
+            || requestLine.compare(uriEnd + 1, 5, "HTTP/") != 0) {
+        return ParseResult::MALFORMED;
+    }
+
+    request.method = requestLine.substr(0, methodEnd);
+    request.version = requestLine.substr(uriEnd + 6);
+    std::string target = requestLine.substr(methodEnd + 1,
+        uriEnd - methodEnd - 1);
+
+    size_t queryStart = target.find('?');
+    if (queryStart != std::string::npos) {
+        request.queryString = target.substr(queryStart + 1);
+        target = target.substr(0, queryStart);
+    }
+    request.uri = urlDecode(target);
+
+    request.headers.clear();
+    size_t pos = lineEnd;
+    while (pos != std::string::npos && pos < head.size()) {
+        pos += 2;
+        size_t next = head.find("\r\n", pos);
+        std::string line = head.substr(pos, next == std::string::npos
+            ? std::string::npos : next - pos);
+        pos = next;
+
+        size_t colon = line.find(':');
+        if (colon == std::string::npos || colon == 0) {
+            return ParseResult::MALFORMED;
+        }
+        request.headers.emplace_back(line.substr(0, colon),
+            trim(line.substr(colon + 1)));
+    }
+    return ParseResult::COMPLETE;
+}
+
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+/*
+ * undoes percent encoding.  in a form (a query string), a + is a space too
+ */
+std::string urlDecode(const std::string &encoded, bool form) {
+    std::string decoded;
+    for (size_t i=0; i<encoded.size(); i++) {
+        if (encoded[i] == '%' && i + 2 < encoded.size()
+                && hexValue(encoded[i + 1]) >= 0
+                && hexValue(encoded[i + 2]) >= 0) {
+            decoded += char(hexValue(encoded[i + 1]) * 16
+                + hexValue(encoded[i + 2]));
+            i += 2;
+        }
+        else if (form && encoded[i] == '+') {
+            decoded += ' ';
+        }
+        else {
+            decoded += encoded[i];
+        }
+    }
+    return decoded;
+}
+
+/*
+ * finds name=value in a query string and URL decodes the value.  returns
+ * false if name isn't there
+ */
+bool queryParameter(const std::string &query, const std::string &name,
+        std::string &value) {
+    size_t pos = 0;
+    while (pos <= query.size()) {
+        size_t end = query.find('&', pos);
+        if (end == std::string::npos) {
+            end = query.size();
+        }
+
+        std::string pair = query.substr(pos, end - pos);
+        size_t equals = pair.find('=');
+        if (urlDecode(pair.substr(0, equals), true) == name) {
+            value = equals == std::string::npos ? ""
+                : urlDecode(pair.substr(equals + 1), true);
+            return true;
+        }
+        pos = end + 1;
+    }
+    return false;
+}
+
+
+/*
+ * a quoted JSON string, for text that comes from clients and so can't be
+ * trusted not to contain quotes or control characters
+ */
+std::string jsonString(const std::string &str) {
+    std::string quoted = "\"";
+    for (unsigned char c: str) {
+        if (c == '"' || c == '\\') {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if (c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        }
+        else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
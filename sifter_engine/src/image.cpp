@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <algorithm>
+
+#include "image.h"
+
+
+#ifdef USE_LIBJPEG
+
+#include <csetjmp>
+#include <cstdio>
+
+#include <jpeglib.h>
+
+
+struct JpegError {
+    jpeg_error_mgr manager;
+    jmp_buf escape;
+};
+
+void jpegErrorExit(j_common_ptr cinfo) {
+    JpegError *error = reinterpret_cast<JpegError *>(cinfo->err);
+    longjmp(error->escape, 1);
+}
+
+void jpegSilence(j_common_ptr) {
+}
+
+
+/*
+ * decodes a JPEG to grayscale, letting libjpeg scale it down by 1/2, 1/4 or
+ * 1/8 as it goes.  that happens in the DCT domain, so it's much cheaper than
+ * decoding at full size and resizing: we skip most of the IDCT and never
+ * touch the full-size pixels at all.  we pick the largest reduction that
+ * keeps the long edge at or above targetLongEdge.  out is a reference rather
+ * than our own local so that it's still well defined after a longjmp
+ */
+bool decodeJpeg(const unsigned char *data, size_t size, int targetLongEdge,
+        cv::Mat &out) {
+    jpeg_decompress_struct cinfo;
+    JpegError error;
+
+    cinfo.err = jpeg_std_error(&error.manager);
+    error.manager.error_exit = jpegErrorExit;
+    error.manager.output_message = jpegSilence;
+
+    if (setjmp(error.escape)) {
+        jpeg_destroy_decompress(&cinfo);
+        out.release();
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<unsigned char *>(data), size);
+    jpeg_read_header(&cinfo, TRUE);
+
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+    if (targetLongEdge > 0) {
+        int longEdge = std::max(cinfo.image_width, cinfo.image_height);
+        for (int denom = 8; denom > 1; denom /= 2) {
+            if (longEdge / denom >= targetLongEdge) {
+                cinfo.scale_denom = denom;
+                break;
+            }
+        }
+    }
+
+    jpeg_start_decompress(&cinfo);
+    out.create(cinfo.output_height, cinfo.output_width, CV_8UC1);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = out.ptr(cinfo.output_scanline);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+#endif
+
+
+/*
+ * decodes an encoded image straight from memory into the single grayscale
+ * channel that SIFT works on, scaled down so its long edge is at most
+ * targetLongEdge (0 leaves it at full size).  JPEGs are scaled while they're
+ * decoded where libjpeg is available; anything else is decoded at full size
+ * and then resized.  returns an empty Mat if it can't be decoded
+ */
+cv::Mat decodeGrayscale(const unsigned char *data, size_t size,
+        int targetLongEdge) {
+    if (size == 0) {
+        return cv::Mat();
+    }
+
+    cv::Mat decoded;
+
+#ifdef USE_LIBJPEG
+    int width, height;
+    if (!jpegDimensions(data, size, width, height)
+            || !decodeJpeg(data, size, targetLongEdge, decoded)) {
+        decoded.release();
+    }
+#endif
+
+    if (decoded.empty()) {
+        cv::Mat encoded(1, size, CV_8UC1, const_cast<unsigned char *>(data));
+        decoded = cv::imdecode(encoded, CV_LOAD_IMAGE_GRAYSCALE);
+    }
+
+    int longEdge = std::max(decoded.cols, decoded.rows);
+    if (targetLongEdge > 0 && longEdge > targetLongEdge) {
+        double scale = double(targetLongEdge) / longEdge;
+        cv::Mat resized;
+        cv::resize(decoded, resized, cv::Size(), scale, scale, cv::INTER_AREA);
+        decoded = resized;
+    }
+    return decoded;
+}
+
+
+/*
+ * reads an image's dimensions from its header, for the formats phones
+ * actually send us.  returns false if it's not one we know
+ */
+bool imageDimensions(const unsigned char *data, size_t size, int &width,
+        int &height) {
+    if (jpegDimensions(data, size, width, height)) {
+        return true;
+    }
+
+    /*
+     * PNG: the 8 byte signature, then IHDR, whose first fields are the
+     * big-endian width and height
+     */
+    const unsigned char pngSignature[] = {0x89, 'P', 'N', 'G', '\r', '\n',
+        0x1a, '\n'};
+    if (size >= 24 && std::equal(pngSignature, pngSignature + 8, data)) {
+        width = (data[16] << 24) | (data[17] << 16) | (data[18] << 8) | data[19];
+        height = (data[20] << 24) | (data[21] << 16) | (data[22] << 8)
+            | data[23];
+        return width > 0 && height > 0;
+    }
+    return false;
+}
+
+
+/*
+ * reads an image's dimensions out of its JPEG header, by walking the marker
+ * segments until we hit a start-of-frame.  that's a few bytes of reading
+ * instead of a full decode.  returns false if this doesn't look like a JPEG
+ */
+bool jpegDimensions(const unsigned char *data, size_t size, int &width,
+        int &height) {
+    if (size < 4 || data[0] != 0xff || data[1] != 0xd8) {
+        return false;
+    }
+
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xff) {
+            return false;
+        }
+
+        unsigned char marker = data[pos + 1];
+        /*
+         * padding, and markers that stand alone without a length
+         */
+        if (marker == 0xff) {
+            pos++;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+            pos += 2;
+            continue;
+        }
+
+        size_t length = (data[pos + 2] << 8) | data[pos + 3];
+        if (length < 2) {
+            return false;
+        }
+
+        /*
+         * every SOFn except DHT (c4), JPG (c8) and DAC (cc)
+         */
+        bool startOfFrame = marker >= 0xc0 && marker <= 0xcf
+            && marker != 0xc4 && marker != 0xc8 && marker != 0xcc;
+        if (startOfFrame) {
+            if (pos + 9 > size) {
+                return false;
+            }
+            height = (data[pos + 5] << 8) | data[pos + 6];
+            width = (data[pos + 7] << 8) | data[pos + 8];
+            return width > 0 && height > 0;
+        }
+
+        /*
+         * start of scan means we've missed the frame header somehow
+         */
+        if (marker == 0xda) {
+            return false;
+        }
+        pos += 2 + length;
+    }
+    return false;
+}
+
+
+/*
+ * a DCT perceptual hash: the image is shrunk to 32x32, and each of the 8x8
+ * lowest frequencies (less the DC term, which is just brightness) becomes a
+ * bit, set if it's above their median.  recompression, rescaling and small
+ * shifts in exposure barely move those frequencies, so the same photo
+ * re-uploaded, or a near-identical one, hashes to within a few bits
+ */
+uint64_t perceptualHash(const cv::Mat &gray) {
+    if (gray.empty()) {
+        return 0;
+    }
+
+    cv::Mat small, pixels, frequencies;
+    cv::resize(gray, small, cv::Size(32, 32), 0, 0, cv::INTER_AREA);
+    small.convertTo(pixels, CV_32F);
+    cv::dct(pixels, frequencies);
+
+    float lowest[64];
+    for (int y=0; y<8; y++) {
+        for (int x=0; x<8; x++) {
+            lowest[y * 8 + x] = frequencies.at<float>(y, x);
+        }
+    }
+
+    float sorted[63];
+    std::copy(lowest + 1, lowest + 64, sorted);
+    std::nth_element(sorted, sorted + 31, sorted + 63);
+    float median = sorted[31];
+
+    uint64_t hash = 0;
+    for (int i=1; i<64; i++) {
+        if (lowest[i] > median) {
+            hash |= uint64_t(1) << i;
+        }
+    }
+    return hash;
+}
+
+int hammingDistance(uint64_t a, uint64_t b) {
+    return __builtin_popcountll(a ^ b);
+}
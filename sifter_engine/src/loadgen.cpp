@@ -0,0 +1,596 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * replays a directory of images against a running server's /match, and
+ * reports how it held up.  the images are named by the design they're of,
+ * the same as --test's, so every answer can be checked as well as timed.
+ *
+ * with --rate, requests go out on a fixed schedule whether or not earlier
+ * ones have come back (open loop), and latency is counted from when each was
+ * due, so a stalled server shows up as latency rather than as fewer
+ * requests.  otherwise --concurrency clients each send their next request as
+ * soon as the last one is answered (closed loop)
+ */
+
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <vector>
+#include <map>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <random>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+#include "logging.h"
+
+namespace fs = boost::filesystem;
+
+
+struct TestImage {
+    fs::path file;
+    std::vector<unsigned char> bytes;
+
+    /*
+     * the design it's of, from its filename, or -1 if it isn't named by one
+     */
+    int id = -1;
+};
+
+struct Sample {
+    /*
+     * the HTTP status, or 0 if we never got one (connection refused, reset,
+     * timed out or unparseable)
+     */
+    int status = 0;
+    double latency = 0;
+    bool judged = false;
+    bool correct = false;
+};
+
+struct Response {
+    int status = 0;
+    bool close = false;
+    std::string body;
+};
+
+
+/*
+ * a keep-alive HTTP/1.1 connection to the server, just enough of a client
+ * for our own responses, which always have a Content-Length
+ */
+class Connection {
+public:
+    Connection(const std::string &host, int port, double timeout):
+        host(host), port(port), timeout(timeout) {}
+    ~Connection() {
+        disconnect();
+    }
+
+    bool request(const std::string &head, const std::vector<unsigned char> &body,
+            Response &response) {
+        if (fd < 0 && !connectToServer()) {
+            return false;
+        }
+        if (!sendAll(head.data(), head.size())
+                || !sendAll(body.data(), body.size())
+                || !readResponse(response)) {
+            disconnect();
+            return false;
+        }
+        if (response.close) {
+            disconnect();
+        }
+        return true;
+    }
+
+    void disconnect() {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+        buffer.clear();
+    }
+
+private:
+    bool connectToServer() {
+        addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        addrinfo *addrs = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints,
+                &addrs) != 0) {
+            return false;
+        }
+
+        for (addrinfo *addr = addrs; addr; addr = addr->ai_next) {
+            fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (fd < 0) {
+                continue;
+            }
+            if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+                break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(addrs);
+
+        if (fd < 0) {
+            return false;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        timeval tv;
+        tv.tv_sec = long(timeout);
+        tv.tv_usec = long((timeout - tv.tv_sec) * 1000000);
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        return true;
+    }
+
+    bool sendAll(const void *data, size_t size) {
+        const char *pos = static_cast<const char *>(data);
+        while (size > 0) {
+            ssize_t sent = send(fd, pos, size, MSG_NOSIGNAL);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                return false;
+            }
+            pos += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    bool fill() {
+        char chunk[16384];
+        while (true) {
+            ssize_t got = recv(fd, chunk, sizeof(chunk), 0);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            buffer.append(chunk, got);
+            return true;
+        }
+    }
+
+    bool readResponse(Response &response) {
+        size_t headEnd;
+        while ((headEnd = buffer.find("\r\n\r\n")) == std::string::npos) {
+            if (!fill()) {
+                return false;
+            }
+        }
+
+        std::string head = buffer.substr(0, headEnd);
+        buffer.erase(0, headEnd + 4);
+
+        size_t space = head.find(' ');
+        if (head.compare(0, 5, "HTTP/") != 0 || space == std::string::npos) {
+            return false;
+        }
+        response.status = atoi(head.c_str() + space + 1);
+        response.close = head.compare(0, 8, "HTTP/1.0") == 0;
+
+        long long length = -1;
+        std::istringstream lines(head);
+        std::string line;
+        std::getline(lines, line);
+        while (std::getline(lines, line)) {
+            size_t colon = line.find(':');
+            if (colon == std::string::npos) {
+                continue;
+            }
+            std::string name = line.substr(0, colon);
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            const char *value = line.c_str() + colon + 1;
+
+            if (name == "content-length") {
+                length = atoll(value);
+            }
+            else if (name == "connection") {
+                response.close = strcasestr(value, "close") != nullptr;
+            }
+        }
+
+        /*
+         * without a length, the body runs until the server hangs up
+         */
+        if (length < 0) {
+            while (fill()) {}
+            response.body.swap(buffer);
+            response.close = true;
+            return true;
+        }
+
+        while (buffer.size() < size_t(length)) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        response.body = buffer.substr(0, length);
+        buffer.erase(0, length);
+        return true;
+    }
+
+    std::string host;
+    int port;
+    double timeout;
+    int fd = -1;
+    std::string buffer;
+};
+
+
+/*
+ * the design id out of a match response, or -1 if there isn't one
+ */
+int matchedId(const std::string &json) {
+    size_t pos = json.find("\"id\":");
+    if (pos == std::string::npos) {
+        return -1;
+    }
+    return atoi(json.c_str() + pos + 5);
+}
+
+
+std::vector<TestImage> loadImages(const fs::path &dir) {
+    std::vector<TestImage> images;
+
+    for (auto it = fs::recursive_directory_iterator(dir);
+            it != fs::recursive_directory_iterator(); it++) {
+        fs::path file = (*it).path();
+        if (file.extension().string() != ".jpg") {
+            continue;
+        }
+
+        TestImage image;
+        image.file = file;
+        std::ifstream handle(file.string(), std::ifstream::binary);
+        image.bytes.assign(std::istreambuf_iterator<char>(handle),
+            std::istreambuf_iterator<char>());
+
+        std::string stem = file.stem().string();
+        if (!stem.empty() && std::all_of(stem.begin(), stem.end(), ::isdigit)) {
+            image.id = std::stoi(stem);
+        }
+        images.push_back(std::move(image));
+    }
+
+    /*
+     * directory order isn't stable, and we want runs to replay the same
+     * sequence
+     */
+    std::sort(images.begin(), images.end(),
+        [](const TestImage &a, const TestImage &b) { return a.file < b.file; });
+    return images;
+}
+
+
+/*
+ * percentile of sorted values, by nearest rank
+ */
+double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t rank = size_t(std::ceil(p / 100.0 * sorted.size()));
+    rank = std::max(size_t(1), std::min(rank, sorted.size()));
+    return sorted[rank - 1];
+}
+
+
+int main(int argc, char** argv) {
+    std::string host;
+    int port;
+    std::string imagesDir;
+    std::string path;
+    double rate;
+    int concurrency;
+    int connections;
+    double duration;
+    double warmup;
+    long long maxRequests;
+    double timeout;
+    int deadlineMs;
+    int seed;
+    std::string out;
+
+    namespace opt = boost::program_options;
+    opt::options_description desc("Options");
+    desc.add_options()
+        ("help", "help message")
+        ("host", opt::value<std::string>(&host)->default_value("127.0.0.1"),
+            "server to load")
+        ("port", opt::value<int>(&port)->default_value(8080),
+            "server's port")
+        ("images", opt::value<std::string>(&imagesDir),
+            "directory of .jpg images to replay, named by design id, like "
+            "test_images/")
+        ("path", opt::value<std::string>(&path)->default_value("/match"),
+            "path, and query string if any, to post the images to")
+        ("rate", opt::value<double>(&rate)->default_value(0),
+            "requests per second to send on a fixed schedule (open loop).  0 "
+            "sends closed loop, with --concurrency")
+        ("concurrency", opt::value<int>(&concurrency)->default_value(8),
+            "clients sending back to back, when there's no --rate")
+        ("connections", opt::value<int>(&connections)->default_value(256),
+            "most requests outstanding at once, with --rate.  requests due "
+            "when all are busy go out late, and the lateness counts in their "
+            "latency")
+        ("duration", opt::value<double>(&duration)->default_value(30),
+            "seconds to send for, after warmup")
+        ("warmup", opt::value<double>(&warmup)->default_value(0),
+            "seconds to send for first, without counting the results")
+        ("requests", opt::value<long long>(&maxRequests)->default_value(0),
+            "stop after this many requests, counting warmup.  0 for no limit")
+        ("timeout", opt::value<double>(&timeout)->default_value(30),
+            "seconds to wait on the server before counting an error")
+        ("deadline-ms", opt::value<int>(&deadlineMs)->default_value(0),
+            "send an X-Deadline-Ms header with each request")
+        ("seed", opt::value<int>(&seed)->default_value(1),
+            "seed for the order the images are replayed in")
+        ("out", opt::value<std::string>(&out),
+            "write the JSON results here instead of to stdout")
+    ;
+
+    opt::variables_map options;
+    opt::store(opt::parse_command_line(argc, argv, desc), options);
+    opt::notify(options);
+
+    if (options.count("help")) {
+        std::cout << desc << "\n";
+        return 1;
+    }
+
+    if (imagesDir.empty() || !fs::is_directory(imagesDir)) {
+        std::cerr << "please specify a directory of images with --images\n";
+        return 1;
+    }
+
+    std::vector<TestImage> images = loadImages(imagesDir);
+    if (images.empty()) {
+        std::cerr << "no .jpg images in " << imagesDir << "\n";
+        return 1;
+    }
+
+    std::vector<size_t> order(images.size());
+    for (size_t i=0; i<order.size(); i++) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937(seed));
+
+    std::vector<std::string> heads(images.size());
+    for (size_t i=0; i<images.size(); i++) {
+        std::stringstream head;
+        head << "POST " << path << " HTTP/1.1\r\n"
+            << "Host: " << host << ":" << port << "\r\n"
+            << "Content-Type: image/jpeg\r\n"
+            << "Content-Length: " << images[i].bytes.size() << "\r\n";
+        if (deadlineMs > 0) {
+            head << "X-Deadline-Ms: " << deadlineMs << "\r\n";
+        }
+        head << "\r\n";
+        heads[i] = head.str();
+    }
+
+
+    bool openLoop = rate > 0;
+    int workers = openLoop ? connections : concurrency;
+    if (workers < 1) {
+        std::cerr << "need at least one connection\n";
+        return 1;
+    }
+
+    std::atomic<long long> next(0);
+    std::vector<std::vector<Sample>> samples(workers);
+    std::vector<double> maxLag(workers, 0);
+
+    double start = logging::timestamp() + 0.1;
+    double measureStart = start + warmup;
+    double end = measureStart + duration;
+
+    auto work = [&](int worker) {
+        Connection conn(host, port, timeout);
+
+        double wait = start - logging::timestamp();
+        if (!openLoop && wait > 0) {
+            usleep(useconds_t(wait * 1000000));
+        }
+
+        while (true) {
+            long long i = next.fetch_add(1);
+            if (maxRequests > 0 && i >= maxRequests) {
+                break;
+            }
+
+            /*
+             * in the open loop, request i is due at a fixed time, whenever
+             * the one before it finished
+             */
+            double due;
+            if (openLoop) {
+                due = start + i / rate;
+                if (due >= end) {
+                    break;
+                }
+                double wait = due - logging::timestamp();
+                if (wait > 0) {
+                    usleep(useconds_t(wait * 1000000));
+                }
+                else {
+                    maxLag[worker] = std::max(maxLag[worker], -wait);
+                }
+            }
+            else {
+                due = logging::timestamp();
+                if (due >= end) {
+                    break;
+                }
+            }
+
+            const TestImage &image = images[order[i % order.size()]];
+            const std::string &head = heads[order[i % order.size()]];
+
+            Response response;
+            Sample sample;
+            if (conn.request(head, image.bytes, response)) {
+                sample.status = response.status;
+            }
+            sample.latency = logging::timestamp() - due;
+
+            if (sample.status == 200 && image.id >= 0) {
+                sample.judged = true;
+                sample.correct = matchedId(response.body) == image.id;
+            }
+
+            if (due >= measureStart) {
+                samples[worker].push_back(sample);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int w=0; w<workers; w++) {
+        threads.emplace_back(work, w);
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+
+    double finished = std::min(logging::timestamp(), end);
+    double elapsed = std::max(1e-9, finished - measureStart);
+
+
+    /*
+     * everything we sent, tallied
+     */
+    std::vector<double> latencies;
+    std::map<int, long long> statuses;
+    long long total = 0, ok = 0, unavailable = 0, errors = 0;
+    long long judged = 0, correct = 0;
+    double lag = 0;
+    for (int w=0; w<workers; w++) {
+        lag = std::max(lag, maxLag[w]);
+        for (auto &sample: samples[w]) {
+            total++;
+            statuses[sample.status]++;
+            if (sample.status == 200) {
+                ok++;
+                latencies.push_back(sample.latency);
+            }
+            else if (sample.status == 503) {
+                unavailable++;
+            }
+            else {
+                errors++;
+            }
+            judged += sample.judged;
+            correct += sample.correct;
+        }
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    double sum = 0;
+    for (double l: latencies) {
+        sum += l;
+    }
+
+    std::stringstream json;
+    json << std::setprecision(6) << std::fixed;
+    json << "{"
+        << "\"mode\": \"" << (openLoop ? "open" : "closed") << "\""
+        << ", \"rate\": " << rate
+        << ", \"concurrency\": " << (openLoop ? 0 : concurrency)
+        << ", \"images\": " << images.size()
+        << ", \"duration\": " << elapsed
+        << ", \"requests\": " << total
+        << ", \"offered_rate\": " << total / elapsed
+        << ", \"throughput\": " << ok / elapsed
+        << ", \"latency\": {"
+        << "\"p50\": " << percentile(latencies, 50)
+        << ", \"p90\": " << percentile(latencies, 90)
+        << ", \"p99\": " << percentile(latencies, 99)
+        << ", \"p999\": " << percentile(latencies, 99.9)
+        << ", \"mean\": " << (latencies.empty() ? 0 : sum / latencies.size())
+        << ", \"max\": " << (latencies.empty() ? 0 : latencies.back())
+        << "}"
+        << ", \"error_rate\": " << (total ? errors / double(total) : 0)
+        << ", \"unavailable_rate\": " << (total ? unavailable / double(total) : 0)
+        << ", \"statuses\": {";
+    bool first = true;
+    for (auto &entry: statuses) {
+        json << (first ? "" : ", ") << "\"" << entry.first << "\": "
+            << entry.second;
+        first = false;
+    }
+    json << "}"
+        << ", \"judged\": " << judged
+        << ", \"correct\": " << correct
+        << ", \"accuracy\": " << (judged ? correct / double(judged) : 0)
+        << ", \"max_send_lag\": " << lag
+        << "}\n";
+
+    if (out.empty()) {
+        std::cout << json.str();
+    }
+    else {
+        std::ofstream handle(out);
+        handle << json.str();
+        if (!handle) {
+            std::cerr << "couldn't write " << out << "\n";
+            return 1;
+        }
+    }
+
+    std::cerr << total << " requests in " << elapsed << "s, "
+        << ok / elapsed << "/s ok, p99 " << percentile(latencies, 99)
+        << "s, " << unavailable << " 503s, " << errors << " errors\n";
+    return 0;
+}
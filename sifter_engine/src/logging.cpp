@@ -20,9 +20,351 @@
  * SOFTWARE.
  */
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "logging.h"
 
 namespace logging {
-	double lastLog = 0;
-	priority currentPriority = HIGH;
+	std::atomic<int> currentPriority(HIGH);
+	std::atomic<int> currentFormat(TEXT);
+	std::atomic<FILE *> currentOutput(stdout);
+
+	/*
+	 * lines longer than this are cut short.  with the queue size, this is
+	 * a few hundred KB per thread that logs
+	 */
+	const size_t MAX_MESSAGE = 512;
+	const size_t QUEUE_SIZE = 512;
+
+	/*
+	 * how long the background thread sleeps when there's nothing to write
+	 */
+	const std::chrono::milliseconds IDLE_WAIT(5);
+
+
+	struct Record {
+		double timestamp;
+		priority level;
+		const char *file;
+		int line;
+		bool always;
+		size_t length;
+		char message[MAX_MESSAGE];
+	};
+
+	/*
+	 * a single-producer, single-consumer ring: only the thread that owns
+	 * it pushes, and only the background thread pops.  a thread that exits
+	 * abandons its queue, and the background thread frees it once it's
+	 * written out what's left
+	 */
+	struct Queue {
+		Record records[QUEUE_SIZE];
+		std::atomic<size_t> head{0};
+		std::atomic<size_t> tail{0};
+		std::atomic<uint64_t> dropped{0};
+		std::atomic_bool abandoned{false};
+		int thread = 0;
+
+		bool push(priority p, const char *file, int line,
+				const char *message, size_t length, bool always) {
+			size_t t = tail.load(std::memory_order_relaxed);
+			if (t - head.load(std::memory_order_acquire) == QUEUE_SIZE) {
+				return false;
+			}
+
+			Record &record = records[t % QUEUE_SIZE];
+			record.timestamp = timestamp();
+			record.level = p;
+			record.file = file;
+			record.line = line;
+			record.always = always;
+			record.length = length;
+			memcpy(record.message, message, length);
+
+			tail.store(t + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool pop(Record &record) {
+			size_t h = head.load(std::memory_order_relaxed);
+			if (h == tail.load(std::memory_order_acquire)) {
+				return false;
+			}
+			record = records[h % QUEUE_SIZE];
+			head.store(h + 1, std::memory_order_release);
+			return true;
+		}
+	};
+
+
+	/*
+	 * every thread's queue, and the background thread that empties them
+	 */
+	class Writer {
+	public:
+		Writer(): thread([this]() { run(); }) {
+		}
+
+		~Writer() {
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				stopping = true;
+			}
+			wake.notify_one();
+			thread.join();
+		}
+
+		Queue *add() {
+			Queue *queue = new Queue;
+			std::lock_guard<std::mutex> guard(lock);
+			queue->thread = ++numThreads;
+			queues.push_back(queue);
+			return queue;
+		}
+
+	private:
+		void run() {
+			std::vector<std::pair<Record, int>> batch;
+			bool idle = false;
+
+			while (true) {
+				std::vector<Queue *> current;
+				bool stop;
+				{
+					std::unique_lock<std::mutex> guard(lock);
+					if (idle) {
+						wake.wait_for(guard, IDLE_WAIT, [&]() {
+							return stopping;
+						});
+					}
+					current = queues;
+					stop = stopping;
+				}
+
+				idle = !drain(current, batch);
+
+				if (stop) {
+					break;
+				}
+			}
+		}
+
+		/*
+		 * writes out everything queued so far, oldest first across all
+		 * threads, with a single flush at the end.  returns false if there
+		 * was nothing to write
+		 */
+		bool drain(std::vector<Queue *> &current,
+				std::vector<std::pair<Record, int>> &batch) {
+			Record record;
+			std::vector<Queue *> finished;
+			for (Queue *queue: current) {
+				bool abandoned = queue->abandoned;
+				while (queue->pop(record)) {
+					batch.emplace_back(record, queue->thread);
+				}
+
+				uint64_t dropped = queue->dropped.exchange(0);
+				if (dropped) {
+					record.timestamp = timestamp();
+					record.level = HIGH;
+					record.file = nullptr;
+					record.always = true;
+					std::string message = "dropped "
+						+ std::to_string(dropped)
+						+ " log lines from a thread logging faster than we could write";
+					record.length = std::min(message.size(), MAX_MESSAGE);
+					memcpy(record.message, message.data(), record.length);
+					batch.emplace_back(record, queue->thread);
+				}
+
+				if (abandoned) {
+					finished.push_back(queue);
+				}
+			}
+
+			if (!finished.empty()) {
+				std::lock_guard<std::mutex> guard(lock);
+				for (Queue *queue: finished) {
+					queues.erase(std::find(queues.begin(), queues.end(),
+						queue));
+					delete queue;
+				}
+			}
+
+			if (batch.empty()) {
+				return false;
+			}
+
+			std::stable_sort(batch.begin(), batch.end(),
+				[](const std::pair<Record, int> &a,
+						const std::pair<Record, int> &b) {
+					return a.first.timestamp < b.first.timestamp;
+				});
+			FILE *out = currentOutput;
+			for (auto &entry: batch) {
+				write(out, entry.first, entry.second);
+			}
+			fflush(out);
+			batch.clear();
+			return true;
+		}
+
+		void write(FILE *out, const Record &record, int thread) {
+			double delta = lastLog == 0 ? 0 : record.timestamp - lastLog;
+			lastLog = record.timestamp;
+
+			if (currentFormat == KEY_VALUE) {
+				static const char *LEVELS[] = {"high", "medium", "low"};
+				fprintf(out, "ts=%.6f dt=%.6f level=%s pid=%d thread=%d",
+					record.timestamp, delta, LEVELS[record.level], pid,
+					thread);
+				if (record.file) {
+					fprintf(out, " src=%s:%d", record.file, record.line);
+				}
+				fputs(" msg=\"", out);
+				for (size_t i=0; i<record.length; i++) {
+					char c = record.message[i];
+					if (c == '"' || c == '\\') {
+						fputc('\\', out);
+						fputc(c, out);
+					}
+					else if (c == '\n') {
+						fputs("\\n", out);
+					}
+					else {
+						fputc(c, out);
+					}
+				}
+				fputs("\"\n", out);
+				return;
+			}
+
+			fprintf(out, "(%d) %.6f %.6f", pid, record.timestamp, delta);
+			if (record.file) {
+				fprintf(out, " %s line %d", record.file, record.line);
+			}
+			fputs(": ", out);
+			fwrite(record.message, 1, record.length, out);
+			fputc('\n', out);
+		}
+
+		std::mutex lock;
+		std::condition_variable wake;
+		std::vector<Queue *> queues;
+		int numThreads = 0;
+		bool stopping = false;
+
+		pid_t pid = getpid();
+		double lastLog = 0;
+		std::thread thread;
+	};
+
+
+	/*
+	 * started on first use, and stopped, with everything written out, when
+	 * the process exits
+	 */
+	Writer &writer() {
+		static Writer instance;
+		return instance;
+	}
+
+	/*
+	 * a thread's queue, given up when the thread exits
+	 */
+	struct ThreadQueue {
+		Queue *queue = nullptr;
+
+		~ThreadQueue() {
+			if (queue) {
+				queue->abandoned = true;
+			}
+		}
+	};
+
+	/*
+	 * a stream over a fixed buffer, so that rendering a message never
+	 * allocates.  anything past the end of the buffer is cut off
+	 */
+	class MessageBuffer: public std::streambuf {
+	public:
+		MessageBuffer(): stream(this) {
+		}
+
+		/*
+		 * messages have always been formatted the way the old macros left
+		 * std::cout: fixed point, to 6 places
+		 */
+		std::ostream &reset() {
+			setp(buffer, buffer + MAX_MESSAGE);
+			stream.clear();
+			stream.flags(std::ios_base::dec | std::ios_base::skipws
+				| std::ios_base::fixed);
+			stream.precision(6);
+			stream.width(0);
+			stream.fill(' ');
+			return stream;
+		}
+
+		const char *data() const {
+			return pbase();
+		}
+
+		size_t size() const {
+			return pptr() - pbase();
+		}
+
+	private:
+		char buffer[MAX_MESSAGE];
+		std::ostream stream;
+	};
+
+	thread_local ThreadQueue threadQueue;
+	thread_local MessageBuffer threadMessage;
+
+
+	void setPriority(priority p) {
+		currentPriority = p;
+	}
+
+	void setFormat(format f) {
+		currentFormat = f;
+	}
+
+	/*
+	 * where lines are written, stdout unless something else, like JSON
+	 * results, needs it to itself
+	 */
+	void setOutput(FILE *out) {
+		currentOutput = out;
+	}
+
+	std::ostream &messageBuffer() {
+		return threadMessage.reset();
+	}
+
+	void submit(priority p, const char *file, int line, bool always) {
+		if (!threadQueue.queue) {
+			threadQueue.queue = writer().add();
+		}
+
+		Queue *queue = threadQueue.queue;
+		while (!queue->push(p, file, line, threadMessage.data(),
+				threadMessage.size(), always)) {
+			if (!always) {
+				queue->dropped++;
+				return;
+			}
+			std::this_thread::yield();
+		}
+	}
 }
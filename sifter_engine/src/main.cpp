@@ -0,0 +1,625 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <functional>
+#include <unistd.h>
+#include <tuple>
+#include <numeric>
+#include <functional>
+#include <csignal>
+#include <limits>
+#include <cstdio>
+#include <cctype>
+#include <thread>
+#include <atomic>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/features2d/features2d.hpp>
+#include <opencv2/nonfree/features2d.hpp>
+
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+#include "sifter.h"
+#include "logging.h"
+#include "web_server.h"
+#include "generate.h"
+#include "image.h"
+#include "query_batcher.h"
+#include "trace.h"
+#include "flight_recorder.h"
+#include "evaluation.h"
+#include "sweep.h"
+#include "tuning.h"
+
+using namespace cv;
+
+
+path DATA_DIR;
+
+Server server;
+
+/*
+ * how confident a match has to be before we count it towards the design's
+ * popularity
+ */
+const float POPULAR_CONFIDENCE = 0.5;
+
+
+/*
+ * a --sweep-* option's default: just the value we're tuned to
+ */
+template <typename T>
+std::string listDefault(T value) {
+    std::stringstream buf;
+    buf << value;
+    return buf.str();
+}
+
+
+/*
+ * the signal we were asked to stop by.  the handler only records it:
+ * stopping the server joins its threads, which the signal may have landed
+ * on, so main does that once it sees the flag
+ */
+volatile sig_atomic_t stopSignal = 0;
+
+void shutdown(int param) {
+    stopSignal = param;
+}
+
+
+/*
+ * used for testing changes to our optimizations and tuning of SIFT parameters.
+ * this runs through our pre-classified test images, matching parallelism of
+ * them at a time, and writes what it measured, speed and accuracy both, as
+ * JSON to outFile, or stdout if there isn't one
+ */
+void runTest(const path &testImagesDir, const std::vector<Mat> &descriptors,
+        int numBestMatches, float distanceRatioThreshold, SIFT &sifter,
+        SIFT &refineSifter, int targetLongEdge, bool multithreaded, int limit,
+        int parallelism, const std::string &outFile) {
+
+    Evaluation evaluation = evaluate(testImagesDir, descriptors,
+        numBestMatches, distanceRatioThreshold, sifter, refineSifter,
+        targetLongEdge, multithreaded, limit, parallelism);
+
+    for (auto &outcome: evaluation.outcomes) {
+        if (!outcome.correct()) {
+            dlog("bad guess: " << outcome.correctId << " thought "
+                << outcome.guess.id, logging::HIGH);
+        }
+    }
+
+    alog("avg match time " << evaluation.latency().mean << ", accuracy: "
+        << evaluation.accuracy() << ", recall@" << numBestMatches << ": "
+        << evaluation.recall(numBestMatches) << ", over "
+        << evaluation.outcomes.size() << " images", logging::HIGH);
+
+    std::vector<int> recallAt = {1, 5, 10, 20};
+    if (std::find(recallAt.begin(), recallAt.end(), numBestMatches)
+            == recallAt.end()) {
+        recallAt.push_back(numBestMatches);
+    }
+    std::string json = evaluation.json(recallAt);
+
+    if (outFile.empty()) {
+        std::cout << json << std::endl;
+    }
+    else {
+        std::ofstream handle(outFile);
+        handle << json << "\n";
+        alog("wrote test results to " << outFile, logging::HIGH);
+    }
+}
+
+
+int main(int argc, char** argv) {
+    int port;
+    std::string frontend;
+    int maxConnections;
+    double idleTimeout;
+    size_t maxBufferedBytes;
+    int healthyThreshold;
+    double deadline;
+    int maxConcurrent;
+    int maxQueued;
+    double queueSlo;
+    int matchThreads;
+    double batchWindow;
+    int maxBatch;
+    size_t maxBatchBytes;
+    int maxBatches;
+    size_t cacheSize;
+    int cacheTolerance;
+    int thumbnailSize;
+    DecodeLimits decodeLimits;
+    bool generateMode;
+    bool testMode;
+    int testLimit;
+    int testParallel;
+    std::string testOut;
+    bool sweepMode;
+    std::string sweepSigma;
+    std::string sweepTrain;
+    std::string sweepCoarse;
+    std::string sweepRefine;
+    std::string sweepMatches;
+    std::string sweepRatio;
+    std::string sweepOut;
+    bool traceMode;
+    std::string traceOut;
+    double slowPercentile;
+    size_t flightRecords;
+    std::string replayDir;
+    std::string logLevel;
+    std::string logFormat;
+    bool singlethreaded;
+    bool coordinatorMode;
+    bool workerMode;
+    SpoolOptions spool;
+
+    namespace opt = boost::program_options;
+    opt::options_description desc("Options");
+    desc.add_options()
+        ("help", "help message")
+        ("base", opt::value<std::string>(),
+            "base directory of our data files")
+        ("port", opt::value<int>(&port)->default_value(8080),
+            "HTTP port to listen on")
+        ("frontend", opt::value<std::string>(&frontend)->default_value("epoll"),
+            "what handles HTTP connections: epoll (one event loop for all of them) or mongoose (a thread each)")
+        ("max-connections", opt::value<int>(&maxConnections)->default_value(10000),
+            "with --frontend epoll, connections we'll hold open at once")
+        ("idle-timeout", opt::value<double>(&idleTimeout)->default_value(30),
+            "with --frontend epoll, seconds a connection may sit idle, between or partway through requests, before we close it")
+        ("max-buffered-bytes", opt::value<size_t>(&maxBufferedBytes)->default_value(1024 * 1024 * 1024),
+            "with --frontend epoll, request body bytes we'll buffer across all connections before answering 503")
+        ("unhealthy", opt::value<int>(&healthyThreshold)->default_value(2),
+            "the number of simultaneous matching requests at which the server becomes unhealthy")
+        ("deadline", opt::value<double>(&deadline)->default_value(6),
+            "seconds a match may take, from arrival, before we return the best found so far (0 for no limit). clients can ask for less with X-Deadline-Ms")
+        ("max-concurrent", opt::value<int>(&maxConcurrent)->default_value(2),
+            "matches that may run at once; the rest queue")
+        ("max-queued", opt::value<int>(&maxQueued)->default_value(32),
+            "matches that may wait in the queue before we answer 503")
+        ("queue-slo", opt::value<double>(&queueSlo)->default_value(5),
+            "seconds of expected queueing at which we answer 503 instead of queueing")
+        ("match-threads", opt::value<int>(&matchThreads)->default_value(0),
+            "threads matching may use, shared by all running matches (0 for all cores)")
+        ("batch-window", opt::value<double>(&batchWindow)->default_value(5),
+            "milliseconds a search waits for others to share its pass over the designs with")
+        ("max-batch", opt::value<int>(&maxBatch)->default_value(8),
+            "most searches that share a pass; batches can't be bigger than --max-concurrent either")
+        ("cache-size", opt::value<size_t>(&cacheSize)->default_value(1024),
+            "match results to remember, so repeated uploads aren't matched again")
+        ("cache-tolerance", opt::value<int>(&cacheTolerance)->default_value(4),
+            "bits two images' perceptual hashes may differ by for one's result to be used for the other (-1 to only reuse results for identical uploads)")
+        ("max-batch-bytes", opt::value<size_t>(&maxBatchBytes)->default_value(256 * 1024 * 1024),
+            "largest /match/batch upload we'll accept; its images are matched --max-batch at a time")
+        ("max-batches", opt::value<int>(&maxBatches)->default_value(2),
+            "/match/batch uploads we'll match at once; more are answered 503")
+        ("max-upload-bytes", opt::value<size_t>(&decodeLimits.maxBytes)->default_value(20 * 1024 * 1024),
+            "largest upload we'll accept for matching")
+        ("max-pixels", opt::value<long long>(&decodeLimits.maxPixels)->default_value(50 * 1000 * 1000),
+            "most pixels an upload's header may claim before we refuse to decode it")
+        ("target-edge", opt::value<int>(&decodeLimits.targetLongEdge)->default_value(1024),
+            "long edge, in pixels, uploads are scaled down to while decoding (0 for full size)")
+        ("generate", opt::bool_switch(&generateMode),
+            "generate descriptors")
+        ("coordinator", opt::bool_switch(&coordinatorMode),
+            "with --generate, split the work into a spool directory for --worker processes")
+        ("worker", opt::bool_switch(&workerMode),
+            "with --generate, process work units from the spool directory")
+        ("spool", opt::value<std::string>(),
+            "spool directory shared by the coordinator and workers (default <base>/spool)")
+        ("unit-size", opt::value<size_t>(&spool.unitSize)->default_value(64),
+            "images per spooled work unit")
+        ("lease", opt::value<double>(&spool.leaseSeconds)->default_value(120),
+            "seconds without a heartbeat before a worker's unit is requeued")
+        ("local-workers", opt::value<int>(&spool.localWorkers)->default_value(0),
+            "worker processes the coordinator launches on this host")
+        ("thumbnail-size", opt::value<int>(&thumbnailSize)->default_value(400),
+            "long edge, in pixels, of the design thumbnails made by --generate")
+        ("singlethreaded", opt::bool_switch(&singlethreaded),
+            "don't parallelize matching or descriptor generation with TBB")
+        ("test", opt::bool_switch(&testMode),
+            "run time and accuracy tests")
+        ("test-limit", opt::value<int>(&testLimit)->default_value(0),
+            "with --test, only match this many test images (0 for all of them)")
+        ("test-parallel", opt::value<int>(&testParallel)->default_value(1),
+            "with --test, how many test images to match at once")
+        ("test-out", opt::value<std::string>(&testOut),
+            "with --test, write the results as JSON here instead of to stdout")
+        ("sweep", opt::bool_switch(&sweepMode),
+            "run the --test evaluation for every combination of the --sweep-* "
+            "values, and report which are Pareto-optimal for accuracy, latency "
+            "and memory")
+        ("sweep-sigma", opt::value<std::string>(&sweepSigma)->default_value(listDefault(tuning::SIGMA)),
+            "comma separated blur sigmas for --sweep")
+        ("sweep-train", opt::value<std::string>(&sweepTrain)->default_value(listDefault(tuning::TRAIN_FEATURES)),
+            "comma separated caps on training descriptors per design for --sweep")
+        ("sweep-coarse", opt::value<std::string>(&sweepCoarse)->default_value(listDefault(tuning::COARSE_FEATURES)),
+            "comma separated query feature counts for the initial scan for --sweep")
+        ("sweep-refine", opt::value<std::string>(&sweepRefine)->default_value(listDefault(tuning::REFINE_FEATURES)),
+            "comma separated query feature counts for refining for --sweep")
+        ("sweep-matches", opt::value<std::string>(&sweepMatches)->default_value(listDefault(tuning::NUM_MATCHES)),
+            "comma separated shortlist lengths for --sweep")
+        ("sweep-ratio", opt::value<std::string>(&sweepRatio)->default_value(listDefault(tuning::RATIO_THRESHOLD)),
+            "comma separated distance ratio thresholds for --sweep")
+        ("sweep-out", opt::value<std::string>(&sweepOut),
+            "with --sweep, write the results as JSON here instead of to stdout")
+        ("slow-percentile", opt::value<double>(&slowPercentile)->default_value(99),
+            "requests slower than this percentile of recent ones are kept by the flight recorder (0 turns it off)")
+        ("flight-records", opt::value<size_t>(&flightRecords)->default_value(16),
+            "slow requests the flight recorder keeps, most recent first")
+        ("flight-dir", opt::value<std::string>(),
+            "where POST /debug/flights/dump writes the flight recorder's requests (default <base>/flights)")
+        ("replay", opt::value<std::string>(&replayDir),
+            "replay the requests dumped by the flight recorder to this directory, and compare them with how they went")
+        ("log-level", opt::value<std::string>(&logLevel)->default_value("high"),
+            "most verbose log lines to write: high, medium or low")
+        ("log-format", opt::value<std::string>(&logFormat)->default_value("text"),
+            "log line format: text, or kv for key=value fields")
+        ("trace", opt::bool_switch(&traceMode),
+            "record per-request traces, served as Chrome trace-event JSON from /debug/trace")
+        ("trace-out", opt::value<std::string>(&traceOut),
+            "with --test, write the traces of the test run to this file, as Chrome trace-event JSON")
+    ;
+    opt::variables_map options;
+    opt::store(opt::parse_command_line(argc, argv, desc), options);
+    opt::notify(options);
+
+    if (options.count("help")) {
+        std::cout << desc << "\n";
+        return 1;
+    }
+
+
+    if (!options.count("base")) {
+        std::cerr << "please specify a base directory with --base\n";
+        return 1;
+    }
+
+    DATA_DIR = options["base"].as<std::string>();
+    tracing::setEnabled(traceMode || !traceOut.empty());
+    logging::setPriority(logLevel == "low" ? logging::LOW
+        : logLevel == "medium" ? logging::MEDIUM : logging::HIGH);
+    logging::setFormat(logFormat == "kv" ? logging::KEY_VALUE
+        : logging::TEXT);
+
+    /*
+     * --test and --sweep results can go to stdout, for piping into other
+     * tools, so their logs go to stderr, out of the way
+     */
+    if (testMode || sweepMode) {
+        logging::setOutput(stderr);
+    }
+
+    if (!boost::filesystem::exists(DATA_DIR)) {
+        std::cerr << "base directory " << DATA_DIR << " doesn't exist!\n";
+        return 1;
+    }
+
+
+
+
+    float sigma = tuning::SIGMA;
+    int maxTrainDescriptors = tuning::TRAIN_FEATURES;
+
+    /*
+     * where our designs are held
+     */
+    path designsDir = DATA_DIR/"designs";
+    /*
+     * the smaller versions of our designs that we stream to clients.  these
+     * are made by --generate, and the server won't start until they have
+     * been
+     */
+    path designThumbsDir = DATA_DIR/"design_thumbnails";
+
+    path descriptorDir = descriptorDirectory(DATA_DIR, maxTrainDescriptors,
+        sigma);
+
+    /*
+     * where our testing images are held, for running accuracy tests on
+     * optimizations.  the images in this directory have been pre-cropped and
+     * flipped (if they were taken in a mirror), and the filename of the image
+     * is the correct design
+     */
+    path testImagesDir = DATA_DIR/"test_images";
+
+
+    /*
+     * SIFT parameters
+     */
+    int octaves = tuning::OCTAVES;
+    float contrastThreshold = tuning::CONTRAST_THRESHOLD;
+    float edgeThreshold = tuning::EDGE_THRESHOLD;
+    int numMatches = tuning::NUM_MATCHES;
+    float thresholdRatio = tuning::RATIO_THRESHOLD;
+
+    /*
+     * sifters used in various stages.  "sifter" is used for our initial
+     * comparisons, and therefore uses a low number of features for speed.
+     * "refineSifter" is a second pass that runs on the numMatches best matches
+     * from "sifter"'s comparisons.  "generateParams" is for generating our
+     * descriptors from our initial design data, and is only used for
+     * --generate, where each thread builds its own extractor from it
+     */
+    SiftParams coarseParams = {tuning::COARSE_FEATURES, octaves,
+        contrastThreshold, edgeThreshold, sigma};
+    SiftParams refineParams = {tuning::REFINE_FEATURES, octaves,
+        contrastThreshold, edgeThreshold, sigma};
+    SIFT sifter = coarseParams.create();
+    SIFT refineSifter = refineParams.create();
+    SiftParams generateParams = {maxTrainDescriptors, octaves,
+        contrastThreshold, edgeThreshold, sigma};
+
+    /*
+     * our mapping of product id to product info.  it's built from the yaml
+     * into a flat file we can mmap, by --generate, or here if the yaml is
+     * newer than what was last built.  workers leave it to their
+     * coordinator, rather than all racing to build the same file
+     */
+    path designInfoYaml = DATA_DIR/"prod_mapping.yaml";
+    path designStoreFile = DATA_DIR/"designs.meta";
+
+    bool designStoreStale = !boost::filesystem::exists(designStoreFile)
+        || (boost::filesystem::exists(designInfoYaml)
+            && boost::filesystem::last_write_time(designInfoYaml)
+                > boost::filesystem::last_write_time(designStoreFile));
+
+    if (!workerMode && (generateMode || designStoreStale)) {
+        if (!DesignStore::build(designInfoYaml, designStoreFile)) {
+            std::cerr << "couldn't build " << designStoreFile << " from "
+                << designInfoYaml << "\n";
+            return 1;
+        }
+    }
+
+    if (generateMode) {
+        spool.spoolDir = options.count("spool") ?
+            path(options["spool"].as<std::string>()) : DATA_DIR/"spool";
+
+        if (workerMode) {
+            bool ok = runGenerationWorker(designsDir, descriptorDir,
+                generateParams, spool, !singlethreaded);
+            return ok ? 0 : 1;
+        }
+        else if (coordinatorMode) {
+            spool.workerCommand = {"/proc/self/exe", "--base", DATA_DIR.string(),
+                "--generate", "--worker", "--spool", spool.spoolDir.string(),
+                "--lease", std::to_string(spool.leaseSeconds)};
+            if (singlethreaded) {
+                spool.workerCommand.push_back("--singlethreaded");
+            }
+            coordinateGeneration(designsDir, descriptorDir, generateParams,
+                spool, !singlethreaded);
+        }
+        else {
+            generateDescriptors(designsDir, descriptorDir, generateParams,
+                !singlethreaded);
+        }
+        generateThumbnails(designsDir, designThumbsDir, thumbnailSize,
+            !singlethreaded);
+        return 0;
+    }
+
+    if (sweepMode) {
+        SweepGrid grid;
+        if (!parseList(sweepSigma, grid.sigmas)
+                || !parseList(sweepTrain, grid.trainDescriptors)
+                || !parseList(sweepCoarse, grid.coarseFeatures)
+                || !parseList(sweepRefine, grid.refineFeatures)
+                || !parseList(sweepMatches, grid.numMatches)
+                || !parseList(sweepRatio, grid.ratios)) {
+            std::cerr << "the --sweep-* options take comma separated numbers\n";
+            return 1;
+        }
+
+        auto results = runSweep(DATA_DIR, designsDir, testImagesDir, grid,
+            octaves, contrastThreshold, edgeThreshold,
+            decodeLimits.targetLongEdge, !singlethreaded, testLimit,
+            testParallel, sweepOut);
+        if (sweepOut.empty()) {
+            std::cout << sweepJson(results);
+        }
+        return 0;
+    }
+
+    /*
+     * preload our 6GB+ of image descriptors.  this will take around half a
+     * minute or so.  they're used for all the image matching
+     */
+    std::vector<Mat> descriptors = preloadDescriptors(descriptorDir);
+
+    if (!MatchInfo::designStore.open(designStoreFile)) {
+        std::cerr << "couldn't open " << designStoreFile << "\n";
+        return 1;
+    }
+
+
+    /*
+     * how we're set up to match, which replays of the flight recorder's
+     * requests need to match to be comparable
+     */
+    std::stringstream matchParams;
+    matchParams << coarseParams.str() << " / " << refineParams.str() << " / "
+        << numMatches << " " << thresholdRatio << " "
+        << decodeLimits.targetLongEdge;
+
+    if (!replayDir.empty()) {
+        replayFlights(replayDir, descriptors, numMatches, thresholdRatio,
+            sifter, refineSifter, coarseParams, decodeLimits.targetLongEdge,
+            matchParams.str(), !singlethreaded);
+        return 0;
+    }
+
+    if (testMode) {
+        runTest(testImagesDir, descriptors, numMatches, thresholdRatio,
+            sifter, refineSifter, decodeLimits.targetLongEdge, !singlethreaded,
+            testLimit, testParallel, testOut);
+
+        if (!traceOut.empty()) {
+            std::ofstream handle(traceOut);
+            tracing::exportJson(handle);
+            alog("wrote traces to " << traceOut, logging::HIGH);
+        }
+        return 0;
+    }
+
+    /*
+     * everything a match response needs about a design's image is prepared
+     * here, so responding does no disk I/O or image decoding.  the full
+     * designs are far too big to hold in memory instead, so without
+     * thumbnails we don't serve at all
+     */
+    if (!MatchInfo::thumbnails.load(designThumbsDir, !singlethreaded)) {
+        std::cerr << "no thumbnails in " << designThumbsDir << ", run with "
+            "--generate to make them\n";
+        return 1;
+    }
+
+    DesignPopularity popularity(descriptors.size(), DATA_DIR/"popularity.txt");
+    popularity.load();
+
+    /*
+     * set the matcher our server should use to match images.  it's just a
+     * closure with some preset defaults.  confident, complete matches count
+     * towards a design's popularity, which decides the order later searches
+     * scan designs in.  no more searches than the scheduler lets run at once
+     * can ever be waiting to share a pass, so a batch that size is as full as
+     * it gets, and goes without waiting out the rest of the window
+     */
+    int batchLimit = std::max(1, std::min(maxBatch, maxConcurrent));
+    QueryBatcher batcher([&descriptors, numMatches, thresholdRatio,
+            singlethreaded](const std::vector<Mat> &queries,
+            std::vector<SearchContext> &contexts) {
+        return findBestMatchesBatch(queries, descriptors, numMatches,
+            thresholdRatio, !singlethreaded, contexts);
+    }, batchWindow / 1000.0, batchLimit);
+
+    server.setMatcher([&descriptors, &sifter, &refineSifter, &popularity,
+            &batcher, numMatches, thresholdRatio, singlethreaded](
+            const Mat &image, SearchContext &context)->MatchInfo{
+        context.order = popularity.order();
+        MatchInfo info = findBestMatch(image, descriptors, numMatches,
+                thresholdRatio, sifter,	refineSifter, !singlethreaded, context,
+                &batcher);
+        if (!info.partial && info.match.confidence >= POPULAR_CONFIDENCE) {
+            popularity.recordHit(info.match.id);
+        }
+        return info;
+    });
+
+    /*
+     * and the matcher for descriptors clients extracted themselves.  they
+     * come strongest first, so the initial scan takes as many from the top
+     * as our coarse sifter would have found, and refining uses them all
+     */
+    server.setPrecomputedMatcher([&descriptors, &popularity, &batcher,
+            coarseParams, numMatches, thresholdRatio, singlethreaded](
+            const Mat &query, SearchContext &context)->MatchInfo{
+        context.order = popularity.order();
+        Mat coarseQuery = query.rowRange(0,
+            std::min(query.rows, coarseParams.numFeatures));
+        MatchInfo info = findBestMatchForDescriptors(coarseQuery, query,
+            descriptors, numMatches, thresholdRatio, !singlethreaded, context,
+            &batcher);
+        if (!info.partial && info.match.confidence >= POPULAR_CONFIDENCE) {
+            popularity.recordHit(info.match.id);
+        }
+        return info;
+    });
+
+    /*
+     * and the verifier, for match sessions checking a new frame against the
+     * shortlist from their last search
+     */
+    server.setVerifier([&descriptors, &refineSifter, thresholdRatio](
+            const Mat &image, std::vector<PotentialMatch> &shortlist,
+            SearchContext &context)->MatchInfo{
+        return verifyShortlist(image, descriptors, shortlist, thresholdRatio,
+            refineSifter, context);
+    });
+
+    /*
+     * and the batch matcher, for /match/batch uploads.  bulk lookups don't
+     * say anything about what people are looking for, so they don't count
+     * towards popularity
+     */
+    server.setBatchMatcher([&descriptors, &sifter, &refineSifter, numMatches,
+            thresholdRatio, singlethreaded](const std::vector<Mat> &images,
+            std::vector<SearchContext> &contexts,
+            const std::function<void(size_t, MatchInfo &)> &found) {
+        findBestMatchBatch(images, descriptors, numMatches, thresholdRatio,
+            sifter, refineSifter, !singlethreaded, contexts, found);
+    });
+
+    server.setHealthyThreshold(healthyThreshold);
+    if (matchThreads <= 0) {
+        matchThreads = std::thread::hardware_concurrency();
+    }
+    server.setScheduling(maxConcurrent, maxQueued, queueSlo, matchThreads);
+    server.setThumbnails(&MatchInfo::thumbnails);
+    server.setDecodeLimits(decodeLimits);
+    server.setDefaultDeadline(deadline);
+    server.setBatchLimits(maxBatchBytes, maxBatch, maxBatches);
+    server.setSiftParams(coarseParams, refineParams);
+    if (slowPercentile > 0) {
+        path flightDir = options.count("flight-dir")
+            ? path(options["flight-dir"].as<std::string>())
+            : DATA_DIR/"flights";
+        server.setFlightRecorder(flightRecords, slowPercentile, flightDir,
+            matchParams.str());
+    }
+    server.setResultCache(cacheSize, cacheTolerance);
+    server.setFrontend(frontend == "mongoose" ? Frontend::MONGOOSE
+        : Frontend::EPOLL);
+    server.setConnectionLimits(maxConnections, idleTimeout,
+        maxBufferedBytes);
+
+    /*
+     * set up our signal handler and launch the web server
+     */
+    signal(SIGTERM, shutdown);
+    server.serve(port);
+
+
+    while (!stopSignal) {
+        sleep(1);
+    }
+
+    dlog("caught signal " << stopSignal << ", shutting down", logging::HIGH);
+    server.stop();
+    return 1;
+}
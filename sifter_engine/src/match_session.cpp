@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sstream>
+
+#include "match_session.h"
+#include "web_server.h"
+#include "image.h"
+#include "logging.h"
+
+
+/*
+ * how confident checking a frame against the last shortlist has to be for
+ * us to believe it, rather than searching everything
+ */
+const float SESSION_CONFIDENCE = 0.5;
+
+/*
+ * frames whose perceptual hashes are this close are the same view
+ */
+const int SESSION_STILL_BITS = 2;
+
+
+MatchSession::MatchSession(Server *server, ThumbnailMode thumbnailMode):
+        server(server), thumbnailMode(thumbnailMode) {
+}
+
+std::string MatchSession::error(const std::string &msg,
+        double retryAfter) const {
+    std::stringstream buf;
+    buf << "{\"frame\": " << frames << ", \"error\": \"" << msg << "\"";
+    if (retryAfter > 0) {
+        buf << ", \"retry_after\": " << retryAfter;
+    }
+    buf << "}";
+    return buf.str();
+}
+
+/*
+ * matches one frame (an encoded image) and returns the JSON message to send
+ * back for it.  "source" says how we got the result: "unchanged" from the
+ * last frame, "verified" against the last shortlist, or "searched"
+ */
+std::string MatchSession::processFrame(const unsigned char *data,
+        size_t size) {
+    frames++;
+
+    const DecodeLimits &limits = server->getDecodeLimits();
+    int width, height;
+    if (size > limits.maxBytes || (imageDimensions(data, size, width, height)
+            && (long long)width * height > limits.maxPixels)) {
+        return error("frame too large");
+    }
+
+    SearchContext context;
+    if (server->getDefaultDeadline() > 0) {
+        context.deadline = logging::timestamp() + server->getDefaultDeadline();
+    }
+
+    MatchInfo info;
+    std::string source;
+    bool decoded = false;
+    double retryAfter = 0;
+
+    bool ran = server->schedule([&]() {
+        Mat image = decodeGrayscale(data, size, limits.targetLongEdge);
+        if (image.empty()) {
+            return;
+        }
+        decoded = true;
+
+        uint64_t frameHash = perceptualHash(image);
+        if (haveLast && hammingDistance(frameHash, lastFrameHash)
+                <= SESSION_STILL_BITS) {
+            info = lastResult;
+            source = "unchanged";
+            return;
+        }
+        else if (!shortlist.empty()) {
+            info = server->verify(image, shortlist, context);
+            if (info.match.confidence >= SESSION_CONFIDENCE) {
+                source = "verified";
+            }
+        }
+
+        if (source.empty()) {
+            info = server->match(image, context);
+            shortlist = context.shortlist;
+            source = "searched";
+        }
+
+        /*
+         * only frames we actually matched move the reference point, so a
+         * slow pan can't drift away from the result it's being compared to
+         */
+        lastFrameHash = frameHash;
+        lastResult = info;
+        haveLast = true;
+    }, retryAfter);
+
+    if (!ran) {
+        return error("busy", retryAfter);
+    }
+    if (!decoded) {
+        return error("couldn't decode image");
+    }
+
+    dlog("session frame " << frames << ": " << source << " " << info.match,
+        logging::MEDIUM);
+
+    std::stringstream buf;
+    buf << "{\"frame\": " << frames
+        << ", \"source\": \"" << source << "\""
+        << ", \"match\": " << info.json(thumbnailMode)
+        << "}";
+    return buf.str();
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "metrics.h"
+
+
+namespace metrics {
+
+    const char *STAGE_NAMES[NUM_STAGES] = {
+        "receive",
+        "decode",
+        "coarse_extract",
+        "coarse_search",
+        "refine_extract",
+        "refine_match",
+        "response",
+        "total"
+    };
+
+    /*
+     * from a millisecond, for a thumbnail lookup, to the tens of seconds a
+     * cold, undeadlined search over every design can take
+     */
+    const std::vector<double> LATENCY_BOUNDS = {0.001, 0.0025, 0.005, 0.01,
+        0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30};
+
+    const std::vector<double> SCANNED_BOUNDS = {100, 1000, 2500, 5000, 10000,
+        25000, 50000, 100000, 250000};
+
+
+    Histogram stages[NUM_STAGES] = {
+        {LATENCY_BOUNDS}, {LATENCY_BOUNDS}, {LATENCY_BOUNDS},
+        {LATENCY_BOUNDS}, {LATENCY_BOUNDS}, {LATENCY_BOUNDS},
+        {LATENCY_BOUNDS}, {LATENCY_BOUNDS}
+    };
+    Histogram scanned(SCANNED_BOUNDS);
+    Counter bytesOut;
+
+
+    void Counter::add(uint64_t n) {
+        count.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t Counter::value() const {
+        return count.load(std::memory_order_relaxed);
+    }
+
+
+    Histogram::Histogram(const std::vector<double> &bounds): bounds(bounds),
+            counts(new std::atomic<uint64_t>[bounds.size() + 1]) {
+        for (size_t i=0; i<=bounds.size(); i++) {
+            counts[i] = 0;
+        }
+    }
+
+    /*
+     * only the bucket the value falls in is counted.  the cumulative counts
+     * Prometheus wants are added up when we render
+     */
+    void Histogram::observe(double value) {
+        size_t bucket = 0;
+        while (bucket < bounds.size() && value > bounds[bucket]) {
+            bucket++;
+        }
+        counts[bucket].fetch_add(1, std::memory_order_relaxed);
+
+        double current = sum.load(std::memory_order_relaxed);
+        while (!sum.compare_exchange_weak(current, current + value,
+                std::memory_order_relaxed)) {
+        }
+    }
+
+    void Histogram::render(std::ostream &out, const std::string &name,
+            const std::string &labels) const {
+        std::string prefix = labels.empty() ? "" : labels + ",";
+        std::string braced = labels.empty() ? "" : "{" + labels + "}";
+
+        uint64_t cumulative = 0;
+        for (size_t i=0; i<=bounds.size(); i++) {
+            cumulative += counts[i].load(std::memory_order_relaxed);
+            out << name << "_bucket{" << prefix << "le=\"";
+            if (i < bounds.size()) {
+                out << bounds[i];
+            }
+            else {
+                out << "+Inf";
+            }
+            out << "\"} " << cumulative << "\n";
+        }
+        out << name << "_sum" << braced << " "
+            << sum.load(std::memory_order_relaxed) << "\n";
+        out << name << "_count" << braced << " " << cumulative << "\n";
+    }
+
+
+    void observeStage(Stage stage, double seconds) {
+        stages[stage].observe(seconds);
+    }
+
+    void observeScanned(int designs) {
+        scanned.observe(designs);
+    }
+
+    void addBytesOut(uint64_t bytes) {
+        bytesOut.add(bytes);
+    }
+
+    void render(std::ostream &out) {
+        /*
+         * sums run to hours of seconds, which the default six digits would
+         * round off
+         */
+        out.precision(12);
+
+        out << "# HELP sifter_stage_seconds time spent in each stage of a "
+            "match\n";
+        out << "# TYPE sifter_stage_seconds histogram\n";
+        for (int stage=0; stage<NUM_STAGES; stage++) {
+            stages[stage].render(out, "sifter_stage_seconds",
+                std::string("stage=\"") + STAGE_NAMES[stage] + "\"");
+        }
+
+        out << "# HELP sifter_designs_scanned designs a search compared its "
+            "image against\n";
+        out << "# TYPE sifter_designs_scanned histogram\n";
+        scanned.render(out, "sifter_designs_scanned");
+
+        out << "# HELP sifter_bytes_out_total response bytes sent\n";
+        out << "# TYPE sifter_bytes_out_total counter\n";
+        out << "sifter_bytes_out_total " << bytesOut.value() << "\n";
+    }
+}
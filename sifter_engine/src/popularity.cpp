@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <fstream>
+
+#include "popularity.h"
+#include "logging.h"
+
+
+namespace fs = boost::filesystem;
+
+
+/*
+ * how many hits we let accumulate before rebuilding the search order (and
+ * saving the counts, so they survive restarts)
+ */
+const uint32_t REBUILD_EVERY = 100;
+
+
+DesignPopularity::DesignPopularity(size_t numDesigns, const path &saveFile):
+        numDesigns(numDesigns), saveFile(saveFile),
+        hits(new std::atomic<uint32_t>[numDesigns]) {
+    for (size_t i=0; i<numDesigns; i++) {
+        hits[i] = 0;
+    }
+    hitsSinceRebuild = 0;
+    rebuild();
+}
+
+void DesignPopularity::load() {
+    std::ifstream handle(saveFile.string());
+    int id;
+    uint32_t count;
+    while (handle >> id >> count) {
+        if (id >= 0 && size_t(id) < numDesigns) {
+            hits[id] = count;
+        }
+    }
+    rebuild();
+}
+
+void DesignPopularity::save() const {
+    if (saveFile.empty()) {
+        return;
+    }
+
+    path tmpFile = saveFile.string() + ".tmp";
+    {
+        std::ofstream handle(tmpFile.string());
+        for (size_t i=0; i<numDesigns; i++) {
+            uint32_t count = hits[i];
+            if (count) {
+                handle << i << " " << count << "\n";
+            }
+        }
+    }
+    boost::system::error_code ec;
+    fs::rename(tmpFile, saveFile, ec);
+}
+
+void DesignPopularity::recordHit(int id) {
+    if (id < 0 || size_t(id) >= numDesigns) {
+        return;
+    }
+    hits[id]++;
+
+    if (++hitsSinceRebuild >= REBUILD_EVERY) {
+        std::unique_lock<std::mutex> guard(rebuildLock, std::try_to_lock);
+        if (guard.owns_lock() && hitsSinceRebuild >= REBUILD_EVERY) {
+            hitsSinceRebuild = 0;
+            rebuild();
+            save();
+        }
+    }
+}
+
+/*
+ * sorts on a snapshot of the counts, since they keep changing under us
+ */
+void DesignPopularity::rebuild() {
+    std::vector<uint32_t> counts(numDesigns);
+    for (size_t i=0; i<numDesigns; i++) {
+        counts[i] = hits[i];
+    }
+
+    std::shared_ptr<std::vector<int>> order(new std::vector<int>(numDesigns));
+    for (size_t i=0; i<numDesigns; i++) {
+        (*order)[i] = i;
+    }
+    std::sort(order->begin(), order->end(), [&counts](int a, int b) {
+        if (counts[a] != counts[b]) {
+            return counts[a] > counts[b];
+        }
+        return a > b;
+    });
+
+    std::lock_guard<std::mutex> guard(orderLock);
+    current = order;
+}
+
+SearchOrder DesignPopularity::order() {
+    std::lock_guard<std::mutex> guard(orderLock);
+    return current;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <chrono>
+
+#include "query_batcher.h"
+#include "logging.h"
+
+
+QueryBatcher::QueryBatcher(const BatchSearch &search, double windowSeconds,
+        size_t maxBatch):
+        batchSearch(search), windowSeconds(windowSeconds),
+        maxBatch(std::max(maxBatch, size_t(1))) {
+}
+
+/*
+ * runs a coarse search for queryDescriptors, as part of whichever batch is
+ * open, and returns its shortlist.  context comes back with how far the
+ * search got, just like with findBestMatches
+ */
+std::vector<PotentialMatch> QueryBatcher::search(const Mat &queryDescriptors,
+        SearchContext &context) {
+
+    std::unique_lock<std::mutex> guard(lock);
+
+    bool leader = !open;
+    if (leader) {
+        open = std::make_shared<Batch>();
+    }
+    std::shared_ptr<Batch> batch = open;
+    size_t slot = batch->queries.size();
+    batch->queries.push_back(queryDescriptors);
+    batch->contexts.push_back(context);
+
+    if (leader) {
+        /*
+         * hold the batch open for the others.  a search that joins the full
+         * batch wakes us early
+         */
+        auto closeAt = std::chrono::steady_clock::now()
+            + std::chrono::duration<double>(windowSeconds);
+        filled.wait_until(guard, closeAt, [&]() {
+            return batch->queries.size() >= maxBatch;
+        });
+        if (open == batch) {
+            open.reset();
+        }
+        guard.unlock();
+
+        dlog("running batched search of " << batch->queries.size()
+            << " queries", logging::MEDIUM);
+
+        try {
+            batch->results = batchSearch(batch->queries, batch->contexts);
+        }
+        catch (...) {
+            batch->error = std::current_exception();
+        }
+
+        guard.lock();
+        batch->done = true;
+        finished.notify_all();
+    }
+    else {
+        /*
+         * a full batch closes right away, and the next search to come along
+         * leads a new one
+         */
+        if (batch->queries.size() >= maxBatch) {
+            open.reset();
+            filled.notify_all();
+        }
+        finished.wait(guard, [&]() { return batch->done; });
+    }
+
+    if (batch->error) {
+        std::rethrow_exception(batch->error);
+    }
+
+    context = batch->contexts[slot];
+    return std::move(batch->results[slot]);
+}
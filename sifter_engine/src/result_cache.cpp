@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <sstream>
+
+#include "result_cache.h"
+#include "image.h"
+#include "logging.h"
+
+
+/*
+ * a perceptual hash only says two images look alike, not that they're the
+ * same photo, so we only hand out results this confident for them.  a
+ * confident match is about the design in the photo, which a lookalike
+ * photo almost certainly shows too
+ */
+const float SIMILAR_MIN_CONFIDENCE = 0.5;
+
+
+ResultCache::ResultCache(size_t capacity, int hammingTolerance):
+        capacity(capacity), hammingTolerance(hammingTolerance) {
+}
+
+/*
+ * moves an entry to the front, as the most recently used.  must be called
+ * with lock held
+ */
+void ResultCache::touch(std::list<Entry>::iterator entry) {
+    entries.splice(entries.begin(), entries, entry);
+}
+
+/*
+ * looks for a result by the exact content of the upload.  every request
+ * comes through here first, so this is also where we count lookups
+ */
+bool ResultCache::find(uint64_t contentHash, MatchInfo &info) {
+    std::lock_guard<std::mutex> guard(lock);
+    lookups++;
+
+    auto found = byContent.find(contentHash);
+    if (found == byContent.end()) {
+        return false;
+    }
+
+    touch(found->second);
+    info = found->second->info;
+    exactHits++;
+    return true;
+}
+
+/*
+ * looks for a result for an image that looks like this one, closest first.
+ * the cache is small enough that a linear scan costs next to nothing next
+ * to a match
+ */
+bool ResultCache::findSimilar(uint64_t imageHash, MatchInfo &info) {
+    if (hammingTolerance < 0 || imageHash == 0) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto best = entries.end();
+    int bestDistance = hammingTolerance + 1;
+    for (auto entry=entries.begin(); entry!=entries.end(); entry++) {
+        if (entry->imageHash == 0
+                || entry->info.match.confidence < SIMILAR_MIN_CONFIDENCE) {
+            continue;
+        }
+
+        int distance = hammingDistance(imageHash, entry->imageHash);
+        if (distance < bestDistance) {
+            best = entry;
+            bestDistance = distance;
+        }
+    }
+
+    if (best == entries.end()) {
+        return false;
+    }
+
+    dlog("perceptual cache hit on " << best->info.design.id << ", "
+        << bestDistance << " bits away", logging::MEDIUM);
+    touch(best);
+    info = best->info;
+    similarHits++;
+    return true;
+}
+
+void ResultCache::insert(uint64_t contentHash, uint64_t imageHash,
+        const MatchInfo &info) {
+    if (capacity == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = byContent.find(contentHash);
+    if (found != byContent.end()) {
+        found->second->imageHash = imageHash;
+        found->second->info = info;
+        touch(found->second);
+        return;
+    }
+
+    entries.push_front(Entry{contentHash, imageHash, info});
+    byContent[contentHash] = entries.begin();
+
+    if (entries.size() > capacity) {
+        byContent.erase(entries.back().contentHash);
+        entries.pop_back();
+    }
+}
+
+/*
+ * returns true if the caller is the first to ask for this content, and so
+ * should match it and fulfil() the claim when it's done.  otherwise, returns
+ * false, with pending set to the outcome of whoever got there first
+ */
+bool ResultCache::claim(uint64_t contentHash,
+        std::shared_future<MatchOutcome> &pending) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = inFlight.find(contentHash);
+    if (found != inFlight.end()) {
+        pending = found->second.outcome;
+        coalesced++;
+        return false;
+    }
+
+    InFlight &claimed = inFlight[contentHash];
+    claimed.outcome = claimed.promise.get_future().share();
+    return true;
+}
+
+/*
+ * hands the outcome of a claimed match to everyone waiting on it, and
+ * releases the claim
+ */
+void ResultCache::fulfil(uint64_t contentHash, const MatchOutcome &outcome) {
+    std::lock_guard<std::mutex> guard(lock);
+
+    auto found = inFlight.find(contentHash);
+    if (found == inFlight.end()) {
+        return;
+    }
+    found->second.promise.set_value(outcome);
+    inFlight.erase(found);
+}
+
+std::string ResultCache::statsJson() {
+    std::lock_guard<std::mutex> guard(lock);
+
+    uint64_t hits = exactHits + similarHits;
+    std::stringstream buf;
+    buf << "{"
+        << "\"entries\": " << entries.size()
+        << ", \"capacity\": " << capacity
+        << ", \"lookups\": " << lookups
+        << ", \"exact_hits\": " << exactHits
+        << ", \"similar_hits\": " << similarHits
+        << ", \"coalesced\": " << coalesced
+        << ", \"hit_rate\": " << (lookups ? double(hits) / lookups : 0)
+        << ", \"in_flight\": " << inFlight.size()
+        << "}";
+    return buf.str();
+}
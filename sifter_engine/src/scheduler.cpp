@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <cmath>
+
+#include "scheduler.h"
+#include "logging.h"
+
+
+/*
+ * how quickly our average service time follows changes
+ */
+const double SERVICE_SMOOTHING = 0.2;
+
+
+MatchScheduler::MatchScheduler(int maxConcurrent, int maxQueued,
+        double sloSeconds, int numThreads):
+        maxConcurrent(std::max(maxConcurrent, 1)), maxQueued(maxQueued),
+        sloSeconds(sloSeconds),
+        arena(numThreads, std::min(std::max(maxConcurrent, 1), numThreads)) {
+}
+
+/*
+ * everyone queued or running ahead of a new arrival has to clear out, a
+ * batch of maxConcurrent at a time, before it gets to run.  must be called
+ * with lock held
+ */
+double MatchScheduler::estimatedWait() const {
+    int ahead = numRunning + waiting.size() - maxConcurrent + 1;
+    if (ahead <= 0) {
+        return 0;
+    }
+    return std::ceil(double(ahead) / maxConcurrent) * averageService;
+}
+
+/*
+ * a quick check, before the caller does any work on a request (like reading
+ * its body), of whether we'd turn it away right now
+ */
+bool MatchScheduler::wouldReject(double &retryAfter) {
+    std::lock_guard<std::mutex> guard(lock);
+    double wait = estimatedWait();
+    if (waiting.size() >= maxQueued || wait > sloSeconds) {
+        retryAfter = std::max(wait, 1.0);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * runs job in our arena once it's its turn, and returns true.  if we're too
+ * loaded to get to it in time, returns false straight away without running
+ * it, with retryAfter set to how long the client should back off for
+ */
+bool MatchScheduler::run(const std::function<void()> &job,
+        double &retryAfter) {
+    {
+        std::unique_lock<std::mutex> guard(lock);
+
+        double wait = estimatedWait();
+        if (waiting.size() >= maxQueued || wait > sloSeconds) {
+            retryAfter = std::max(wait, 1.0);
+            numRejected++;
+            dlog("rejecting match, " << waiting.size() << " queued, "
+                << numRunning << " running, estimated wait " << wait,
+                logging::MEDIUM);
+            return false;
+        }
+
+        uint64_t ticket = nextTicket++;
+        waiting.push_back(ticket);
+        turn.wait(guard, [&]() {
+            return waiting.front() == ticket && numRunning < maxConcurrent;
+        });
+        waiting.pop_front();
+        numRunning++;
+    }
+
+    /*
+     * whoever is next in line may be able to start too
+     */
+    turn.notify_all();
+
+    /*
+     * gives our slot back however the job ends.  a job that throws would
+     * otherwise hold it for good, and once maxConcurrent of them had, nothing
+     * would run again
+     */
+    struct SlotGuard {
+        MatchScheduler &scheduler;
+        ~SlotGuard() {
+            {
+                std::lock_guard<std::mutex> guard(scheduler.lock);
+                scheduler.numRunning--;
+            }
+            scheduler.turn.notify_all();
+        }
+    } slot = {*this};
+
+    double start = logging::timestamp();
+    arena.execute(job);
+    double elapsed = logging::timestamp() - start;
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (averageService == 0) {
+            averageService = elapsed;
+        }
+        else {
+            averageService += SERVICE_SMOOTHING * (elapsed - averageService);
+        }
+    }
+    return true;
+}
+
+int MatchScheduler::queued() {
+    std::lock_guard<std::mutex> guard(lock);
+    return waiting.size();
+}
+
+int MatchScheduler::running() {
+    std::lock_guard<std::mutex> guard(lock);
+    return numRunning;
+}
+
+uint64_t MatchScheduler::rejected() {
+    std::lock_guard<std::mutex> guard(lock);
+    return numRejected;
+}
@@ -24,6 +24,7 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
 #include <algorithm>
 #include <iterator>
 #include <vector>
@@ -32,36 +33,33 @@
 #include <tuple>
 #include <numeric>
 #include <functional>
-#include <csignal>
 #include <limits>
 #include <cstdio>
 #include <cctype>
+#include <thread>
+#include <atomic>
 
 #include <opencv2/opencv.hpp>
 #include <opencv2/features2d/features2d.hpp>
 #include <opencv2/nonfree/features2d.hpp>
 
-#include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 
 #include <tbb/tbb.h>
 
-#include <glib-2.0/glib.h>
-
 #include "sifter.h"
 #include "logging.h"
-#include "web_server.h"
+#include "image.h"
+#include "query_batcher.h"
+#include "trace.h"
 
 
 
 using namespace cv;
 
 
-path DATA_DIR;
-
-Server server;
-std::map<int, DesignInfo> MatchInfo::designInfoData;
-path MatchInfo::designThumbsDir;
+DesignStore MatchInfo::designStore;
+ThumbnailCache MatchInfo::thumbnails;
 
 
 void computeKeypointsAndDescriptors(const path &imageFile,
@@ -72,9 +70,19 @@ void computeKeypointsAndDescriptors(const path &imageFile,
     sifter.compute(img, keypoints, descriptors);
 }
 
-Mat computeDescriptors(const path &imageFile, SIFT &sifter) {
-    Mat img = imread(imageFile.string(), CV_LOAD_IMAGE_GRAYSCALE);
+SIFT SiftParams::create() const {
+    return SIFT(numFeatures, octaves, contrastThreshold, edgeThreshold, sigma);
+}
 
+std::string SiftParams::str() const {
+    std::stringstream buf;
+    buf << numFeatures << " " << octaves << " " << contrastThreshold << " "
+        << edgeThreshold << " " << sigma;
+    return buf.str();
+}
+
+
+Mat computeDescriptors(const Mat &img, SIFT &sifter) {
     std::vector<KeyPoint> keypoints;
     Mat descriptors;
 
@@ -106,35 +114,6 @@ Mat loadDescriptors(const path &fileName) {
     return descriptors;
 }
 
-/*
- * takes our yaml design info file and populates a mapping of structs containing
- * that data
- */
-std::map<int, DesignInfo> loadDesignInfoData(const path &fileName) {
-    FileStorage handle;
-
-    handle.open(fileName.string(), FileStorage::READ);
-    std::string artist;
-
-    std::map<int, DesignInfo> productData;
-    FileNode mapping = handle["product_mapping"];
-    for (auto entry: mapping) {
-        int i = std::stoi(entry.name().substr(1, std::string::npos));
-        DesignInfo designInfo;
-
-        designInfo.id = i;
-        entry["artist"] >> designInfo.artistName;
-        entry["title"] >> designInfo.title;
-        entry["added"] >> designInfo.dateAdded;
-        entry["url"] >> designInfo.artistUrl;
-
-        productData[i] = designInfo;
-    }
-    handle.release();
-    return productData;
-}
-
-
 void applyFunctionToImages(const path &imageDirectory,
         std::function<void(const path&)> application, int max) {
 
@@ -162,48 +141,34 @@ void applyFunctionToImages(const path &imageDirectory,
 }
 
 
-void generateKeypointsAndDescriptors(const path& imagePath,
-        const path& descriptorDir, SIFT &sifter, bool skipExists) {
-
-    path descriptorFile = descriptorDir / (imagePath.filename().string() + ".sift");
-
-    if (boost::filesystem::exists(descriptorFile) && skipExists) {
-        dlog(descriptorFile << " already exists, skipping", logging::HIGH);
-        return;
-    }
-
-    Mat descriptors;
-    std::vector<KeyPoint> keypoints;
-
-    computeKeypointsAndDescriptors(imagePath, keypoints, descriptors, sifter);
-    saveDescriptorsAndKeypoints(descriptorFile, descriptors, keypoints);
-}
-
-
-
 MatchDetails compareImageToDesign(const Mat &query, const Mat &training,
         DescriptorMatcher &matcher, float distanceRatioThreshold) {
-    std::vector<DMatch> matches;
-
     std::vector<std::vector<DMatch>> knnMatches;
 
     dlog("beginning matching", logging::LOW);
     matcher.knnMatch(query, training, knnMatches, 2);
+    dlog("done matching", logging::LOW);
+
+    return filterMatches(knnMatches, distanceRatioThreshold);
+}
+
 
+MatchDetails filterMatches(const std::vector<std::vector<DMatch>> &knnMatches,
+        float distanceRatioThreshold) {
+    std::vector<DMatch> matches;
 
     /*
      * filter out matches based on our distance ratio threshold of the nearest
      * match and the next nearest match
      */
     std::vector<DMatch> goodMatches;
-    for (auto matchGroup: knnMatches) {
+    for (auto &matchGroup: knnMatches) {
         float ratio = matchGroup[0].distance / matchGroup[1].distance;
         if (ratio > distanceRatioThreshold) {
             continue;
         }
         goodMatches.push_back(matchGroup[0]);
     }
-    dlog("done matching", logging::LOW);
 
 
     /*
@@ -370,26 +335,16 @@ std::ostream &operator<<(std::ostream &out, const PotentialMatch &match) {
 
 MatchInfo::MatchInfo(const PotentialMatch &match, float elapsed): match(match),
         elapsed(elapsed) {
-    design = designInfoData[match.id];
+    design.id = match.id;
+    designStore.lookup(match.id, design);
 
     designUrl = "http://www.threadless.com/product/" + std::to_string(match.id);
 
-    path designFile = designThumbsDir/(std::to_string(match.id) + ".jpg");
-    std::ifstream design(designFile.string(), std::ifstream::binary);
-    Mat designMat = cv::imread(designFile.string());
-    width = designMat.cols;
-    height = designMat.rows;
-
-    design.seekg(0, std::ios::end);
-    int length = design.tellg();
-    design.seekg(0, std::ios::beg);
-
-    char *buffer = new char[length];
-    design.read(buffer, length);
-    design.close();
-
-    thumbnail = g_base64_encode((const uchar*)buffer, length);
-    delete buffer;
+    thumbnail = thumbnails.get(match.id);
+    if (thumbnail) {
+        width = thumbnail->width;
+        height = thumbnail->height;
+    }
 }
 
 
@@ -397,7 +352,7 @@ MatchInfo::MatchInfo(const PotentialMatch &match, float elapsed): match(match),
  * serializes ourself to JSON.  we use double quotes, which should be fine,
  * because our product data has been pre-sanitized for double quotes
  */
-std::string MatchInfo::json() {
+std::string MatchInfo::json(ThumbnailMode thumbnailMode) {
     std::stringstream jsonBuf;
     jsonBuf << "{"
         << "\"id\": " << design.id
@@ -408,8 +363,23 @@ std::string MatchInfo::json() {
         << ", \"artist_url\": \"" << design.artistUrl << "\""
         << ", \"confidence\": " << match.confidence
         << ", \"elapsed\": " << elapsed
-        << ", \"thumbnail\": \"" << thumbnail << "\""
-        << ", \"width\": " << width
+        << ", \"partial\": " << (partial ? "true" : "false")
+        << ", \"scanned\": " << scanned
+        << ", \"cached\": " << (cached ? "true" : "false");
+
+    if (thumbnailMode == ThumbnailMode::INLINE) {
+        jsonBuf << ", \"thumbnail\": \"";
+        if (thumbnail) {
+            jsonBuf << thumbnail->base64;
+        }
+        jsonBuf << "\"";
+    }
+    else if (thumbnailMode == ThumbnailMode::URL && thumbnail) {
+        jsonBuf << ", \"thumbnail_url\": \"/thumbnail/" << design.id
+            << "?v=" << thumbnail->version << "\"";
+    }
+
+    jsonBuf << ", \"width\": " << width
         << ", \"height\": " << height
         << "}";
     return jsonBuf.str();
@@ -417,6 +387,29 @@ std::string MatchInfo::json() {
 
 
 
+/*
+ * the design id a descriptor file is named by, or -1 if it isn't one.  only
+ * "<id>.jpg.sift" counts, so that the manifest, and anything half-written
+ * alongside the descriptors, is skipped
+ */
+int descriptorFileId(const path &descriptorPath) {
+    const std::string suffix = ".jpg.sift";
+    std::string name = descriptorPath.filename().string();
+    if (name.size() <= suffix.size()
+            || name.compare(name.size() - suffix.size(), suffix.size(),
+                suffix) != 0) {
+        return -1;
+    }
+
+    std::string stem = name.substr(0, name.size() - suffix.size());
+    if (stem.size() > 9
+            || stem.find_first_not_of("0123456789") != std::string::npos) {
+        return -1;
+    }
+    return std::stoi(stem);
+}
+
+
 std::vector<Mat> preloadDescriptors(const path &descriptorDirectory) {
     std::vector<Mat> preloaded;
 
@@ -425,18 +418,18 @@ std::vector<Mat> preloadDescriptors(const path &descriptorDirectory) {
 
     auto it = dirIt(descriptorDirectory);
     auto end = dirIt();
-    int maxId = 0;
+    int maxId = -1;
     while (it != end) {
         path descriptorPath = (*it).path();
         it++;
 
-        int id = std::stoi(descriptorPath.stem().string());
+        int id = descriptorFileId(descriptorPath);
         if (id > maxId) {
             maxId = id;
         }
     }
 
-    for (int i=0; i<maxId; i++){
+    for (int i=0; i<=maxId; i++){
         path descriptorPath = descriptorDirectory/(std::to_string(i) + ".jpg.sift");
         dlog("loading " << descriptorPath, logging::LOW);
 
@@ -450,29 +443,223 @@ std::vector<Mat> preloadDescriptors(const path &descriptorDirectory) {
 }
 
 
+bool SearchContext::expired() const {
+    return deadline > 0 && logging::timestamp() >= deadline;
+}
+
+
 /*
- * takes an input file path and returns the best match it can find for that
- * design
+ * how long refining usually takes, so that a search with a deadline can stop
+ * its initial scan early enough to leave time for it
  */
-MatchInfo findBestMatch(const path &fileNameToMatch,
+std::atomic<double> averageRefineTime(0);
+const double REFINE_SMOOTHING = 0.2;
+
+/*
+ * how many designs, in search order, we scan in parallel at a time
+ */
+const size_t SEARCH_WAVE_SIZE = 4096;
+
+
+/*
+ * takes an input image and returns the best match it can find for that
+ * design, within context's deadline.  with a batcher, the initial scan is
+ * shared with whatever other searches are running at the same time
+ */
+MatchInfo findBestMatch(const Mat &imageToMatch,
         const std::vector<Mat> &descriptors, int numBestMatches,
         float distanceRatioThreshold, SIFT &sifter, SIFT &refineSifter,
-        bool multithreaded) {
+        bool multithreaded, SearchContext &context, QueryBatcher *batcher) {
 
-    dlog("finding single best match for " << fileNameToMatch, logging::HIGH);
+    dlog("finding single best match for " << imageToMatch.cols << "x"
+        << imageToMatch.rows << " image", logging::HIGH);
 
     double start = logging::timestamp();
-    auto matches = findBestMatches(fileNameToMatch, descriptors, numBestMatches,
-        distanceRatioThreshold, sifter, multithreaded);
-    PotentialMatch bestMatch = ofBestMatchesGetOne(fileNameToMatch, descriptors,
-        matches, refineSifter);
+    Mat coarseQuery = computeDescriptors(imageToMatch, sifter);
+    double coarseExtracted = logging::timestamp();
+    Mat refineQuery = computeDescriptors(imageToMatch, refineSifter);
+    double refineExtracted = logging::timestamp();
+    context.coarseExtractTime = coarseExtracted - start;
+    context.refineExtractTime = refineExtracted - coarseExtracted;
+    tracing::record("coarse_extract", tracing::current(), start,
+        coarseExtracted, coarseQuery.rows);
+    tracing::record("refine_extract", tracing::current(), coarseExtracted,
+        refineExtracted, refineQuery.rows);
+
+    MatchInfo info = findBestMatchForDescriptors(coarseQuery, refineQuery,
+        descriptors, numBestMatches, distanceRatioThreshold, multithreaded,
+        context, batcher);
+    info.elapsed = logging::timestamp() - start;
+    return info;
+}
+
+
+/*
+ * the same as findBestMatch, but for descriptors that have already been
+ * extracted from the image: coarseQuery for the initial scan, and
+ * refineQuery for refining what it comes up with
+ */
+MatchInfo findBestMatchForDescriptors(const Mat &coarseQuery,
+        const Mat &refineQuery, const std::vector<Mat> &descriptors,
+        int numBestMatches, float distanceRatioThreshold, bool multithreaded,
+        SearchContext &context, QueryBatcher *batcher) {
+
+    double start = logging::timestamp();
+
+    SearchContext coarseContext = context;
+    if (context.deadline > 0) {
+        coarseContext.deadline -= averageRefineTime;
+    }
+    std::vector<PotentialMatch> matches;
+    if (batcher) {
+        matches = batcher->search(coarseQuery, coarseContext);
+    }
+    else {
+        std::vector<Mat> queries{coarseQuery};
+        std::vector<SearchContext> contexts{coarseContext};
+        matches = findBestMatchesBatch(queries, descriptors, numBestMatches,
+            distanceRatioThreshold, multithreaded, contexts)[0];
+        coarseContext = contexts[0];
+    }
+    context.partial = coarseContext.partial;
+    context.scanned = coarseContext.scanned;
+    context.shortlist = matches;
+
+    double refineStart = logging::timestamp();
+    context.coarseSearchTime = refineStart - start;
+    PotentialMatch bestMatch = refineMatches(refineQuery, descriptors,
+        matches, distanceRatioThreshold, context);
+    double refineElapsed = logging::timestamp() - refineStart;
+    context.refineMatchTime = refineElapsed;
+    tracing::record("coarse_search", tracing::current(), start, refineStart,
+        context.scanned);
+    tracing::record("refine_match", tracing::current(), refineStart,
+        refineStart + refineElapsed, matches.size());
+
+    /*
+     * other searches are updating this too, so it's swapped in rather than
+     * assigned, or their updates would be lost
+     */
+    double average = averageRefineTime.load(std::memory_order_relaxed);
+    while (!averageRefineTime.compare_exchange_weak(average,
+            average + REFINE_SMOOTHING * (refineElapsed - average),
+            std::memory_order_relaxed)) {
+    }
+
     double elapsed = logging::timestamp() - start;
 
-    dlog("best match " << bestMatch << " for " << fileNameToMatch
-        << " took " << elapsed << " seconds", logging::HIGH);
+    dlog("best match " << bestMatch << " took " << elapsed << " seconds"
+        << (context.partial ? ", partial" : ""), logging::HIGH);
 
     MatchInfo info(bestMatch, elapsed);
+    info.partial = context.partial;
+    info.scanned = context.scanned;
+
+    return info;
+}
+
+
+/*
+ * finds the best match for each of several images, sharing a single pass
+ * over the designs between all of them.  each image is refined on its own
+ * after that, and found is called with its index and result as soon as it's
+ * done, so results can go out one at a time rather than all at the end
+ */
+void findBestMatchBatch(const std::vector<Mat> &images,
+        const std::vector<Mat> &descriptors, int numBestMatches,
+        float distanceRatioThreshold, SIFT &sifter, SIFT &refineSifter,
+        bool multithreaded, std::vector<SearchContext> &contexts,
+        const std::function<void(size_t, MatchInfo &)> &found) {
+
+    double start = logging::timestamp();
+
+    std::vector<Mat> queries(images.size());
+    uint64_t trace = tracing::current();
+    auto extract = [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t i=r.begin(); i!=r.end(); i++) {
+            double extractStart = logging::timestamp();
+            queries[i] = computeDescriptors(images[i], sifter);
+            double extracted = logging::timestamp();
+            contexts[i].coarseExtractTime = extracted - extractStart;
+            tracing::record("coarse_extract", trace, extractStart, extracted,
+                queries[i].rows);
+        }
+    };
+    tbb::blocked_range<size_t> range(0, images.size());
+    if (multithreaded) {
+        tbb::parallel_for(range, extract);
+    }
+    else {
+        extract(range);
+    }
+
+    double searchStart = logging::timestamp();
+    auto shortlists = findBestMatchesBatch(queries, descriptors,
+        numBestMatches, distanceRatioThreshold, multithreaded, contexts);
+    double searchElapsed = logging::timestamp() - searchStart;
+    tracing::record("coarse_search", trace, searchStart,
+        searchStart + searchElapsed, images.size());
+
+    for (size_t i=0; i<images.size(); i++) {
+        contexts[i].shortlist = shortlists[i];
+        contexts[i].coarseSearchTime = searchElapsed;
+
+        double refineStart = logging::timestamp();
+        Mat refineQuery = computeDescriptors(images[i], refineSifter);
+        double refineExtracted = logging::timestamp();
+        PotentialMatch bestMatch = refineMatches(refineQuery, descriptors,
+            shortlists[i], distanceRatioThreshold, contexts[i]);
+        double refined = logging::timestamp();
+        contexts[i].refineExtractTime = refineExtracted - refineStart;
+        contexts[i].refineMatchTime = refined - refineExtracted;
+        tracing::record("refine_extract", trace, refineStart, refineExtracted,
+            refineQuery.rows);
+        tracing::record("refine_match", trace, refineExtracted, refined,
+            shortlists[i].size());
+
+        MatchInfo info(bestMatch, logging::timestamp() - start);
+        info.partial = contexts[i].partial;
+        info.scanned = contexts[i].scanned;
+        found(i, info);
+    }
+
+    dlog("batch of " << images.size() << " matched in "
+        << (logging::timestamp() - start) << " seconds", logging::HIGH);
+}
 
+
+/*
+ * refines an image against a shortlist from an earlier search, instead of
+ * searching all the designs again.  used when we expect the image to show
+ * the same design as the one the shortlist came from, like consecutive
+ * frames from a camera.  the confidence is measured against how the
+ * shortlist scored in its original search
+ */
+MatchInfo verifyShortlist(const Mat &image,
+        const std::vector<Mat> &descriptors,
+        std::vector<PotentialMatch> &shortlist, float distanceRatioThreshold,
+        SIFT &refineSifter, SearchContext &context) {
+
+    double start = logging::timestamp();
+    Mat refineQuery = computeDescriptors(image, refineSifter);
+    double extracted = logging::timestamp();
+    PotentialMatch bestMatch = refineMatches(refineQuery, descriptors,
+        shortlist, distanceRatioThreshold, context);
+    double elapsed = logging::timestamp() - start;
+    context.refineExtractTime = extracted - start;
+    context.refineMatchTime = elapsed - context.refineExtractTime;
+    tracing::record("refine_extract", tracing::current(), start, extracted,
+        refineQuery.rows);
+    tracing::record("refine_match", tracing::current(), extracted,
+        start + elapsed, shortlist.size());
+
+    dlog("verified " << bestMatch << " against a shortlist of "
+        << shortlist.size() << " in " << elapsed << " seconds",
+        logging::MEDIUM);
+
+    MatchInfo info(bestMatch, elapsed);
+    info.partial = context.partial;
+    context.shortlist = shortlist;
     return info;
 }
 
@@ -482,12 +669,24 @@ MatchInfo findBestMatch(const path &fileNameToMatch,
  * performing additional checks and optimizations.  the resulting match has
  * its confidence value set according to the results of some training data
  */
-PotentialMatch ofBestMatchesGetOne(const path &fileNameToMatch,
+PotentialMatch ofBestMatchesGetOne(const Mat &image,
         const std::vector<Mat> &descriptors,
-        std::vector<PotentialMatch> &matches, SIFT &sifter) {
+        std::vector<PotentialMatch> &matches, float distanceRatioThreshold,
+        SIFT &sifter, SearchContext &context) {
+
+    return refineMatches(computeDescriptors(image, sifter), descriptors,
+        matches, distanceRatioThreshold, context);
+}
+
+/*
+ * ofBestMatchesGetOne, for an image whose descriptors we already have
+ */
+PotentialMatch refineMatches(const Mat &imageToMatch,
+        const std::vector<Mat> &descriptors,
+        std::vector<PotentialMatch> &matches, float distanceRatioThreshold,
+        SearchContext &context) {
 
     BFMatcher matcher(NORM_L2, false);
-    Mat imageToMatch = computeDescriptors(fileNameToMatch, sifter);
 
 
     /*
@@ -496,17 +695,25 @@ PotentialMatch ofBestMatchesGetOne(const path &fileNameToMatch,
      * about 10% of accuracy when we use a smaller query descriptor cap
      * (resulting in a faster initial search)
      */
+    if (matches.empty()) {
+        return PotentialMatch();
+    }
+
     PotentialMatch bestMatch = matches[0];
     std::vector<int> numMatches;
     for (auto possibleMatch: matches) {
 
         if (possibleMatch.id < 0) {
+            continue;
+        }
+        if (context.expired()) {
+            context.partial = true;
             break;
         }
 
         Mat candidateDescriptor = descriptors[possibleMatch.id];
         MatchDetails details = compareImageToDesign(imageToMatch,
-            candidateDescriptor, matcher, 0.75);
+            candidateDescriptor, matcher, distanceRatioThreshold);
 
         if (details.numMatches > bestMatch.details.numMatches) {
             bestMatch.id = possibleMatch.id;
@@ -517,6 +724,15 @@ PotentialMatch ofBestMatchesGetOne(const path &fileNameToMatch,
     }
 
 
+    /*
+     * nothing to compare against, if we ran out of time before refining
+     * anything
+     */
+    if (numMatches.empty()) {
+        bestMatch.confidence = 0;
+        return bestMatch;
+    }
+
     float mean = std::accumulate(numMatches.begin(), numMatches.end(), 0) / float(numMatches.size());
     float variance = 0;
     for (int num: numMatches) {
@@ -544,25 +760,51 @@ PotentialMatch ofBestMatchesGetOne(const path &fileNameToMatch,
 }
 
 
+/*
+ * one query's part in a coarse pass: its descriptors, its results (one per
+ * design, by id), and how far it got before its deadline
+ */
+struct CoarseQuery {
+    Mat descriptors;
+    double deadline = 0;
+    std::vector<PotentialMatch> results;
+    std::atomic_bool expired{false};
+    std::atomic_int scanned{0};
+};
+
+
 /*
  * this functor is contains parallelizable matching code.  it can be fed into
  * TBB's parallel_for or used serially, so long as the blocked_range passed
- * into operator() is correct
+ * into operator() is correct.  the range is over positions in the search
+ * order rather than design ids.  each design is compared against every query
+ * in the pass back to back, so its descriptors come in from memory once and
+ * stay in cache for the rest.  a query whose deadline has passed drops out
+ * of the pass, and the pass stops once every query has
  */
 class MatchFunctor {
 public:
-    MatchFunctor(const Mat &imageToMatch, const std::vector<Mat> &descriptors,
-        float distanceRatioThreshold, std::vector<PotentialMatch> &results):
-        imageToMatch(imageToMatch), descriptors(descriptors),
-        distanceRatioThreshold(distanceRatioThreshold), results(results) {
+    MatchFunctor(std::vector<CoarseQuery> &queries,
+        const std::vector<Mat> &descriptors, float distanceRatioThreshold,
+        const std::vector<int> *order):
+        queries(queries), descriptors(descriptors),
+        distanceRatioThreshold(distanceRatioThreshold), order(order),
+        trace(tracing::current()) {
     }
 
     void operator()(const tbb::blocked_range<size_t>& r) const {
         BFMatcher matcher(NORM_L2, false);
 
         double start = logging::timestamp();
+        int compared = 0;
+        std::vector<int> scanned(queries.size(), 0);
 
-        for (size_t i=r.begin(); i!=r.end(); i++) {
+        for (size_t pos=r.begin(); pos!=r.end(); pos++) {
+            if (allExpired()) {
+                break;
+            }
+
+            size_t i = order ? (*order)[pos] : pos;
             Mat candidateDescriptor = descriptors[i];
 
             if (candidateDescriptor.cols == 0) {
@@ -570,23 +812,59 @@ public:
                 continue;
             }
 
-            results[i].id = i;
-            results[i].details = compareImageToDesign(imageToMatch,
-                candidateDescriptor, matcher, distanceRatioThreshold);
+            double now = logging::timestamp();
+            for (size_t q=0; q<queries.size(); q++) {
+                CoarseQuery &query = queries[q];
+                if (query.expired) {
+                    continue;
+                }
+                if (query.deadline > 0 && now >= query.deadline) {
+                    query.expired = true;
+                    continue;
+                }
+
+                query.results[i].id = i;
+                query.results[i].details = compareImageToDesign(
+                    query.descriptors, candidateDescriptor, matcher,
+                    distanceRatioThreshold);
+                scanned[q]++;
+                compared++;
+            }
+        }
+
+        for (size_t q=0; q<queries.size(); q++) {
+            queries[q].scanned += scanned[q];
         }
 
         double elapsed = logging::timestamp() - start;
-        float average = elapsed / r.size();
+        float average = elapsed / std::max(compared, 1);
 
-        dlog("performed " << r.size() << " comparisons, averaged " << average
+        /*
+         * one span per chunk, on whichever thread TBB ran it on, so that
+         * stragglers in the parallel_for show up in the trace
+         */
+        tracing::record("scan_chunk", trace, start, start + elapsed,
+            compared);
+
+        dlog("performed " << compared << " comparisons, averaged " << average
             << " seconds per comparison", logging::LOW);
     }
 
+    bool allExpired() const {
+        for (auto &query: queries) {
+            if (!query.expired) {
+                return false;
+            }
+        }
+        return true;
+    }
+
 private:
-    const Mat &imageToMatch;
+    std::vector<CoarseQuery> &queries;
     const std::vector<Mat> &descriptors;
     float distanceRatioThreshold;
-    std::vector<PotentialMatch> &results;
+    const std::vector<int> *order;
+    uint64_t trace;
 };
 
 
@@ -597,273 +875,105 @@ private:
  * performs additional checks to increase the accuracy and return a single
  * match
  */
-std::vector<PotentialMatch> findBestMatches(const path &fileNameToMatch,
+std::vector<PotentialMatch> findBestMatches(const Mat &image,
         const std::vector<Mat> &descriptors, int numBestMatches,
-        float distanceRatioThreshold, SIFT &sifter, bool multithreaded) {
-
-    Mat imageToMatch = computeDescriptors(fileNameToMatch, sifter);
-
-
-    std::vector<PotentialMatch> results(descriptors.size());
-    MatchFunctor fn(imageToMatch, descriptors, distanceRatioThreshold, results);
-    tbb::blocked_range<size_t> range(0, descriptors.size());
-
-    if (multithreaded) {
-        tbb::parallel_for(range, fn);
-    }
-    else {
-        fn(range);
-    }
-
-
-    dlog("sorting and filtering to " << numBestMatches << " best matches", logging::HIGH);
-    std::sort_heap(results.begin(), results.end(), std::greater<PotentialMatch>());
-
-    std::vector<PotentialMatch> bestResults;
-    for (int i=0; i<numBestMatches; i++) {
-        bestResults.push_back(results[i]);
-    }
-    dlog("done sorting and filtering best matches", logging::HIGH);
-
-    return bestResults;
-}
-
-
+        float distanceRatioThreshold, SIFT &sifter, bool multithreaded,
+        SearchContext &context) {
 
+    std::vector<Mat> queries{computeDescriptors(image, sifter)};
+    std::vector<SearchContext> contexts{context};
 
-
-void shutdown(int param) {
-    dlog("caught signal " << param << ", shutting down", logging::HIGH);
-    server.stop();
-    exit(1);
+    auto results = findBestMatchesBatch(queries, descriptors, numBestMatches,
+        distanceRatioThreshold, multithreaded, contexts);
+    context = contexts[0];
+    return results[0];
 }
 
 
 /*
- * used for testing changes to our optimizations and tuning of SIFT parameters.
- * this just runs through our pre-classified test images and performs a best
- * match, measures the average matching time, and calculates a average accuracy
+ * the same as findBestMatches, but for several queries' descriptors at once,
+ * in a single pass over the designs.  each query keeps its own deadline and
+ * gets its own list back.  the pass scans in the first query's order; all
+ * queries take the order from the same place, so it's rare for them to
+ * differ, and when they do, the orders are only a few hits apart
  */
-void runTest(const path& designDir, const path &testImagesDir,
+std::vector<std::vector<PotentialMatch>> findBestMatchesBatch(
+        const std::vector<Mat> &queryDescriptors,
         const std::vector<Mat> &descriptors, int numBestMatches,
-        float distanceRatioThreshold, SIFT &sifter, SIFT &refineSifter,
-        bool multithreaded) {
+        float distanceRatioThreshold, bool multithreaded,
+        std::vector<SearchContext> &contexts) {
+
+    std::vector<CoarseQuery> queries(queryDescriptors.size());
+    for (size_t q=0; q<queries.size(); q++) {
+        queries[q].descriptors = queryDescriptors[q];
+        queries[q].deadline = contexts[q].deadline;
+        queries[q].results.resize(descriptors.size());
+    }
+
 
     /*
-     * perform the matching on all images in testImagesDir
+     * an order only makes sense if it covers exactly the designs we have
      */
-    double start = logging::timestamp();
-    std::map<int, PotentialMatch> guesses;
-    applyFunctionToImages(testImagesDir, [&](const path& filePath) {
-        int correct = std::stoi(filePath.stem().string());
-        MatchInfo guess = findBestMatch(filePath, descriptors, numBestMatches,
-            distanceRatioThreshold, sifter, refineSifter, multithreaded);
-        guesses[correct] = guess.match;
-    }, 50);
-    double elapsed = logging::timestamp() - start;
+    const std::vector<int> *order = contexts.empty() ? nullptr
+        : contexts[0].order.get();
+    if (order && order->size() != descriptors.size()) {
+        order = nullptr;
+    }
 
+    MatchFunctor fn(queries, descriptors, distanceRatioThreshold, order);
 
     /*
-     * record how far away our best match is as well, so we can refine our
-     * confidence calculations with more data later
+     * parallel_for hands out its range in no particular order, so we feed it
+     * the search order a wave at a time.  that way, if we run out of time,
+     * what we've scanned is the front of the order rather than scattered
+     * pieces of it
      */
-    std::vector<float> correctSTDAway;
-    std::vector<float> incorrectSTDAway;
+    for (size_t begin=0; begin<descriptors.size() && !fn.allExpired();
+            begin+=SEARCH_WAVE_SIZE) {
+        size_t end = std::min(begin + SEARCH_WAVE_SIZE, descriptors.size());
+        tbb::blocked_range<size_t> range(begin, end);
 
-    /*
-     * loop through and figure out how many we got correct, and how many we
-     * didn't
-     */
-    int correctAnswers = 0;
-    int testDesigns = guesses.size();
-    for (auto guess: guesses) {
-        if (guess.first == guess.second.id) {
-            correctAnswers++;
-            correctSTDAway.push_back(guess.second.stdAway);
+        if (multithreaded) {
+            tbb::parallel_for(range, fn);
         }
         else {
-            dlog("bad guess: " << guess.first << " thought " << guess.second.id, logging::HIGH);
-            incorrectSTDAway.push_back(guess.second.stdAway);
+            fn(range);
         }
     }
 
-    dlog("avg match time " << (elapsed / testDesigns) << ", accuracy: "
-        << (correctAnswers / float(testDesigns)), logging::HIGH);
-}
-
-
-/*
- * takes a directory of training designs and computes keypoints and descriptors
- * for all of those images
- */
-void generateDescriptors(const path &imageDir, const path &outputDir,
-        SIFT &sifter, bool skipExists) {
-    if (!boost::filesystem::exists(outputDir)) {
-        boost::filesystem::create_directories(outputDir);
-    }
-    applyFunctionToImages(imageDir, [&](const path& imagePath){
-        generateKeypointsAndDescriptors(imagePath, outputDir, sifter, skipExists);
-    }, 0);
-}
-
-
-
-int main(int argc, char** argv) {
-    int port;
-    int healthyThreshold;
-    bool generateMode;
-    bool testMode;
-    bool singlethreaded;
-
-    namespace opt = boost::program_options;
-    opt::options_description desc("Options");
-    desc.add_options()
-        ("help", "help message")
-        ("base", opt::value<std::string>(),
-            "base directory of our data files")
-        ("port", opt::value<int>(&port)->default_value(8080),
-            "HTTP port to listen on")
-        ("unhealthy", opt::value<int>(&healthyThreshold)->default_value(2),
-            "the number of simultaneous matching requests at which the server becomes unhealthy")
-        ("generate", opt::bool_switch(&generateMode),
-            "generate descriptors")
-        ("singlethreaded", opt::bool_switch(&singlethreaded),
-            "don't parallelize matching with TBB")
-        ("test", opt::bool_switch(&testMode),
-            "run time and accuracy tests")
-    ;
-    opt::variables_map options;
-    opt::store(opt::parse_command_line(argc, argv, desc), options);
-    opt::notify(options);
-
-    if (options.count("help")) {
-        std::cout << desc << "\n";
-        return 1;
-    }
-
-
-    if (!options.count("base")) {
-        std::cerr << "please specify a base directory with --base\n";
-        return 1;
-    }
-
-    DATA_DIR = options["base"].as<std::string>();
-
-    if (!boost::filesystem::exists(DATA_DIR)) {
-        std::cerr << "base directory " << DATA_DIR << " doesn't exist!\n";
-        return 1;
-    }
-
-
-
-
-    /*
-     * a blur sigma of 3.0 seems to be the sweet spot between high accuracy
-     * and low matching time
-     */
-    float sigma = 3.0;
-
-    /*
-     * after graphing the distribution of descriptors over all training images,
-     * 3500 seems to be a good cutoff
-     */
-    int maxTrainDescriptors = 3500;
-
-    /*
-     * where our designs are held
-     */
-    path designsDir = DATA_DIR/"designs";
-    /*
-     * if you want to use tinier thumbnails to stream to clients, specify
-     * another directory here
-     */
-    //path designThumbsDir = DATA_DIR/"design_thumbnails";
-    path designThumbsDir = designsDir;
-
-    std::stringstream descriptorRelativePath;
-    descriptorRelativePath << "descriptors-" << maxTrainDescriptors << "-"
-        << std::setprecision(2) << sigma;
-    path descriptorDir = DATA_DIR/descriptorRelativePath.str();
-
-    /*
-     * where our testing images are held, for running accuracy tests on
-     * optimizations.  the images in this directory have been pre-cropped and
-     * flipped (if they were taken in a mirror), and the filename of the image
-     * is the correct design
-     */
-    path testImagesDir = DATA_DIR/"test_images";
-
-
-    /*
-     * SIFT parameters
-     */
-    int octaves = 3;
-    float contrastThreshold = 0.04;
-    float edgeThreshold = 10;
-    int numMatches = 80;
-    float thresholdRatio = 0.75;
-
-    /*
-     * sifters used in various stages.  "sifter" is used for our initial
-     * comparisons, and therefore uses a low number of features for speed.
-     * "refineSifter" is a second pass that runs on the numMatches best matches
-     * from "sifter"'s comparisons.  "generateSifter" is for generating our
-     * descriptors from our initial design data, and is only used for
-     * --generate
-     */
-    SIFT sifter(80, octaves, contrastThreshold, edgeThreshold, sigma);
-    SIFT refineSifter(300, octaves, contrastThreshold, edgeThreshold, sigma);
-    SIFT generateSifter(maxTrainDescriptors, octaves, contrastThreshold,
-        edgeThreshold, sigma);
 
     /*
-     * our mapping of product id to product info
+     * designs we never got to, or that have no descriptors, keep their
+     * default PotentialMatch, with an id of -1.  they're dropped, rather than
+     * left to tie with designs we did scan and found nothing in
      */
-    MatchInfo::designInfoData = loadDesignInfoData(DATA_DIR/"prod_mapping.yaml");
-    MatchInfo::designThumbsDir = designThumbsDir;
-
-    if (generateMode) {
-        generateDescriptors(designsDir, descriptorDir, generateSifter, true);
-        return 0;
-    }
-
-    /*
-     * preload our 6GB+ of image descriptors.  this will take around half a
-     * minute or so.  they're used for all the image matching
-     */
-    std::vector<Mat> descriptors = preloadDescriptors(descriptorDir);
-
-
-    if (testMode) {
-        runTest(designsDir, testImagesDir, descriptors, numMatches, thresholdRatio,
-            sifter, refineSifter, !singlethreaded);
-        return 0;
+    dlog("sorting and filtering to " << numBestMatches << " best matches", logging::HIGH);
+    std::vector<std::vector<PotentialMatch>> bestResults;
+    for (size_t q=0; q<queries.size(); q++) {
+        auto &results = queries[q].results;
+        contexts[q].partial = contexts[q].partial || queries[q].expired;
+        contexts[q].scanned = queries[q].scanned;
+
+        results.erase(std::remove_if(results.begin(), results.end(),
+            [](const PotentialMatch &match) {
+                return match.id < 0;
+            }), results.end());
+
+        bestResults.push_back(topMatches(results, numBestMatches));
     }
+    dlog("done sorting and filtering best matches", logging::HIGH);
 
-    /*
-     * set the matcher our server should use to match images.  it's just a
-     * closure with some preset defaults
-     */
-    server.setMatcher([&descriptors, &sifter, &refineSifter, numMatches,
-        thresholdRatio, singlethreaded](const path &imagePath)->MatchInfo{
-        MatchInfo info = findBestMatch(imagePath, descriptors, numMatches,
-                thresholdRatio, sifter,	refineSifter, !singlethreaded);
-        return info;
-    });
-
-    server.setHealthyThreshold(healthyThreshold);
-
-    /*
-     * set up our signal handler and launch the web server
-     */
-    signal(SIGTERM, shutdown);
-    server.serve(port);
-
-
-    while (true) {
-        sleep(1);
-    }
+    return bestResults;
+}
 
 
-    return 0;
+/*
+ * the numBest best of results, best first.  results is left partially sorted
+ */
+std::vector<PotentialMatch> topMatches(std::vector<PotentialMatch> &results,
+        int numBest) {
+    size_t count = std::min(size_t(numBest), results.size());
+    std::partial_sort(results.begin(), results.begin() + count,
+        results.end(), std::greater<PotentialMatch>());
+    return std::vector<PotentialMatch>(results.begin(), results.begin() + count);
 }
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "sweep.h"
+#include "evaluation.h"
+#include "generate.h"
+#include "logging.h"
+
+
+size_t SweepGrid::size() const {
+    return sigmas.size() * trainDescriptors.size() * coarseFeatures.size()
+        * refineFeatures.size() * numMatches.size() * ratios.size();
+}
+
+
+/*
+ * at least as good on accuracy, both latencies and memory, and better on
+ * at least one of them
+ */
+bool SweepResult::dominates(const SweepResult &other) const {
+    bool noWorse = accuracy >= other.accuracy && p50 <= other.p50
+        && p99 <= other.p99 && descriptorBytes <= other.descriptorBytes;
+    bool better = accuracy > other.accuracy || p50 < other.p50
+        || p99 < other.p99 || descriptorBytes < other.descriptorBytes;
+    return noWorse && better;
+}
+
+std::string SweepResult::json() const {
+    std::stringstream buf;
+    buf << std::setprecision(6);
+    buf << "{\"sigma\": " << sigma
+        << ", \"train_descriptors\": " << trainDescriptors
+        << ", \"coarse_features\": " << coarseFeatures
+        << ", \"refine_features\": " << refineFeatures
+        << ", \"num_matches\": " << numMatches
+        << ", \"ratio\": " << ratio
+        << ", \"accuracy\": " << accuracy
+        << ", \"recall\": " << recall
+        << ", \"p50\": " << p50
+        << ", \"p99\": " << p99
+        << ", \"throughput\": " << throughput
+        << ", \"descriptor_bytes\": " << descriptorBytes
+        << "}";
+    return buf.str();
+}
+
+
+/*
+ * a comma separated list of values, like "60,80,120"
+ */
+bool parseList(const std::string &list, std::vector<int> &values) {
+    values.clear();
+    std::stringstream buf(list);
+    std::string item;
+    while (std::getline(buf, item, ',')) {
+        char *end;
+        long value = strtol(item.c_str(), &end, 10);
+        if (end == item.c_str() || *end != '\0') {
+            return false;
+        }
+        values.push_back(value);
+    }
+    return !values.empty();
+}
+
+bool parseList(const std::string &list, std::vector<float> &values) {
+    values.clear();
+    std::stringstream buf(list);
+    std::string item;
+    while (std::getline(buf, item, ',')) {
+        char *end;
+        float value = strtof(item.c_str(), &end);
+        if (end == item.c_str() || *end != '\0') {
+            return false;
+        }
+        values.push_back(value);
+    }
+    return !values.empty();
+}
+
+
+/*
+ * the results that no other result dominates, by index
+ */
+std::vector<size_t> paretoFront(const std::vector<SweepResult> &results) {
+    std::vector<size_t> front;
+    for (size_t i=0; i<results.size(); i++) {
+        bool dominated = false;
+        for (size_t j=0; j<results.size() && !dominated; j++) {
+            dominated = j != i && results[j].dominates(results[i]);
+        }
+        if (!dominated) {
+            front.push_back(i);
+        }
+    }
+    return front;
+}
+
+std::string sweepJson(const std::vector<SweepResult> &results) {
+    std::vector<size_t> front = paretoFront(results);
+
+    std::stringstream buf;
+    buf << "{\"configurations\": [";
+    for (size_t i=0; i<results.size(); i++) {
+        buf << (i ? ",\n    " : "\n    ") << results[i].json();
+    }
+    buf << "],\n\"pareto\": [";
+    for (size_t i=0; i<front.size(); i++) {
+        buf << (i ? ",\n    " : "\n    ") << results[front[i]].json();
+    }
+    buf << "]}\n";
+    return buf.str();
+}
+
+
+/*
+ * every combination of the grid's search-time parameters, the ones that
+ * don't need the descriptors regenerated
+ */
+std::vector<SweepResult> searchConfigurations(const SweepGrid &grid) {
+    std::vector<SweepResult> configurations;
+    for (int coarse: grid.coarseFeatures) {
+        for (int refine: grid.refineFeatures) {
+            for (int numMatches: grid.numMatches) {
+                for (float ratio: grid.ratios) {
+                    SweepResult config;
+                    config.coarseFeatures = coarse;
+                    config.refineFeatures = refine;
+                    config.numMatches = numMatches;
+                    config.ratio = ratio;
+                    configurations.push_back(config);
+                }
+            }
+        }
+    }
+    return configurations;
+}
+
+
+/*
+ * runs the evaluation harness for every configuration in the grid.  the
+ * design descriptors only depend on sigma and the training cap, so those
+ * are the outer loops: each descriptor set is generated (or brought up to
+ * date, which is quick if it already was) and loaded once, and every
+ * configuration that uses it is run before moving on.  the results so far
+ * are rewritten to outFile after each configuration, so a long sweep that's
+ * cut short still leaves something behind
+ */
+std::vector<SweepResult> runSweep(const path &base, const path &designsDir,
+        const path &testImagesDir, const SweepGrid &grid, int octaves,
+        float contrastThreshold, float edgeThreshold, int targetLongEdge,
+        bool multithreaded, int limit, int parallelism, const path &outFile) {
+
+    std::vector<SweepResult> results;
+    size_t total = grid.size();
+
+    for (float sigma: grid.sigmas) {
+        for (int train: grid.trainDescriptors) {
+            path descriptorDir = descriptorDirectory(base, train, sigma);
+            SiftParams generateParams = {train, octaves, contrastThreshold,
+                edgeThreshold, sigma};
+            generateDescriptors(designsDir, descriptorDir, generateParams,
+                multithreaded);
+
+            std::vector<Mat> descriptors = preloadDescriptors(descriptorDir);
+            size_t descriptorBytes = 0;
+            for (auto &d: descriptors) {
+                descriptorBytes += d.total() * d.elemSize();
+            }
+
+            for (auto result: searchConfigurations(grid)) {
+                result.sigma = sigma;
+                result.trainDescriptors = train;
+
+                SIFT sifter = SiftParams{result.coarseFeatures, octaves,
+                    contrastThreshold, edgeThreshold, sigma}.create();
+                SIFT refineSifter = SiftParams{result.refineFeatures, octaves,
+                    contrastThreshold, edgeThreshold, sigma}.create();
+
+                Evaluation evaluation = evaluate(testImagesDir, descriptors,
+                    result.numMatches, result.ratio, sifter, refineSifter,
+                    targetLongEdge, multithreaded, limit, parallelism);
+                Distribution latency = evaluation.latency();
+
+                result.accuracy = evaluation.accuracy();
+                result.recall = evaluation.recall(result.numMatches);
+                result.p50 = latency.p50;
+                result.p99 = latency.p99;
+                result.throughput = evaluation.wallTime > 0
+                    ? evaluation.outcomes.size() / evaluation.wallTime : 0;
+                result.descriptorBytes = descriptorBytes;
+                results.push_back(result);
+
+                alog("sweep " << results.size() << "/" << total << ": "
+                    << result.json(), logging::HIGH);
+
+                if (!outFile.empty()) {
+                    std::ofstream handle(outFile.string());
+                    handle << sweepJson(results);
+                }
+            }
+        }
+    }
+
+    return results;
+}
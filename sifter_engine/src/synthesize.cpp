@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*
+ * makes a synthetic catalog that the engine can be run against in place of
+ * the real design data: designs/, prod_mapping.yaml and test_images/, laid
+ * out the way main expects them under --base.  the descriptors, thumbnails
+ * and design store come from running sifter --generate on it afterwards.
+ *
+ * every design and photo is drawn from its own RNG, seeded from --seed and
+ * its id, so a catalog can be made in parallel, and grown by running again
+ * with more --designs; designs that already exist are left alone
+ */
+
+
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <atomic>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+#include <tbb/tbb.h>
+
+#include "synthetic.h"
+#include "logging.h"
+
+namespace fs = boost::filesystem;
+
+
+/*
+ * which stream of a design's RNG each thing is drawn from
+ */
+enum {DESIGN_STREAM, PHOTO_STREAM, INFO_STREAM};
+
+const int JPEG_QUALITY = 90;
+
+
+fs::path designFile(const fs::path &dir, int id) {
+    return dir/(std::to_string(id) + ".jpg");
+}
+
+
+int main(int argc, char** argv) {
+    std::string out;
+    int numDesigns;
+    int width;
+    int height;
+    int numTestImages;
+    int photoSize;
+    uint64_t seed;
+    PhotoDistortion distortion;
+    bool singlethreaded;
+
+    namespace opt = boost::program_options;
+    opt::options_description desc("Options");
+    desc.add_options()
+        ("help", "help message")
+        ("out", opt::value<std::string>(&out),
+            "base directory to make the catalog in")
+        ("designs", opt::value<int>(&numDesigns)->default_value(1000),
+            "number of designs, with ids from 1")
+        ("width", opt::value<int>(&width)->default_value(600),
+            "width of each design, in pixels")
+        ("height", opt::value<int>(&height)->default_value(750),
+            "height of each design, in pixels")
+        ("test-images", opt::value<int>(&numTestImages)->default_value(200),
+            "number of test photos, each of a different design")
+        ("photo-size", opt::value<int>(&photoSize)->default_value(640),
+            "long edge of the test photos, in pixels")
+        ("perspective", opt::value<float>(&distortion.perspective)->default_value(0.08),
+            "how far each corner of a photo can move, as a fraction of its size")
+        ("rotation", opt::value<float>(&distortion.rotation)->default_value(10),
+            "largest rotation of a photo, in degrees")
+        ("blur", opt::value<float>(&distortion.blur)->default_value(1.5),
+            "largest blur sigma of a photo")
+        ("lighting", opt::value<float>(&distortion.lighting)->default_value(0.3),
+            "largest change in a photo's brightness, as a fraction")
+        ("noise", opt::value<float>(&distortion.noise)->default_value(8),
+            "largest standard deviation of a photo's sensor noise")
+        ("seed", opt::value<uint64_t>(&seed)->default_value(1),
+            "seed everything is drawn from")
+        ("singlethreaded", opt::bool_switch(&singlethreaded),
+            "don't parallelize with TBB")
+    ;
+
+    opt::variables_map options;
+    opt::store(opt::parse_command_line(argc, argv, desc), options);
+    opt::notify(options);
+
+    if (options.count("help")) {
+        std::cout << desc << "\n";
+        return 1;
+    }
+
+    if (out.empty()) {
+        std::cerr << "please specify a directory to make the catalog in with "
+            "--out\n";
+        return 1;
+    }
+    if (numDesigns < 1 || width < 16 || height < 16) {
+        std::cerr << "need at least one design, of at least 16x16\n";
+        return 1;
+    }
+    numTestImages = std::min(numTestImages, numDesigns);
+
+    fs::path base(out);
+    fs::path designsDir = base/"designs";
+    fs::path testImagesDir = base/"test_images";
+    fs::create_directories(designsDir);
+    fs::create_directories(testImagesDir);
+
+    std::vector<int> params = {CV_IMWRITE_JPEG_QUALITY, JPEG_QUALITY};
+
+
+    /*
+     * the designs themselves
+     */
+    double start = logging::timestamp();
+    std::atomic_int drawn(0);
+    auto drawDesigns = [&](const tbb::blocked_range<int> &r) {
+        for (int id=r.begin(); id!=r.end(); id++) {
+            fs::path file = designFile(designsDir, id);
+            if (fs::exists(file)) {
+                continue;
+            }
+
+            cv::RNG rng = seededRng(seed, id, DESIGN_STREAM);
+            cv::Mat design = syntheticDesign(width, height, rng);
+
+            fs::path tmpFile = file.string() + ".tmp.jpg";
+            cv::imwrite(tmpFile.string(), design, params);
+            fs::rename(tmpFile, file);
+
+            int done = ++drawn;
+            if (done % 1000 == 0) {
+                alog("drew " << done << " designs", logging::HIGH);
+            }
+        }
+    };
+
+    tbb::blocked_range<int> designRange(1, numDesigns + 1);
+    if (singlethreaded) {
+        drawDesigns(designRange);
+    }
+    else {
+        tbb::parallel_for(designRange, drawDesigns);
+    }
+    alog("drew " << drawn << " designs in " << designsDir << " in "
+        << (logging::timestamp() - start) << " seconds, "
+        << (numDesigns - drawn) << " already existed", logging::HIGH);
+
+
+    /*
+     * the design info, in the same yaml as the real prod_mapping.yaml
+     */
+    fs::path yamlFile = base/"prod_mapping.yaml";
+    cv::FileStorage yaml(yamlFile.string(), cv::FileStorage::WRITE);
+    yaml << "product_mapping" << "{";
+    for (int id=1; id<=numDesigns; id++) {
+        cv::RNG rng = seededRng(seed, id, INFO_STREAM);
+        std::string artist = "artist" + std::to_string(rng.uniform(1, 5000));
+
+        std::stringstream added;
+        added << rng.uniform(2000, 2014) << "-" << std::setfill('0')
+            << std::setw(2) << rng.uniform(1, 13) << "-" << std::setw(2)
+            << rng.uniform(1, 29);
+
+        yaml << ("p" + std::to_string(id)) << "{"
+            << "artist" << artist
+            << "title" << syntheticTitle(rng)
+            << "added" << added.str()
+            << "url" << ("http://www.threadless.com/profile/0/" + artist)
+            << "}";
+    }
+    yaml << "}";
+    yaml.release();
+    alog("wrote " << yamlFile, logging::HIGH);
+
+
+    /*
+     * photos of a sample of the designs, as they were saved, named by the
+     * design they're of, as --test wants them.  the sample is a partial shuffle of the ids, so it
+     * doesn't depend on how many photos are asked for beyond its length
+     */
+    std::vector<int> ids(numDesigns);
+    for (int i=0; i<numDesigns; i++) {
+        ids[i] = i + 1;
+    }
+    cv::RNG sampleRng = seededRng(seed, 0, PHOTO_STREAM);
+    for (int i=0; i<numTestImages; i++) {
+        std::swap(ids[i], ids[sampleRng.uniform(i, numDesigns)]);
+    }
+
+    auto takePhotos = [&](const tbb::blocked_range<int> &r) {
+        for (int i=r.begin(); i!=r.end(); i++) {
+            int id = ids[i];
+            cv::Mat design = cv::imread(designFile(designsDir, id).string());
+            if (design.empty()) {
+                dlog("couldn't read design " << id, logging::HIGH);
+                continue;
+            }
+
+            cv::RNG photoRng = seededRng(seed, id, PHOTO_STREAM);
+            cv::Mat photo = syntheticPhoto(design, photoSize, photoRng,
+                distortion);
+            cv::imwrite(designFile(testImagesDir, id).string(), photo, params);
+        }
+    };
+
+    tbb::blocked_range<int> photoRange(0, numTestImages);
+    if (singlethreaded) {
+        takePhotos(photoRange);
+    }
+    else {
+        tbb::parallel_for(photoRange, takePhotos);
+    }
+    alog("took " << numTestImages << " test photos in " << testImagesDir,
+        logging::HIGH);
+
+    std::cout << "now run: sifter --base " << base.string() << " --generate\n";
+    return 0;
+}
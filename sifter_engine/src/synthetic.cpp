@@ -0,0 +1,169 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "synthetic.h"
+
+
+const char *ADJECTIVES[] = {"electric", "sleepy", "cosmic", "tiny", "angry",
+    "haunted", "golden", "wild", "paper", "broken", "secret", "neon"};
+const char *NOUNS[] = {"robot", "forest", "whale", "taco", "monster", "city",
+    "owl", "planet", "ghost", "octopus", "garden", "machine"};
+
+
+cv::RNG seededRng(uint64_t seed, uint64_t id, uint64_t stream) {
+    /*
+     * splitmix64, so that neighbouring ids don't get neighbouring states
+     */
+    uint64_t state = seed ^ (id * 0x9E3779B97F4A7C15ULL)
+        ^ (stream * 0xC2B2AE3D27D4EB4FULL);
+    state = (state ^ (state >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    state = (state ^ (state >> 27)) * 0x94D049BB133111EBULL;
+    state = state ^ (state >> 31);
+    return cv::RNG(state ? state : 1);
+}
+
+
+cv::Scalar randomColor(cv::RNG &rng) {
+    return cv::Scalar(rng.uniform(0, 256), rng.uniform(0, 256),
+        rng.uniform(0, 256));
+}
+
+
+/*
+ * overlapping shapes and numbers in random colors, softened a little, like a
+ * printed design.  there's enough going on for SIFT to find plenty of
+ * features, and no two seeds look alike
+ */
+cv::Mat syntheticDesign(int width, int height, cv::RNG &rng) {
+    cv::Mat design(height, width, CV_8UC3, randomColor(rng));
+    int shapes = std::max(20, width * height / 2000);
+    int largest = std::max(5, std::min(width, height) / 6);
+
+    for (int i=0; i<shapes; i++) {
+        cv::Point center(rng.uniform(0, width), rng.uniform(0, height));
+        int size = rng.uniform(4, largest);
+        cv::Scalar color = randomColor(rng);
+
+        switch (rng.uniform(0, 5)) {
+        case 0:
+            cv::rectangle(design, center, center + cv::Point(size, size / 2),
+                color, -1);
+            break;
+        case 1:
+            cv::circle(design, center, size / 2, color, -1);
+            break;
+        case 2:
+            cv::line(design, center, center + cv::Point(size, -size), color,
+                rng.uniform(1, 5));
+            break;
+        case 3:
+            cv::ellipse(design, center, cv::Size(size, size / 3),
+                rng.uniform(0, 180), 0, 360, color, -1);
+            break;
+        default:
+            cv::putText(design, std::to_string(rng.uniform(0, 1000)), center,
+                cv::FONT_HERSHEY_SIMPLEX, size / 30.0 + 0.3, color, 2);
+        }
+    }
+
+    cv::GaussianBlur(design, design, cv::Size(3, 3), 0);
+    return design;
+}
+
+
+/*
+ * the design as a phone might photograph it, already cropped to it: scaled
+ * to longEdge, seen at an angle, blurred, unevenly lit and noisy
+ */
+cv::Mat syntheticPhoto(const cv::Mat &design, int longEdge, cv::RNG &rng,
+        const PhotoDistortion &distortion) {
+    float scale = float(longEdge) / std::max(design.cols, design.rows);
+    cv::Mat photo;
+    cv::resize(design, photo, cv::Size(), scale, scale, cv::INTER_AREA);
+
+    float w = photo.cols, h = photo.rows;
+    cv::Point2f from[] = {cv::Point2f(0, 0), cv::Point2f(w, 0),
+        cv::Point2f(w, h), cv::Point2f(0, h)};
+
+    float angle = rng.uniform(-distortion.rotation, distortion.rotation)
+        * CV_PI / 180;
+    cv::Point2f to[4];
+    for (int i=0; i<4; i++) {
+        float x = from[i].x - w / 2, y = from[i].y - h / 2;
+        to[i].x = w / 2 + x * std::cos(angle) - y * std::sin(angle)
+            + rng.uniform(-distortion.perspective, distortion.perspective) * w;
+        to[i].y = h / 2 + x * std::sin(angle) + y * std::cos(angle)
+            + rng.uniform(-distortion.perspective, distortion.perspective) * h;
+    }
+    cv::Mat warped;
+    cv::warpPerspective(photo, warped, cv::getPerspectiveTransform(from, to),
+        photo.size(), cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+    photo = warped;
+
+    float sigma = rng.uniform(0.0f, distortion.blur);
+    if (sigma > 0.3) {
+        cv::GaussianBlur(photo, photo, cv::Size(0, 0), sigma);
+    }
+
+    /*
+     * overall exposure, and light falling off across the photo in a random
+     * direction
+     */
+    cv::Mat lit;
+    photo.convertTo(lit, CV_32F);
+    float gain = 1 + rng.uniform(-distortion.lighting, distortion.lighting);
+    float falloff = rng.uniform(0.0f, distortion.lighting);
+    float direction = rng.uniform(0.0, 2 * CV_PI);
+    float dx = std::cos(direction) / w, dy = std::sin(direction) / h;
+    for (int y=0; y<lit.rows; y++) {
+        float *row = lit.ptr<float>(y);
+        for (int x=0; x<lit.cols; x++) {
+            float light = gain * (1 + falloff * ((x - w / 2) * dx
+                + (y - h / 2) * dy));
+            for (int c=0; c<lit.channels(); c++) {
+                row[x * lit.channels() + c] *= light;
+            }
+        }
+    }
+
+    if (distortion.noise > 0) {
+        cv::Mat noise(lit.size(), lit.type());
+        cv::randn(noise, cv::Scalar::all(0),
+            cv::Scalar::all(rng.uniform(0.0f, distortion.noise)));
+        cv::add(lit, noise, lit);
+    }
+
+    lit.convertTo(photo, CV_8U);
+    return photo;
+}
+
+
+std::string syntheticTitle(cv::RNG &rng) {
+    const int numAdjectives = sizeof(ADJECTIVES) / sizeof(ADJECTIVES[0]);
+    const int numNouns = sizeof(NOUNS) / sizeof(NOUNS[0]);
+    return std::string(ADJECTIVES[rng.uniform(0, numAdjectives)]) + " "
+        + NOUNS[rng.uniform(0, numNouns)];
+}
@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iterator>
+
+#include <opencv2/opencv.hpp>
+
+#include <tbb/tbb.h>
+
+#include <glib-2.0/glib.h>
+
+#include "thumbnails.h"
+#include "image.h"
+#include "hash.h"
+#include "tuning.h"
+#include "logging.h"
+
+
+namespace fs = boost::filesystem;
+
+
+std::vector<fs::path> listJpegs(const fs::path &dir) {
+    std::vector<fs::path> images;
+    for (auto it = fs::directory_iterator(dir); it != fs::directory_iterator();
+            it++) {
+        fs::path imagePath = (*it).path();
+        if (imagePath.extension().string() == ".jpg") {
+            images.push_back(imagePath);
+        }
+    }
+    return images;
+}
+
+
+/*
+ * downscales every design so that its long edge is at most longEdge.  only
+ * designs whose thumbnail is missing or older than the design are redone
+ */
+void generateThumbnails(const fs::path &designsDir, const fs::path &thumbsDir,
+        int longEdge, bool multithreaded) {
+    if (!fs::exists(thumbsDir)) {
+        fs::create_directories(thumbsDir);
+    }
+
+    std::vector<fs::path> designs = listJpegs(designsDir);
+    std::vector<int> params = {CV_IMWRITE_JPEG_QUALITY,
+        tuning::THUMBNAIL_QUALITY};
+    std::atomic_int generated(0);
+
+    auto generate = [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t i=r.begin(); i!=r.end(); i++) {
+            fs::path thumbFile = thumbsDir/designs[i].filename();
+            if (fs::exists(thumbFile) && fs::last_write_time(thumbFile)
+                    >= fs::last_write_time(designs[i])) {
+                continue;
+            }
+
+            cv::Mat design = cv::imread(designs[i].string());
+            if (design.empty()) {
+                dlog("couldn't read " << designs[i], logging::HIGH);
+                continue;
+            }
+
+            float scale = std::min(1.0f,
+                float(longEdge) / std::max(design.cols, design.rows));
+            cv::Mat thumbnail = design;
+            if (scale < 1.0f) {
+                cv::resize(design, thumbnail, cv::Size(), scale, scale,
+                    cv::INTER_AREA);
+            }
+
+            /*
+             * written aside and renamed, so the server never loads half a
+             * thumbnail
+             */
+            fs::path tmpFile = thumbFile.string() + ".tmp.jpg";
+            cv::imwrite(tmpFile.string(), thumbnail, params);
+            fs::rename(tmpFile, thumbFile);
+            generated++;
+        }
+    };
+
+    tbb::blocked_range<size_t> range(0, designs.size());
+    if (multithreaded) {
+        tbb::parallel_for(range, generate);
+    }
+    else {
+        generate(range);
+    }
+
+    alog("generated " << generated << " thumbnails in " << thumbsDir << ", "
+        << (designs.size() - generated) << " were up to date", logging::HIGH);
+}
+
+
+/*
+ * the design id a thumbnail is named by, or -1 if it isn't exactly
+ * "<id>.jpg".  anything else, like a .tmp.jpg left by an interrupted
+ * generateThumbnails, or a zero-padded copy, would otherwise load over the
+ * design's real thumbnail
+ */
+int thumbnailId(const fs::path &file) {
+    std::string name = file.filename().string();
+    if (name.size() <= 4 || name.compare(name.size() - 4, 4, ".jpg") != 0) {
+        return -1;
+    }
+
+    std::string stem = name.substr(0, name.size() - 4);
+    if (stem.size() > 9
+            || stem.find_first_not_of("0123456789") != std::string::npos
+            || (stem.size() > 1 && stem[0] == '0')) {
+        return -1;
+    }
+    return std::stoi(stem);
+}
+
+
+/*
+ * reads every thumbnail in thumbsDir, named by design id, and prepares
+ * everything a response needs from it: the raw bytes, the base64 of those
+ * bytes, a hash of them for caching, and the dimensions, which come from the
+ * JPEG header rather than from decoding the image
+ */
+bool ThumbnailCache::load(const path &thumbsDir, bool multithreaded) {
+    if (!fs::exists(thumbsDir)) {
+        dlog("thumbnail directory " << thumbsDir << " doesn't exist",
+            logging::HIGH);
+        return false;
+    }
+
+    dlog("loading thumbnails from " << thumbsDir, logging::HIGH);
+
+    std::vector<fs::path> files = listJpegs(thumbsDir);
+    std::vector<int> ids(files.size(), -1);
+    int maxId = -1;
+    for (size_t i=0; i<files.size(); i++) {
+        ids[i] = thumbnailId(files[i]);
+        maxId = std::max(maxId, ids[i]);
+    }
+
+    if (maxId < 0) {
+        dlog("no thumbnails in " << thumbsDir, logging::HIGH);
+        return false;
+    }
+
+    thumbnails.assign(maxId + 1, Thumbnail());
+    std::atomic_int loaded(0);
+
+    auto loadRange = [&](const tbb::blocked_range<size_t> &r) {
+        for (size_t i=r.begin(); i!=r.end(); i++) {
+            if (ids[i] < 0) {
+                continue;
+            }
+
+            Thumbnail &thumbnail = thumbnails[ids[i]];
+            std::ifstream handle(files[i].string(), std::ifstream::binary);
+            thumbnail.jpeg.assign(std::istreambuf_iterator<char>(handle),
+                std::istreambuf_iterator<char>());
+
+            const unsigned char *bytes = reinterpret_cast<const unsigned char *>(
+                thumbnail.jpeg.data());
+            if (!jpegDimensions(bytes, thumbnail.jpeg.size(), thumbnail.width,
+                    thumbnail.height)) {
+                dlog("couldn't read dimensions of " << files[i], logging::LOW);
+            }
+
+            thumbnail.version = hashing::hex(hashing::fnv1a(bytes,
+                thumbnail.jpeg.size()));
+            thumbnail.etag = "\"" + thumbnail.version + "\"";
+
+            gchar *encoded = g_base64_encode(bytes, thumbnail.jpeg.size());
+            thumbnail.base64 = encoded;
+            g_free(encoded);
+            loaded++;
+        }
+    };
+
+    tbb::blocked_range<size_t> range(0, files.size());
+    if (multithreaded) {
+        tbb::parallel_for(range, loadRange);
+    }
+    else {
+        loadRange(range);
+    }
+
+    numLoaded = loaded;
+    dlog("loaded " << numLoaded << " thumbnails", logging::HIGH);
+    return true;
+}
+
+const Thumbnail *ThumbnailCache::get(int id) const {
+    if (id < 0 || size_t(id) >= thumbnails.size()
+            || thumbnails[id].jpeg.empty()) {
+        return nullptr;
+    }
+    return &thumbnails[id];
+}
+
+size_t ThumbnailCache::size() const {
+    return numLoaded;
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "trace.h"
+#include "logging.h"
+
+
+namespace tracing {
+
+    /*
+     * spans each thread keeps.  at a few dozen bytes each, this is a few
+     * hundred KB per thread, and a few hundred requests' worth of spans
+     */
+    const size_t RING_SIZE = 8192;
+
+    struct Event {
+        const char *name;
+        uint64_t trace;
+        double start;
+        double end;
+        int64_t arg;
+    };
+
+    /*
+     * a thread's spans.  only its own thread writes to it, so its lock is
+     * only ever contended while an export is reading it
+     */
+    struct Ring {
+        int tid;
+        std::mutex lock;
+        std::vector<Event> events;
+        size_t next = 0;
+        bool wrapped = false;
+    };
+
+
+    std::atomic_bool isEnabled(false);
+    std::atomic<uint64_t> nextTrace(1);
+    thread_local uint64_t currentTrace = 0;
+
+    std::mutex ringsLock;
+    std::vector<std::unique_ptr<Ring>> rings;
+    thread_local Ring *threadRing = nullptr;
+
+
+    /*
+     * rings are never freed, so that spans outlive the threads that
+     * recorded them.  our threads are pools that live as long as we do, so
+     * there are only ever as many rings as threads
+     */
+    Ring *ring() {
+        if (!threadRing) {
+            std::unique_ptr<Ring> created(new Ring);
+            created->events.resize(RING_SIZE);
+
+            std::lock_guard<std::mutex> guard(ringsLock);
+            created->tid = rings.size() + 1;
+            threadRing = created.get();
+            rings.push_back(std::move(created));
+        }
+        return threadRing;
+    }
+
+
+    void setEnabled(bool enabled) {
+        isEnabled = enabled;
+    }
+
+    bool enabled() {
+        return isEnabled.load(std::memory_order_relaxed);
+    }
+
+    uint64_t newTrace() {
+        return nextTrace++;
+    }
+
+    uint64_t current() {
+        return currentTrace;
+    }
+
+    void record(const char *name, uint64_t trace, double start, double end,
+            int64_t arg) {
+        if (!enabled()) {
+            return;
+        }
+
+        Ring *r = ring();
+        std::lock_guard<std::mutex> guard(r->lock);
+        r->events[r->next] = Event{name, trace, start, end, arg};
+        r->next++;
+        if (r->next == RING_SIZE) {
+            r->next = 0;
+            r->wrapped = true;
+        }
+    }
+
+    /*
+     * every span we still have, or just those of onlyTrace, as complete
+     * ("X") events.  times are in microseconds, as Chrome wants them
+     */
+    void exportJson(std::ostream &out, uint64_t onlyTrace) {
+        std::vector<Ring *> snapshot;
+        {
+            std::lock_guard<std::mutex> guard(ringsLock);
+            for (auto &r: rings) {
+                snapshot.push_back(r.get());
+            }
+        }
+
+        out << std::fixed << std::setprecision(1);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+        bool first = true;
+        for (Ring *r: snapshot) {
+            out << (first ? "" : ",") << "\n{\"name\": \"thread_name\", "
+                "\"ph\": \"M\", \"pid\": 1, \"tid\": " << r->tid
+                << ", \"args\": {\"name\": \"thread " << r->tid << "\"}}";
+            first = false;
+
+            std::lock_guard<std::mutex> guard(r->lock);
+            size_t count = r->wrapped ? RING_SIZE : r->next;
+            size_t begin = r->wrapped ? r->next : 0;
+            for (size_t i=0; i<count; i++) {
+                const Event &event = r->events[(begin + i) % RING_SIZE];
+                if (onlyTrace && event.trace != onlyTrace) {
+                    continue;
+                }
+                out << ",\n{\"name\": \"" << event.name
+                    << "\", \"cat\": \"sifter\", \"ph\": \"X\", \"pid\": 1, "
+                    "\"tid\": " << r->tid
+                    << ", \"ts\": " << event.start * 1e6
+                    << ", \"dur\": " << (event.end - event.start) * 1e6
+                    << ", \"args\": {\"trace\": " << event.trace
+                    << ", \"arg\": " << event.arg << "}}";
+            }
+        }
+        out << "\n]}\n";
+    }
+
+
+    Scope::Scope(uint64_t trace): previous(currentTrace) {
+        currentTrace = trace;
+    }
+
+    Scope::~Scope() {
+        currentTrace = previous;
+    }
+
+
+    Span::Span(const char *name, int64_t arg): name(name),
+            trace(currentTrace), arg(arg),
+            start(enabled() ? logging::timestamp() : 0) {
+    }
+
+    Span::Span(const char *name, uint64_t trace, int64_t arg): name(name),
+            trace(trace), arg(arg),
+            start(enabled() ? logging::timestamp() : 0) {
+    }
+
+    Span::~Span() {
+        if (start > 0) {
+            record(name, trace, start, logging::timestamp(), arg);
+        }
+    }
+
+    void Span::setArg(int64_t arg) {
+        this->arg = arg;
+    }
+}
@@ -22,50 +22,142 @@
 
 
 
+#include <algorithm>
 #include <string>
 #include <sstream>
 #include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <thread>
 
 extern "C" {
 #include "mongoose.h"
 }
 
 #include "web_server.h"
+#include "event_server.h"
+#include "websocket.h"
+#include "match_session.h"
 #include "sifter.h"
+#include "image.h"
+#include "hash.h"
+#include "metrics.h"
+#include "trace.h"
 #include "logging.h"
 
 
 /*
- * for uploaded files
+ * the most body we'll read for anything that isn't an upload to match
  */
-const char* TMP_DIR = "/tmp";
+const size_t MAX_OTHER_BODY = 64 * 1024;
+
+/*
+ * how long a /match/batch group waits for the scheduler to make room before
+ * its images are given up on
+ */
+const double BATCH_MAX_WAIT = 60;
+
+/*
+ * how long a batch turned away for there being too many others is told to
+ * back off for
+ */
+const double BATCH_RETRY_AFTER = 10;
+
+/*
+ * the longest an upload without a deadline waits on an identical one
+ */
+const double COALESCED_MAX_WAIT = 60;
 
 
 Server::Server() {
     pendingMatches = 0;
+    activeBatches = 0;
+    coalescedWaiters = 0;
+}
+
+/*
+ * Server::~Server() has to be defined where EventServer is complete, for
+ * our unique_ptr of one
+ */
+Server::~Server() {
 }
 
 void Server::serve(int port) {
     this->port = port;
     log_server("starting up", logging::HIGH);
 
+    if (frontend == Frontend::EPOLL) {
+        eventServer.reset(new EventServer(this, maxConnections, idleTimeout,
+            maxBufferedBytes, handlerThreads()));
+        if (!eventServer->start(port)) {
+            log_server("couldn't listen", logging::HIGH);
+        }
+        return;
+    }
+
     mg_callbacks callbacks;
     memset(&callbacks, 0, sizeof(callbacks));
 
-    callbacks.begin_request = handleRequest;
-    callbacks.upload = handleUpload;
+    callbacks.begin_request = handleMongooseRequest;
+#ifdef USE_WEBSOCKET
+    callbacks.websocket_ready = startMongooseSession;
+    callbacks.websocket_data = handleMongooseFrame;
+    callbacks.end_request = endMongooseRequest;
+#endif
 
 
     // NULL is the sentinel
-    const char *options[] = {"listening_ports", std::to_string(port).c_str(),
-        NULL};
+    std::string ports = std::to_string(port);
+    const char *options[] = {"listening_ports", ports.c_str(), NULL};
 
     ctx = mg_start(&callbacks, this, options);
 }
 
 void Server::stop() {
     //log_server("stopping", logging::HIGH);
-    mg_stop(ctx);
+    if (eventServer) {
+        eventServer->stop();
+    }
+    if (ctx) {
+        mg_stop(ctx);
+    }
+}
+
+void Server::setFrontend(Frontend frontend) {
+    this->frontend = frontend;
+}
+
+void Server::setConnectionLimits(int maxConnections, double idleTimeout,
+        size_t maxBufferedBytes) {
+    this->maxConnections = maxConnections;
+    this->idleTimeout = idleTimeout;
+    this->maxBufferedBytes = maxBufferedBytes;
+}
+
+/*
+ * a /match request holds its handler thread for as long as it's queued or
+ * running, and the scheduler never lets more than this many be either, so
+ * this many threads are enough for all of them.  anything more has been
+ * turned away.  a /match/batch holds its thread for much longer, waiting for
+ * room between its groups, and an upload identical to one being matched
+ * holds its thread waiting on that one, outside the scheduler, so both get
+ * threads of their own on top
+ */
+int Server::handlerThreads() const {
+    return maxActive() + maxBatches + maxCoalescedWaiters() + 1;
+}
+
+/*
+ * how many matches may be queued or running at once, and how many uploads
+ * may wait on an identical one: as many as may be queued
+ */
+int Server::maxActive() const {
+    return scheduler ? maxConcurrent + maxQueued : healthyThreshold;
+}
+
+int Server::maxCoalescedWaiters() const {
+    return scheduler ? std::max(maxQueued, 1) : healthyThreshold;
 }
 
 void Server::setHealthyThreshold(int healthyThreshold) {
@@ -76,109 +168,1505 @@ void Server::setMatcher(Matcher matcher) {
     this->matcher = matcher;
 }
 
-MatchInfo Server::match(const path& imagePath) {
-    pendingMatches++;
-    auto info = matcher(imagePath);
-    pendingMatches--;
+void Server::setVerifier(Verifier verifier) {
+    this->verifier = verifier;
+}
+
+void Server::setBatchMatcher(BatchMatcher batchMatcher) {
+    this->batchMatcher = batchMatcher;
+}
+
+void Server::setPrecomputedMatcher(PrecomputedMatcher precomputedMatcher) {
+    this->precomputedMatcher = precomputedMatcher;
+}
+
+/*
+ * what our extractors were built with, which /match/descriptors uploads
+ * have to have been extracted with too
+ */
+void Server::setSiftParams(const SiftParams &coarse,
+        const SiftParams &refine) {
+    coarseParams = coarse;
+    refineParams = refine;
+}
+
+const SiftParams &Server::getCoarseParams() const {
+    return coarseParams;
+}
+
+const SiftParams &Server::getRefineParams() const {
+    return refineParams;
+}
+
+/*
+ * how big a /match/batch upload may be, how many of its images are decoded
+ * and searched together, and how many batches may be matched at once
+ */
+void Server::setBatchLimits(size_t maxBytes, int groupSize, int maxBatches) {
+    maxBatchBytes = maxBytes;
+    batchGroupSize = std::max(groupSize, 1);
+    this->maxBatches = std::max(maxBatches, 1);
+}
+
+size_t Server::getMaxBatchBytes() const {
+    return maxBatchBytes;
+}
+
+int Server::getBatchGroupSize() const {
+    return batchGroupSize;
+}
+
+/*
+ * a quick check, before a batch's body is read, of whether there'd be room
+ * to match it
+ */
+bool Server::batchesFull() const {
+    return activeBatches >= maxBatches;
+}
+
+/*
+ * takes one of the places batches are matched in, returning false if
+ * they're all taken.  endBatch gives it back
+ */
+bool Server::beginBatch() {
+    if (++activeBatches > maxBatches) {
+        activeBatches--;
+        return false;
+    }
+    return true;
+}
+
+void Server::endBatch() {
+    activeBatches--;
+}
+
+/*
+ * the same for uploads waiting on an identical one being matched
+ */
+bool Server::beginCoalescedWait() {
+    if (++coalescedWaiters > maxCoalescedWaiters()) {
+        coalescedWaiters--;
+        return false;
+    }
+    return true;
+}
+
+void Server::endCoalescedWait() {
+    coalescedWaiters--;
+}
+
+void Server::setThumbnails(const ThumbnailCache *thumbnails) {
+    this->thumbnails = thumbnails;
+}
+
+void Server::setDecodeLimits(const DecodeLimits &limits) {
+    decodeLimits = limits;
+}
+
+const DecodeLimits &Server::getDecodeLimits() const {
+    return decodeLimits;
+}
+
+double Server::getDefaultDeadline() const {
+    return defaultDeadline;
+}
+
+void Server::setDefaultDeadline(double seconds) {
+    defaultDeadline = seconds;
+}
+
+void Server::setScheduling(int maxConcurrent, int maxQueued,
+        double sloSeconds, int numThreads) {
+    scheduler.reset(new MatchScheduler(maxConcurrent, maxQueued, sloSeconds,
+        numThreads));
+    this->maxConcurrent = maxConcurrent;
+    this->maxQueued = maxQueued;
+}
+
+void Server::setResultCache(size_t capacity, int hammingTolerance) {
+    resultCache.reset(new ResultCache(capacity, hammingTolerance));
+}
+
+ResultCache *Server::getResultCache() {
+    return resultCache.get();
+}
+
+/*
+ * keeps requests slower than percentile of recent ones, for dumping to
+ * dumpDir.  params describes how we're set up to match, so that a replay
+ * can tell whether it's comparing like with like
+ */
+void Server::setFlightRecorder(size_t capacity, double percentile,
+        const path &dumpDir, const std::string &params) {
+    flightRecorder.reset(new FlightRecorder(capacity, percentile, dumpDir,
+        params));
+}
+
+FlightRecorder *Server::getFlightRecorder() {
+    return flightRecorder.get();
+}
+
+LoadSnapshot Server::loadSnapshot() {
+    LoadSnapshot load;
+    load.inFlight = pendingMatches;
+    if (scheduler) {
+        load.queued = scheduler->queued();
+        load.running = scheduler->running();
+    }
+    return load;
+}
+
+/*
+ * the search's own stages, as the engine timed them.  verifying against a
+ * shortlist skips the initial scan, so only its refining counts
+ */
+void recordSearch(const SearchContext &context, bool scanned) {
+    if (scanned) {
+        metrics::observeStage(metrics::COARSE_EXTRACT,
+            context.coarseExtractTime);
+        metrics::observeStage(metrics::COARSE_SEARCH,
+            context.coarseSearchTime);
+        metrics::observeScanned(context.scanned);
+    }
+    metrics::observeStage(metrics::REFINE_EXTRACT, context.refineExtractTime);
+    metrics::observeStage(metrics::REFINE_MATCH, context.refineMatchTime);
+}
+
+/*
+ * counts a match as pending for as long as it's in scope, so that one that
+ * throws doesn't leave /health thinking we're busy forever
+ */
+struct PendingMatch {
+    explicit PendingMatch(std::atomic_int &pending): pending(pending) {
+        pending++;
+    }
+    ~PendingMatch() {
+        pending--;
+    }
+
+    std::atomic_int &pending;
+};
+
+MatchInfo Server::match(const Mat &image, SearchContext &context) {
+    PendingMatch pending(pendingMatches);
+    auto info = matcher(image, context);
+    recordSearch(context, true);
+    return info;
+}
+
+MatchInfo Server::verify(const Mat &image,
+        std::vector<PotentialMatch> &shortlist, SearchContext &context) {
+    PendingMatch pending(pendingMatches);
+    auto info = verifier(image, shortlist, context);
+    recordSearch(context, false);
+    return info;
+}
+
+MatchInfo Server::matchPrecomputed(const Mat &descriptors,
+        SearchContext &context) {
+    PendingMatch pending(pendingMatches);
+    auto info = precomputedMatcher(descriptors, context);
+    recordSearch(context, true);
     return info;
 }
 
+/*
+ * a group of images counts as one pending match, since it's searched in a
+ * single pass
+ */
+void Server::matchBatch(const std::vector<Mat> &images,
+        std::vector<SearchContext> &contexts,
+        const std::function<void(size_t, MatchInfo &)> &found) {
+    {
+        PendingMatch pending(pendingMatches);
+        batchMatcher(images, contexts, found);
+    }
+
+    for (auto &context: contexts) {
+        recordSearch(context, true);
+    }
+}
+
+/*
+ * runs job through our scheduler, if we have one.  returns false if the
+ * scheduler turned it away, with retryAfter set.  the job keeps the
+ * caller's trace, whichever thread it ends up running on
+ */
+bool Server::schedule(const std::function<void()> &job, double &retryAfter) {
+    if (!scheduler) {
+        job();
+        return true;
+    }
+
+    uint64_t trace = tracing::current();
+    double queued = logging::timestamp();
+    return scheduler->run([&]() {
+        tracing::Scope scope(trace);
+        tracing::record("queued", trace, queued, logging::timestamp());
+        job();
+    }, retryAfter);
+}
+
+bool Server::wouldReject(double &retryAfter) {
+    return scheduler && scheduler->wouldReject(retryAfter);
+}
+
 bool Server::isHealthy() {
     return pendingMatches < healthyThreshold;
 }
 
-std::string Server::createResponse(int code, const std::string &codeMsg,
-        const std::string &contentType,
-        const std::string &msg) const {
+std::string Server::statsJson() {
+    std::stringstream buf;
+    buf << "{\"pending_matches\": " << pendingMatches;
+    if (scheduler) {
+        buf << ", \"queued\": " << scheduler->queued()
+            << ", \"running\": " << scheduler->running()
+            << ", \"rejected\": " << scheduler->rejected();
+    }
+    if (resultCache) {
+        buf << ", \"result_cache\": " << resultCache->statsJson();
+    }
+    buf << "}";
+    return buf.str();
+}
+
+/*
+ * everything /stats has, and the stage histograms, for Prometheus to scrape
+ */
+std::string Server::metricsText() {
+    std::stringstream buf;
+    metrics::render(buf);
+
+    buf << "# HELP sifter_in_flight matches being searched right now\n"
+        << "# TYPE sifter_in_flight gauge\n"
+        << "sifter_in_flight " << pendingMatches << "\n";
+    if (scheduler) {
+        buf << "# HELP sifter_queued matches waiting for the scheduler\n"
+            << "# TYPE sifter_queued gauge\n"
+            << "sifter_queued " << scheduler->queued() << "\n"
+            << "# HELP sifter_running matches the scheduler is running\n"
+            << "# TYPE sifter_running gauge\n"
+            << "sifter_running " << scheduler->running() << "\n"
+            << "# HELP sifter_rejected_total matches turned away with a 503\n"
+            << "# TYPE sifter_rejected_total counter\n"
+            << "sifter_rejected_total " << scheduler->rejected() << "\n";
+    }
+    return buf.str();
+}
+
+std::string Server::createHeaders(int code, const std::string &codeMsg,
+        const std::string &contentType, size_t contentLength,
+        const std::string &extraHeaders) const {
+    std::stringstream buf;
+
+    buf << "HTTP/1.1 " << code << " " << codeMsg << "\r\n";
+    buf << "Content-Type: " << contentType << "\r\n";
+    buf << "Content-Length: " << contentLength << "\r\n";
+    buf << extraHeaders;
+    buf << "\r\n";
+
+    return buf.str();
+}
+
+/*
+ * headers for a response whose body is streamed with a ChunkedWriter
+ */
+std::string Server::createChunkedHeaders(int code, const std::string &codeMsg,
+        const std::string &contentType) const {
     std::stringstream buf;
 
     buf << "HTTP/1.1 " << code << " " << codeMsg << "\r\n";
     buf << "Content-Type: " << contentType << "\r\n";
-    buf << "Content-Length: " << msg.size() << "\r\n";
+    buf << "Transfer-Encoding: chunked\r\n";
     buf << "\r\n";
-    buf << msg;
 
     return buf.str();
 }
 
-void Server::OKJSON(mg_connection *conn, const std::string &json) const {
-    OK(conn, json, "application/json");
+std::string Server::createResponse(int code, const std::string &codeMsg,
+        const std::string &contentType,
+        const std::string &msg) const {
+    return createHeaders(code, codeMsg, contentType, msg.size()) + msg;
+}
+
+void Server::OKJSON(Responder &out, const std::string &json) const {
+    OK(out, json, "application/json");
+}
+
+void Server::OK(Responder &out, const std::string &msg, const std::string &contentType) const {
+    out.write(createResponse(200, "OK", contentType, msg));
 }
 
-void Server::OK(mg_connection *conn, const std::string &msg, const std::string &contentType) const {
-    auto response = createResponse(200, "OK", contentType, msg);
-    mg_write(conn, response.c_str(), response.size());
+void Server::errorNotAllowed(Responder &out) const {
+    error(out, 405, "Method Not Allowed");
 }
 
-void Server::errorNotAllowed(mg_connection *conn) const {
-    auto response = createResponse(405, "Method Not Allowed", "text/plain", "");
-    mg_write(conn, response.c_str(), response.size());
+void Server::errorNotFound(Responder &out) const {
+    error(out, 404, "Not Found");
 }
 
-void Server::errorNotFound(mg_connection *conn) const {
-    auto response = createResponse(404, "Not Found", "text/plain", "");
-    mg_write(conn, response.c_str(), response.size());
+void Server::error(Responder &out, int code, const std::string &codeMsg,
+        const std::string &msg) const {
+    out.write(createResponse(code, codeMsg, "text/plain", msg));
+}
+
+void Server::errorUnavailable(Responder &out, double retryAfter) const {
+    std::string retryHeader = "Retry-After: "
+        + std::to_string(int(std::ceil(retryAfter))) + "\r\n";
+    out.write(createHeaders(503, "Service Unavailable", "text/plain", 0,
+        retryHeader));
 }
 
 
 
-void handleUpload(mg_connection *conn, const char *path) {
-    const mg_request_info *request = mg_get_request_info(conn);
-    auto server = reinterpret_cast<Server *>(request->user_data);
+/*
+ * thumbnails never change without their version, and so their URL, changing
+ * too, so clients may cache them forever.  the body goes out straight from
+ * the cache, without being copied into a response buffer first
+ */
+void Server::sendThumbnail(const HttpRequest &request, Responder &out,
+        int id) const {
+    const Thumbnail *thumbnail = thumbnails ? thumbnails->get(id) : nullptr;
+    if (!thumbnail) {
+        errorNotFound(out);
+        return;
+    }
+
+    std::string cacheHeaders = "ETag: " + thumbnail->etag + "\r\n"
+        "Cache-Control: public, max-age=31536000, immutable\r\n";
+
+    const char *ifNoneMatch = request.header("If-None-Match");
+    if (ifNoneMatch && thumbnail->etag.compare(ifNoneMatch) == 0) {
+        out.write(createHeaders(304, "Not Modified", "image/jpeg", 0,
+            cacheHeaders));
+        return;
+    }
 
-    MatchInfo match = server->match(path);
-    server->OKJSON(conn, match.json());
+    out.write(createHeaders(200, "OK", "image/jpeg", thumbnail->jpeg.size(),
+        cacheHeaders));
+    out.writeStatic(thumbnail->jpeg.data(), thumbnail->jpeg.size());
 }
 
-int handleRequest(mg_connection *conn) {
-    const mg_request_info *request = mg_get_request_info(conn);
-    auto server = reinterpret_cast<Server *>(request->user_data);
 
-    std::string response;
-    std::string path(request->uri);
-    std::string method(request->request_method);
 
-    dlog("got request to " << path, logging::HIGH);
+/*
+ * clients that already have a design's thumbnail, or don't want it, can ask
+ * for /match?thumbnail=url or /match?thumbnail=none instead of having it
+ * inlined
+ */
+ThumbnailMode requestedThumbnailMode(const HttpRequest &request) {
+    std::string mode;
+    if (!queryParameter(request.queryString, "thumbnail", mode)) {
+        return ThumbnailMode::INLINE;
+    }
 
+    if (mode == "url") {
+        return ThumbnailMode::URL;
+    }
+    else if (mode == "none") {
+        return ThumbnailMode::NONE;
+    }
+    return ThumbnailMode::INLINE;
+}
 
-    /*
-     * more elaborate method handling will require a better dispatcher, but
-     * for the few methods we're handling now, this is fine
-     */
+/*
+ * splits a multipart/form-data body into its parts, using the boundary from
+ * the content type.  anything malformed just ends the parsing early
+ */
+std::vector<BodyPart> parseMultipart(const std::string &contentType,
+        const unsigned char *body, size_t size) {
+    std::vector<BodyPart> parts;
 
-    /*
-     * our main image matching endpoint
-     */
-    if (path.compare("/match") == 0) {
-        if (method.compare("POST") == 0) {
-            mg_upload(conn, TMP_DIR);
+    size_t boundaryPos = contentType.find("boundary=");
+    if (boundaryPos == std::string::npos) {
+        return parts;
+    }
+    std::string boundary = contentType.substr(boundaryPos + 9);
+    boundary = boundary.substr(0, boundary.find(';'));
+    if (boundary.size() >= 2 && boundary.front() == '"'
+            && boundary.back() == '"') {
+        boundary = boundary.substr(1, boundary.size() - 2);
+    }
+
+    std::string delimiter = "--" + boundary;
+    std::string nextDelimiter = "\r\n" + delimiter;
+    const char *headersEnd = "\r\n\r\n";
+    const unsigned char *end = body + size;
+
+    const unsigned char *pos = std::search(body, end, delimiter.begin(),
+        delimiter.end());
+    while (pos != end) {
+        pos += delimiter.size();
+
+        /*
+         * "--" after a delimiter marks the end of the body
+         */
+        if (end - pos < 2 || (pos[0] == '-' && pos[1] == '-')) {
+            break;
         }
-        else {
-            server->errorNotAllowed(conn);
+
+        const unsigned char *headers = pos;
+        const unsigned char *data = std::search(headers, end, headersEnd,
+            headersEnd + 4);
+        if (data == end) {
+            break;
+        }
+
+        const unsigned char *dataEnd = std::search(data + 4, end,
+            nextDelimiter.begin(), nextDelimiter.end());
+        if (dataEnd == end) {
+            break;
+        }
+
+        BodyPart part;
+        part.headers.assign(headers, data);
+        part.data = data + 4;
+        part.size = dataEnd - part.data;
+        parts.push_back(part);
+
+        pos = dataEnd + 2;
+    }
+    return parts;
+}
+
+
+/*
+ * how many seconds a match may take.  clients can ask for less than our
+ * default with an X-Deadline-Ms header, but not more.  zero means no limit
+ */
+double requestedBudget(const HttpRequest &request, double defaultSeconds) {
+    double seconds = defaultSeconds;
+
+    const char *header = request.header("X-Deadline-Ms");
+    if (header) {
+        double requested = strtod(header, nullptr) / 1000.0;
+        if (requested > 0 && (seconds <= 0 || requested < seconds)) {
+            seconds = requested;
+        }
+    }
+    return seconds > 0 ? seconds : 0;
+}
+
+/*
+ * when a match has to be done by, counted from when it arrived in full (so
+ * that a slow upload doesn't eat into it)
+ */
+double requestedDeadline(const HttpRequest &request, double defaultDeadline) {
+    double seconds = requestedBudget(request, defaultDeadline);
+    return seconds > 0 ? request.arrival + seconds : 0;
+}
+
+
+/*
+ * reads the regular files out of a tar archive, in the order they appear.
+ * directories, links and the pax/GNU extension headers are skipped over.
+ * returns false if the archive is malformed or cut short
+ */
+bool parseTar(const unsigned char *body, size_t size,
+        std::vector<BatchImage> &images) {
+    const size_t BLOCK = 512;
+    size_t pos = 0;
+
+    while (pos + BLOCK <= size) {
+        const char *header = reinterpret_cast<const char *>(body + pos);
+
+        /*
+         * an all-zero block marks the end of the archive
+         */
+        if (std::all_of(header, header + BLOCK,
+                [](char c) { return c == 0; })) {
+            return true;
+        }
+
+        std::string name(header, strnlen(header, 100));
+        if (memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+            name = std::string(header + 345, strnlen(header + 345, 155))
+                + "/" + name;
+        }
+
+        std::string sizeField(header + 124, strnlen(header + 124, 12));
+        char *end = nullptr;
+        unsigned long long fileSize = strtoull(sizeField.c_str(), &end, 8);
+        if (end == sizeField.c_str()) {
+            return false;
+        }
+
+        pos += BLOCK;
+        if (fileSize > size - pos) {
+            return false;
+        }
+
+        char type = header[156];
+        if (type == '0' || type == '\0') {
+            images.push_back(BatchImage{name, body + pos, size_t(fileSize)});
         }
+        pos += (fileSize + BLOCK - 1) / BLOCK * BLOCK;
     }
+
     /*
-     * for AWS ELB health checks
+     * archives are supposed to end with zero blocks, but plenty of tools
+     * stop right after the last file
      */
-    else if (path.compare("/health") == 0) {
-        if (method.compare("GET") == 0) {
-            if (server->isHealthy()) {
-                server->OK(conn);
-            }
-            else {
-                server->errorNotFound(conn);
-            }
+    return pos >= size;
+}
+
+
+/*
+ * decides, from its headers alone, whether we'll take a request's body.
+ * front ends call this before they read any of it, so that uploads we'd
+ * turn away anyway (because they're too big, or we're too busy) aren't
+ * read first.  returns false if we've already responded, and otherwise
+ * sets maxBody to how much body the request may have
+ */
+bool admitRequest(Server *server, const HttpRequest &request,
+        Responder &out, size_t &maxBody) {
+    const char *lengthHeader = request.header("Content-Length");
+    long long length = lengthHeader ? strtoll(lengthHeader, nullptr, 10) : 0;
+
+    if (request.header("Transfer-Encoding")) {
+        server->error(out, 411, "Length Required");
+        return false;
+    }
+
+    if (isMatchRequest(request)) {
+        /*
+         * batches wait for room in the scheduler group by group, so they're
+         * only turned away up front if as many as we'll match at once
+         * already are
+         */
+        double retryAfter = 0;
+        if (isBatchRequest(request) && server->batchesFull()) {
+            server->errorUnavailable(out, BATCH_RETRY_AFTER);
+            return false;
+        }
+        if (!isBatchRequest(request) && server->wouldReject(retryAfter)) {
+            server->errorUnavailable(out, retryAfter);
+            return false;
+        }
+        if (!lengthHeader) {
+            server->error(out, 411, "Length Required");
+            return false;
+        }
+        if (isBatchRequest(request)) {
+            maxBody = server->getMaxBatchBytes();
+        }
+        else if (isDescriptorsRequest(request)) {
+            maxBody = descriptor_payload::HEADER_SIZE
+                + server->getRefineParams().numFeatures
+                * descriptor_payload::ROW_LENGTH * sizeof(float);
         }
         else {
-            server->errorNotAllowed(conn);
+            maxBody = server->getDecodeLimits().maxBytes;
         }
     }
     else {
-        server->errorNotFound(conn);
+        maxBody = MAX_OTHER_BODY;
     }
 
-    /*
-     * non-zero tells mongoose that our function has replied to the client
-     */
-    return 1;
+    if (length < 0 || size_t(length) > maxBody) {
+        server->error(out, 413, "Request Entity Too Large");
+        return false;
+    }
+    maxBody = length;
+    return true;
 }
+
+/*
+ * requests that can block their handler for a while, waiting on the
+ * scheduler, so they're turned away up front when it's full
+ */
+bool isMatchRequest(const HttpRequest &request) {
+    return (request.uri.compare("/match") == 0 || isBatchRequest(request)
+            || isDescriptorsRequest(request))
+        && request.method.compare("POST") == 0;
+}
+
+/*
+ * requests cheap enough to answer from the event thread, without waiting on
+ * anything.  the event front end hands the rest to its handler threads
+ */
+bool isInlineRequest(const HttpRequest &request) {
+    return (request.uri.compare("/health") == 0
+            || request.uri.compare("/stats") == 0
+            || request.uri.compare("/metrics") == 0)
+        && request.method.compare("GET") == 0;
+}
+
+bool isBatchRequest(const HttpRequest &request) {
+    return request.uri.compare("/match/batch") == 0;
+}
+
+bool isDescriptorsRequest(const HttpRequest &request) {
+    return request.uri.compare("/match/descriptors") == 0;
+}
+
+/*
+ * a WebSocket upgrade to /session, for streaming frames to match
+ */
+bool isSessionRequest(const HttpRequest &request) {
+    return request.uri.compare("/session") == 0
+        && websocket::isUpgrade(request);
+}
+
+
+/*
+ * matches the uploaded image, which is already in memory.  the Android app
+ * sends a multipart form, but a raw image body (application/octet-stream,
+ * or an image/ type) works too.  images whose header claims too many
+ * pixels are turned away before any decoding happens
+ */
+void handleMatch(Server *server, const HttpRequest &request,
+        Responder &out) {
+    recordReceive(request);
+    LoadSnapshot load = server->getFlightRecorder() ? server->loadSnapshot()
+        : LoadSnapshot();
+
+    SearchContext context;
+    context.deadline = requestedDeadline(request,
+        server->getDefaultDeadline());
+
+    const DecodeLimits &limits = server->getDecodeLimits();
+    const std::vector<unsigned char> &body = request.body;
+    if (body.empty()) {
+        server->error(out, 400, "Bad Request", "no image");
+        return;
+    }
+
+    const char *typeHeader = request.header("Content-Type");
+    std::string contentType(typeHeader ? typeHeader : "");
+    const unsigned char *image = body.data();
+    size_t imageSize = body.size();
+
+    if (contentType.compare(0, 19, "multipart/form-data") == 0) {
+        auto parts = parseMultipart(contentType, body.data(), body.size());
+        if (parts.empty()) {
+            server->error(out, 400, "Bad Request", "malformed multipart body");
+            return;
+        }
+
+        /*
+         * the file part if there is one, otherwise whatever came first
+         */
+        const BodyPart *filePart = &parts[0];
+        for (auto &part: parts) {
+            if (part.headers.find("filename=") != std::string::npos) {
+                filePart = &part;
+                break;
+            }
+        }
+        image = filePart->data;
+        imageSize = filePart->size;
+    }
+
+    int width, height;
+    if (imageDimensions(image, imageSize, width, height)
+            && (long long)width * height > limits.maxPixels) {
+        server->error(out, 413, "Request Entity Too Large",
+            "image has too many pixels");
+        return;
+    }
+
+    MatchOutcome outcome = matchUpload(server, image, imageSize, context);
+
+    if (outcome.status == MatchOutcome::UNAVAILABLE) {
+        server->errorUnavailable(out, outcome.retryAfter);
+        return;
+    }
+    if (outcome.status == MatchOutcome::UNDECODABLE) {
+        server->error(out, 400, "Bad Request", "couldn't decode image");
+        return;
+    }
+
+    double responseStart = logging::timestamp();
+    server->OKJSON(out, outcome.info.json(requestedThumbnailMode(request)));
+    recordResponse(request, responseStart);
+    recordIfSlow(server, request, "image", image, imageSize, context,
+        outcome.info, load);
+}
+
+
+/*
+ * how long an upload took to come in, after its headers
+ */
+void recordReceive(const HttpRequest &request) {
+    if (request.headArrival > 0) {
+        metrics::observeStage(metrics::RECEIVE,
+            request.arrival - request.headArrival);
+    }
+}
+
+/*
+ * how long building and writing a match response took, from start, and
+ * how long the whole request took
+ */
+void recordResponse(const HttpRequest &request, double start) {
+    double now = logging::timestamp();
+    metrics::observeStage(metrics::RESPONSE, now - start);
+    if (request.headArrival > 0) {
+        metrics::observeStage(metrics::TOTAL, now - request.headArrival);
+    }
+}
+
+
+/*
+ * matches descriptors a client extracted itself, so that callers already
+ * running SIFT don't have to upload an image for us to decode and extract
+ * them again.  the body is a descriptor_payload, and its SIFT parameters
+ * have to match ours
+ */
+void handleMatchDescriptors(Server *server, const HttpRequest &request,
+        Responder &out) {
+    recordReceive(request);
+    LoadSnapshot load = server->getFlightRecorder() ? server->loadSnapshot()
+        : LoadSnapshot();
+
+    SearchContext context;
+    context.deadline = requestedDeadline(request,
+        server->getDefaultDeadline());
+
+    descriptor_payload::Payload payload;
+    std::string problem;
+    if (!descriptor_payload::parse(request.body.data(), request.body.size(),
+            payload, problem)
+            || !descriptor_payload::compatible(payload.params,
+                server->getCoarseParams(), server->getRefineParams(),
+                problem)) {
+        server->error(out, 400, "Bad Request", problem);
+        return;
+    }
+
+    MatchInfo info;
+    double retryAfter = 0;
+    bool ran = server->schedule([&]() {
+        info = server->matchPrecomputed(payload.descriptors, context);
+    }, retryAfter);
+
+    if (!ran) {
+        server->errorUnavailable(out, retryAfter);
+        return;
+    }
+
+    double responseStart = logging::timestamp();
+    server->OKJSON(out, info.json(requestedThumbnailMode(request)));
+    recordResponse(request, responseStart);
+    recordIfSlow(server, request, "descriptors", request.body.data(),
+        request.body.size(), context, info, load);
+}
+
+
+/*
+ * hands a request to the flight recorder if it was slow.  nothing is
+ * copied unless it was
+ */
+void recordIfSlow(Server *server, const HttpRequest &request,
+        const char *kind, const unsigned char *upload, size_t size,
+        const SearchContext &context, const MatchInfo &info,
+        const LoadSnapshot &load) {
+    FlightRecorder *recorder = server->getFlightRecorder();
+    if (!recorder || request.headArrival <= 0) {
+        return;
+    }
+
+    double latency = logging::timestamp() - request.headArrival;
+    double threshold = 0;
+    if (!recorder->isSlow(latency, threshold)) {
+        return;
+    }
+
+    FlightRecord record;
+    record.kind = kind;
+    record.upload.assign(upload, upload + size);
+    record.arrival = request.headArrival;
+    record.latency = latency;
+    record.threshold = threshold;
+    record.budget = context.deadline > 0
+        ? context.deadline - request.arrival : 0;
+    record.receiveTime = request.arrival - request.headArrival;
+    record.context = context;
+    record.context.order.reset();
+    record.load = load;
+    std::stringstream thread;
+    thread << std::this_thread::get_id();
+    record.thread = thread.str();
+    record.matchId = info.match.id;
+    record.confidence = info.match.confidence;
+    record.cached = info.cached;
+    recorder->keep(std::move(record));
+}
+
+
+/*
+ * runs job through the scheduler, waiting for room instead of giving up the
+ * first time it's turned away.  a bulk upload would rather be slow than
+ * lose images part way through
+ */
+bool scheduleWaiting(Server *server, const std::function<void()> &job) {
+    double waited = 0;
+    double retryAfter = 0;
+    while (!server->schedule(job, retryAfter)) {
+        if (waited >= BATCH_MAX_WAIT) {
+            return false;
+        }
+        double pause = std::min(std::max(retryAfter, 0.1),
+            BATCH_MAX_WAIT - waited);
+        std::this_thread::sleep_for(std::chrono::duration<double>(pause));
+        waited += pause;
+    }
+    return true;
+}
+
+/*
+ * matches every image in a multipart or tar upload, streaming a line of
+ * JSON per image as soon as it's matched, and a summary line at the end.
+ * images are decoded and searched in groups, so that a group shares one
+ * pass over the designs.  anything wrong with one image is reported on its
+ * line and doesn't stop the rest.  results may come out of order, so each
+ * line carries the image's index.  there's no deadline unless the client
+ * asks for one, and then it applies to each group rather than to the whole
+ * upload
+ */
+void handleMatchBatch(Server *server, const HttpRequest &request,
+        Responder &out) {
+    double start = logging::timestamp();
+    recordReceive(request);
+
+    /*
+     * however many batches were let in to upload, only so many are matched
+     * at once, so that they can't take every handler thread
+     */
+    struct BatchPlace {
+        explicit BatchPlace(Server *server): server(server),
+            taken(server->beginBatch()) {}
+        ~BatchPlace() {
+            if (taken) {
+                server->endBatch();
+            }
+        }
+
+        Server *server;
+        bool taken;
+    } place(server);
+
+    if (!place.taken) {
+        server->errorUnavailable(out, BATCH_RETRY_AFTER);
+        return;
+    }
+
+    if (request.version.compare("1.0") == 0) {
+        server->error(out, 400, "Bad Request",
+            "batch results are streamed, which needs HTTP/1.1");
+        return;
+    }
+
+    const std::vector<unsigned char> &body = request.body;
+    const char *typeHeader = request.header("Content-Type");
+    std::string contentType(typeHeader ? typeHeader : "");
+    std::vector<BatchImage> images;
+
+    if (contentType.compare(0, 19, "multipart/form-data") == 0) {
+        auto parts = parseMultipart(contentType, body.data(), body.size());
+        for (auto &part: parts) {
+            std::string name;
+            size_t filenamePos = part.headers.find("filename=\"");
+            if (filenamePos != std::string::npos) {
+                filenamePos += 10;
+                name = part.headers.substr(filenamePos,
+                    part.headers.find('"', filenamePos) - filenamePos);
+            }
+            images.push_back(BatchImage{name, part.data, part.size});
+        }
+    }
+    else if (contentType.compare(0, 17, "application/x-tar") == 0
+            || contentType.compare(0, 15, "application/tar") == 0) {
+        if (!parseTar(body.data(), body.size(), images)) {
+            server->error(out, 400, "Bad Request", "malformed tar archive");
+            return;
+        }
+    }
+    else {
+        server->error(out, 415, "Unsupported Media Type",
+            "send a multipart/form-data or application/x-tar body");
+        return;
+    }
+
+    if (images.empty()) {
+        server->error(out, 400, "Bad Request", "no images");
+        return;
+    }
+
+    std::string mode;
+    ThumbnailMode thumbnailMode = queryParameter(request.queryString,
+        "thumbnail", mode) ? requestedThumbnailMode(request)
+        : ThumbnailMode::NONE;
+    double budget = requestedBudget(request, 0);
+    const DecodeLimits &limits = server->getDecodeLimits();
+    ResultCache *cache = server->getResultCache();
+
+    out.write(server->createChunkedHeaders(200, "OK",
+        "application/x-ndjson"));
+    ChunkedWriter results(out);
+
+    int matched = 0;
+    int failed = 0;
+
+    auto sendMatch = [&](size_t index, MatchInfo &info) {
+        results.write("{\"index\": " + std::to_string(index)
+            + ", \"name\": " + jsonString(images[index].name)
+            + ", \"match\": " + info.json(thumbnailMode) + "}\n");
+        matched++;
+    };
+    auto sendError = [&](size_t index, const std::string &msg) {
+        results.write("{\"index\": " + std::to_string(index)
+            + ", \"name\": " + jsonString(images[index].name)
+            + ", \"error\": " + jsonString(msg) + "}\n");
+        failed++;
+    };
+
+    std::vector<uint64_t> contentHashes(images.size());
+    size_t groupSize = server->getBatchGroupSize();
+    for (size_t begin=0; begin < images.size(); begin += groupSize) {
+        size_t end = std::min(begin + groupSize, images.size());
+
+        /*
+         * anything too big, or that we've matched before, is dealt with
+         * without taking up a place in the scheduler
+         */
+        std::vector<size_t> pending;
+        for (size_t i=begin; i < end; i++) {
+            const BatchImage &image = images[i];
+
+            int width, height;
+            if (imageDimensions(image.data, image.size, width, height)
+                    && (long long)width * height > limits.maxPixels) {
+                sendError(i, "image has too many pixels");
+                continue;
+            }
+
+            if (cache) {
+                MatchInfo info;
+                contentHashes[i] = hashing::fnv1a(image.data, image.size);
+                if (cache->find(contentHashes[i], info)) {
+                    info.cached = true;
+                    sendMatch(i, info);
+                    continue;
+                }
+            }
+            pending.push_back(i);
+        }
+
+        if (pending.empty()) {
+            continue;
+        }
+
+        bool ran = scheduleWaiting(server, [&]() {
+            std::vector<Mat> decoded;
+            std::vector<size_t> indices;
+            std::vector<uint64_t> imageHashes;
+
+            for (size_t i: pending) {
+                double decodeStart = logging::timestamp();
+                Mat image = decodeGrayscale(images[i].data, images[i].size,
+                    limits.targetLongEdge);
+                double decodeEnd = logging::timestamp();
+                metrics::observeStage(metrics::DECODE, decodeEnd - decodeStart);
+                tracing::record("decode", tracing::current(), decodeStart,
+                    decodeEnd, images[i].size);
+                if (image.empty()) {
+                    sendError(i, "couldn't decode image");
+                    continue;
+                }
+
+                uint64_t imageHash = 0;
+                if (cache) {
+                    MatchInfo info;
+                    imageHash = perceptualHash(image);
+                    if (cache->findSimilar(imageHash, info)) {
+                        info.cached = true;
+                        sendMatch(i, info);
+                        continue;
+                    }
+                }
+                decoded.push_back(image);
+                indices.push_back(i);
+                imageHashes.push_back(imageHash);
+            }
+
+            if (decoded.empty()) {
+                return;
+            }
+
+            std::vector<SearchContext> contexts(decoded.size());
+            if (budget > 0) {
+                double deadline = logging::timestamp() + budget;
+                for (auto &context: contexts) {
+                    context.deadline = deadline;
+                }
+            }
+
+            server->matchBatch(decoded, contexts,
+                    [&](size_t k, MatchInfo &info) {
+                if (cache && !info.partial) {
+                    cache->insert(contentHashes[indices[k]], imageHashes[k],
+                        info);
+                }
+                sendMatch(indices[k], info);
+            });
+        });
+
+        if (!ran) {
+            for (size_t i: pending) {
+                sendError(i, "server too busy");
+            }
+        }
+    }
+
+    std::stringstream summary;
+    summary << "{\"done\": true, \"images\": " << images.size()
+        << ", \"matched\": " << matched << ", \"failed\": " << failed
+        << ", \"elapsed\": " << logging::timestamp() - start << "}\n";
+    results.write(summary.str());
+    results.finish();
+
+    dlog("matched a batch of " << images.size() << " images in "
+        << logging::timestamp() - start << "s", logging::MEDIUM);
+}
+
+
+/*
+ * waits on an identical upload that's already being matched, and takes its
+ * outcome, stage times and all, as ours.  we hold a handler thread while we
+ * wait, but no place in the scheduler, so only so many may wait at once, and
+ * none past their own deadline
+ */
+MatchOutcome awaitCoalesced(Server *server,
+        const std::shared_future<MatchOutcome> &pending,
+        SearchContext &context) {
+    MatchOutcome outcome;
+    outcome.status = MatchOutcome::UNAVAILABLE;
+    outcome.retryAfter = 1;
+
+    if (!server->beginCoalescedWait()) {
+        dlog("too many uploads waiting on identical ones, turning one away",
+            logging::MEDIUM);
+        return outcome;
+    }
+
+    dlog("waiting on an identical upload already being matched",
+        logging::MEDIUM);
+    double wait = context.deadline > 0
+        ? context.deadline - logging::timestamp() : COALESCED_MAX_WAIT;
+    bool ready = wait > 0 && pending.wait_for(
+        std::chrono::duration<double>(wait)) == std::future_status::ready;
+    server->endCoalescedWait();
+
+    if (!ready) {
+        dlog("gave up waiting on an identical upload", logging::MEDIUM);
+        return outcome;
+    }
+
+    outcome = pending.get();
+    double deadline = context.deadline;
+    context = outcome.context;
+    context.deadline = deadline;
+    return outcome;
+}
+
+
+/*
+ * matches an upload, going through the server's result cache if it has one.
+ * an upload we've seen before gets its old result back without being
+ * decoded.  if the same upload is already being matched, we wait for that
+ * instead of starting another.  otherwise we decode it, try again by its
+ * perceptual hash, and only then match it.  partial results depend on how
+ * much time the search had, so they aren't kept
+ */
+MatchOutcome matchUpload(Server *server, const unsigned char *image,
+        size_t imageSize, SearchContext &context) {
+    const DecodeLimits &limits = server->getDecodeLimits();
+    ResultCache *cache = server->getResultCache();
+    MatchOutcome outcome;
+
+    uint64_t contentHash = 0;
+    if (cache) {
+        contentHash = hashing::fnv1a(image, imageSize);
+        if (cache->find(contentHash, outcome.info)) {
+            outcome.info.cached = true;
+            return outcome;
+        }
+
+        std::shared_future<MatchOutcome> pending;
+        if (!cache->claim(contentHash, pending)) {
+            return awaitCoalesced(server, pending, context);
+        }
+    }
+
+    uint64_t imageHash = 0;
+    try {
+        bool ran = server->schedule([&]() {
+            double decodeStart = logging::timestamp();
+            Mat decodedImage = decodeGrayscale(image, imageSize,
+                limits.targetLongEdge);
+            double decoded = logging::timestamp();
+            context.decodeTime = decoded - decodeStart;
+            metrics::observeStage(metrics::DECODE, context.decodeTime);
+            tracing::record("decode", tracing::current(), decodeStart,
+                decoded, imageSize);
+            if (decodedImage.empty()) {
+                outcome.status = MatchOutcome::UNDECODABLE;
+                return;
+            }
+
+            if (cache) {
+                imageHash = perceptualHash(decodedImage);
+                if (cache->findSimilar(imageHash, outcome.info)) {
+                    outcome.info.cached = true;
+                    return;
+                }
+            }
+            outcome.info = server->match(decodedImage, context);
+        }, outcome.retryAfter);
+
+        if (!ran) {
+            outcome.status = MatchOutcome::UNAVAILABLE;
+        }
+    }
+    catch (...) {
+        if (cache) {
+            outcome.status = MatchOutcome::UNAVAILABLE;
+            outcome.retryAfter = 1;
+            outcome.context = context;
+            cache->fulfil(contentHash, outcome);
+        }
+        throw;
+    }
+
+    if (cache) {
+        if (outcome.status == MatchOutcome::MATCHED && !outcome.info.cached
+                && !outcome.info.partial) {
+            cache->insert(contentHash, imageHash, outcome.info);
+        }
+        outcome.context = context;
+        cache->fulfil(contentHash, outcome);
+    }
+    return outcome;
+}
+
+/*
+ * routes a fully received request to whatever handles it
+ */
+void handleRequest(Server *server, const HttpRequest &request,
+        Responder &out) {
+    const std::string &path = request.uri;
+    const std::string &method = request.method;
+
+    /*
+     * everything done for this request, on this thread or any it hands
+     * work to, is traced under a new id
+     */
+    tracing::Scope scope(tracing::newTrace());
+    tracing::Span span("request", request.body.size());
+
+    dlog("got request to " << path, logging::HIGH);
+
+
+    /*
+     * more elaborate method handling will require a better dispatcher, but
+     * for the few methods we're handling now, this is fine
+     */
+
+    /*
+     * our main image matching endpoint
+     */
+    if (path.compare("/match") == 0) {
+        if (method.compare("POST") == 0) {
+            handleMatch(server, request, out);
+        }
+        else {
+            server->errorNotAllowed(out);
+        }
+    }
+    /*
+     * descriptors clients extracted themselves
+     */
+    else if (path.compare("/match/descriptors") == 0) {
+        if (method.compare("POST") == 0) {
+            handleMatchDescriptors(server, request, out);
+        }
+        else {
+            server->errorNotAllowed(out);
+        }
+    }
+    /*
+     * many images in one upload, for bulk identification
+     */
+    else if (path.compare("/match/batch") == 0) {
+        if (method.compare("POST") == 0) {
+            handleMatchBatch(server, request, out);
+        }
+        else {
+            server->errorNotAllowed(out);
+        }
+    }
+    /*
+     * streaming match sessions, which the front ends take over before we get
+     * here if the request is a WebSocket upgrade
+     */
+    else if (path.compare("/session") == 0) {
+        server->error(out, 426, "Upgrade Required",
+            "/session is a WebSocket endpoint");
+    }
+    /*
+     * design thumbnails, for clients that asked for URLs instead of inlined
+     * thumbnails in their match responses
+     */
+    else if (path.compare(0, 11, "/thumbnail/") == 0) {
+        if (method.compare("GET") == 0) {
+            char *end = nullptr;
+            long id = strtol(path.c_str() + 11, &end, 10);
+            if (end != path.c_str() + 11 && *end == '\0') {
+                server->sendThumbnail(request, out, id);
+            }
+            else {
+                server->errorNotFound(out);
+            }
+        }
+        else {
+            server->errorNotAllowed(out);
+        }
+    }
+    /*
+     * counters for keeping an eye on the scheduler and result cache
+     */
+    else if (path.compare("/stats") == 0) {
+        if (method.compare("GET") == 0) {
+            server->OKJSON(out, server->statsJson());
+        }
+        else {
+            server->errorNotAllowed(out);
+        }
+    }
+    /*
+     * the same, and per-stage latency histograms, for Prometheus
+     */
+    else if (path.compare("/metrics") == 0) {
+        if (method.compare("GET") == 0) {
+            server->OK(out, server->metricsText(),
+                "text/plain; version=0.0.4");
+        }
+        else {
+            server->errorNotAllowed(out);
+        }
+    }
+    /*
+     * recent spans as Chrome trace-event JSON, all of them or just those of
+     * ?trace=<id>
+     */
+    else if (path.compare("/debug/trace") == 0) {
+        if (method.compare("GET") == 0) {
+            if (!tracing::enabled()) {
+                server->error(out, 404, "Not Found",
+                    "tracing is off; start with --trace");
+            }
+            else {
+                std::string trace;
+                queryParameter(request.queryString, "trace", trace);
+                std::stringstream buf;
+                tracing::exportJson(buf, strtoull(trace.c_str(), nullptr,
+                    10));
+                server->OKJSON(out, buf.str());
+            }
+        }
+        else {
+            server->errorNotAllowed(out);
+        }
+    }
+    /*
+     * the flight recorder's slow requests, and dumping them to disk for
+     * --replay
+     */
+    else if (path.compare("/debug/flights") == 0
+            || path.compare("/debug/flights/dump") == 0) {
+        FlightRecorder *recorder = server->getFlightRecorder();
+        bool dump = path.compare("/debug/flights/dump") == 0;
+        if (method.compare(dump ? "POST" : "GET") != 0) {
+            server->errorNotAllowed(out);
+        }
+        else if (!recorder) {
+            server->error(out, 404, "Not Found",
+                "the flight recorder is off; start with --slow-percentile");
+        }
+        else if (!dump) {
+            server->OKJSON(out, recorder->listJson());
+        }
+        else {
+            std::string problem;
+            size_t dumped = recorder->dump(problem);
+            if (!problem.empty()) {
+                server->error(out, 500, "Internal Server Error", problem);
+            }
+            else {
+                server->OKJSON(out, "{\"dumped\": "
+                    + std::to_string(dumped) + ", \"dir\": "
+                    + jsonString(recorder->getDumpDir().string()) + "}");
+            }
+        }
+    }
+    /*
+     * for AWS ELB health checks
+     */
+    else if (path.compare("/health") == 0) {
+        if (method.compare("GET") == 0) {
+            if (server->isHealthy()) {
+                server->OK(out);
+            }
+            else {
+                server->errorNotFound(out);
+            }
+        }
+        else {
+            server->errorNotAllowed(out);
+        }
+    }
+    else {
+        server->errorNotFound(out);
+    }
+}
+
+
+/*
+ * writes straight to a mongoose connection, from the connection's own
+ * thread
+ */
+class MongooseResponder: public Responder {
+public:
+    MongooseResponder(mg_connection *conn): conn(conn) {
+    }
+
+    void write(const void *data, size_t size) {
+        int n = mg_write(conn, data, size);
+        if (n > 0) {
+            metrics::addBytesOut(n);
+        }
+    }
+
+private:
+    mg_connection *conn;
+};
+
+
+/*
+ * the --frontend mongoose way in: mongoose has already read the headers,
+ * on one of its threads, and we read the body on the same thread before
+ * handling the request
+ */
+HttpRequest mongooseRequest(const mg_request_info *info) {
+    HttpRequest request;
+    request.method = info->request_method;
+    request.uri = info->uri;
+    request.version = info->http_version ? info->http_version : "1.0";
+    if (info->query_string) {
+        request.queryString = info->query_string;
+    }
+    for (int i=0; i<info->num_headers; i++) {
+        request.headers.emplace_back(info->http_headers[i].name,
+            info->http_headers[i].value);
+    }
+    return request;
+}
+
+int handleMongooseRequest(mg_connection *conn) {
+    const mg_request_info *info = mg_get_request_info(conn);
+    auto server = reinterpret_cast<Server *>(info->user_data);
+    MongooseResponder out(conn);
+
+    HttpRequest request = mongooseRequest(info);
+    request.headArrival = logging::timestamp();
+
+#ifdef USE_WEBSOCKET
+    /*
+     * zero lets mongoose do the WebSocket handshake, after which it calls
+     * our websocket callbacks
+     */
+    if (isSessionRequest(request)) {
+        return 0;
+    }
+#endif
+
+    size_t length = 0;
+    if (admitRequest(server, request, out, length)) {
+        request.body.resize(length);
+        size_t received = 0;
+        while (received < length) {
+            int n = mg_read(conn, request.body.data() + received,
+                length - received);
+            if (n <= 0) {
+                break;
+            }
+            received += n;
+        }
+
+        if (received < length) {
+            server->error(out, 400, "Bad Request", "incomplete upload");
+        }
+        else {
+            request.arrival = logging::timestamp();
+            handleRequest(server, request, out);
+        }
+    }
+
+    /*
+     * non-zero tells mongoose that our function has replied to the client
+     */
+    return 1;
+}
+
+
+#ifdef USE_WEBSOCKET
+
+/*
+ * with --frontend mongoose, a session lives on its connection's thread,
+ * which matches each frame as it arrives
+ */
+void startMongooseSession(mg_connection *conn) {
+    mg_request_info *info = mg_get_request_info(conn);
+    auto server = reinterpret_cast<Server *>(info->user_data);
+    HttpRequest request = mongooseRequest(info);
+
+    ThumbnailMode thumbnailMode = ThumbnailMode::URL;
+    std::string mode;
+    if (queryParameter(request.queryString, "thumbnail", mode)) {
+        thumbnailMode = requestedThumbnailMode(request);
+    }
+    info->conn_data = new MatchSession(server, thumbnailMode);
+}
+
+int handleMongooseFrame(mg_connection *conn, int bits, char *data,
+        size_t size) {
+    mg_request_info *info = mg_get_request_info(conn);
+    auto session = reinterpret_cast<MatchSession *>(info->conn_data);
+    int opcode = bits & 0x0f;
+
+    if (opcode == websocket::CLOSE) {
+        return 0;
+    }
+    if (opcode == websocket::PING) {
+        mg_websocket_write(conn, WEBSOCKET_OPCODE_PONG, data, size);
+    }
+    else if (session && (opcode == websocket::TEXT
+            || opcode == websocket::BINARY)) {
+        std::string json = session->processFrame(
+            reinterpret_cast<const unsigned char *>(data), size);
+        mg_websocket_write(conn, WEBSOCKET_OPCODE_TEXT, json.data(),
+            json.size());
+    }
+    return 1;
+}
+
+void endMongooseRequest(const mg_connection *conn, int) {
+    mg_request_info *info = mg_get_request_info(
+        const_cast<mg_connection *>(conn));
+    delete reinterpret_cast<MatchSession *>(info->conn_data);
+    info->conn_data = nullptr;
+}
+
+#endif
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <strings.h>
+
+#include <glib-2.0/glib.h>
+
+#include "websocket.h"
+
+
+namespace websocket {
+
+    /*
+     * the GUID every server appends to the client's key before hashing it,
+     * from the RFC
+     */
+    const char *KEY_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+
+    bool isUpgrade(const HttpRequest &request) {
+        const char *upgrade = request.header("Upgrade");
+        const char *connection = request.header("Connection");
+        return request.method == "GET" && upgrade && connection
+            && request.header("Sec-WebSocket-Key")
+            && strcasecmp(upgrade, "websocket") == 0
+            && strcasestr(connection, "upgrade") != nullptr;
+    }
+
+    /*
+     * the 101 response that completes the handshake: the client's key, with
+     * our GUID, SHA-1 hashed and base64 encoded back to it
+     */
+    std::string handshake(const std::string &key) {
+        std::string keyed = key + KEY_GUID;
+
+        guint8 digest[20];
+        gsize digestLength = sizeof(digest);
+        GChecksum *sha1 = g_checksum_new(G_CHECKSUM_SHA1);
+        g_checksum_update(sha1, reinterpret_cast<const guchar *>(keyed.data()),
+            keyed.size());
+        g_checksum_get_digest(sha1, digest, &digestLength);
+        g_checksum_free(sha1);
+
+        gchar *accept = g_base64_encode(digest, digestLength);
+        std::string response = "HTTP/1.1 101 Switching Protocols\r\n"
+            "Upgrade: websocket\r\n"
+            "Connection: Upgrade\r\n"
+            "Sec-WebSocket-Accept: " + std::string(accept) + "\r\n\r\n";
+        g_free(accept);
+        return response;
+    }
+
+    /*
+     * a single, final, unmasked frame, as servers send them
+     */
+    std::string encode(int opcode, const void *data, size_t size) {
+        std::string frame;
+        frame += char(0x80 | opcode);
+
+        if (size < 126) {
+            frame += char(size);
+        }
+        else if (size <= 0xffff) {
+            frame += char(126);
+            frame += char(size >> 8);
+            frame += char(size & 0xff);
+        }
+        else {
+            frame += char(127);
+            for (int shift=56; shift>=0; shift-=8) {
+                frame += char((uint64_t(size) >> shift) & 0xff);
+            }
+        }
+
+        frame.append(static_cast<const char *>(data), size);
+        return frame;
+    }
+
+    /*
+     * reads a frame from the start of data, unmasking its payload.  clients
+     * must mask everything they send, so an unmasked frame is MALFORMED, as
+     * is one with a payload over maxPayload
+     */
+    ParseResult decode(const char *data, size_t size, size_t maxPayload,
+            Frame &frame, size_t &frameLength) {
+        const unsigned char *bytes = reinterpret_cast<const unsigned char *>(
+            data);
+        if (size < 2) {
+            return ParseResult::INCOMPLETE;
+        }
+
+        bool masked = bytes[1] & 0x80;
+        if (!masked) {
+            return ParseResult::MALFORMED;
+        }
+
+        uint64_t payloadLength = bytes[1] & 0x7f;
+        size_t headerLength = 2;
+        if (payloadLength == 126) {
+            if (size < 4) {
+                return ParseResult::INCOMPLETE;
+            }
+            payloadLength = (bytes[2] << 8) | bytes[3];
+            headerLength = 4;
+        }
+        else if (payloadLength == 127) {
+            if (size < 10) {
+                return ParseResult::INCOMPLETE;
+            }
+            payloadLength = 0;
+            for (int i=2; i<10; i++) {
+                payloadLength = (payloadLength << 8) | bytes[i];
+            }
+            headerLength = 10;
+        }
+
+        if (payloadLength > maxPayload) {
+            return ParseResult::MALFORMED;
+        }
+
+        const unsigned char *mask = bytes + headerLength;
+        headerLength += 4;
+        if (size < headerLength + payloadLength) {
+            return ParseResult::INCOMPLETE;
+        }
+
+        frame.fin = bytes[0] & 0x80;
+        frame.opcode = bytes[0] & 0x0f;
+        frame.payload.assign(data + headerLength, payloadLength);
+        for (size_t i=0; i<payloadLength; i++) {
+            frame.payload[i] ^= mask[i % 4];
+        }
+
+        frameLength = headerLength + payloadLength;
+        return ParseResult::COMPLETE;
+    }
+}
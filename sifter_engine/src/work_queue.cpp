@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2013 Andrew Moffat
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <ctime>
+#include <fstream>
+
+#include <unistd.h>
+
+#include "work_queue.h"
+#include "logging.h"
+
+
+namespace fs = boost::filesystem;
+
+
+const char *QUEUE_DIRS[] = {"pending", "claimed", "results", "done"};
+
+
+std::vector<std::string> readLines(const fs::path &fileName) {
+    std::vector<std::string> lines;
+    std::ifstream handle(fileName.string());
+    std::string line;
+    while (std::getline(handle, line)) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+std::vector<std::string> listDir(const fs::path &dir) {
+    std::vector<std::string> names;
+    boost::system::error_code ec;
+    for (auto it = fs::directory_iterator(dir, ec); !ec
+            && it != fs::directory_iterator(); it.increment(ec)) {
+        names.push_back((*it).path().filename().string());
+    }
+    return names;
+}
+
+
+WorkQueue::WorkQueue(const path &spoolDir, double leaseSeconds):
+        spoolDir(spoolDir), leaseSeconds(leaseSeconds) {
+    char host[256] = {0};
+    gethostname(host, sizeof(host) - 1);
+    ownerName = std::string(host) + "." + std::to_string(getpid());
+}
+
+const std::string &WorkQueue::owner() const {
+    return ownerName;
+}
+
+WorkQueue::path WorkQueue::claimedFile(const std::string &unit) const {
+    return spoolDir/"claimed"/(unit + "@" + ownerName);
+}
+
+/*
+ * lines are written somewhere no one is looking and then renamed into place,
+ * so readers never see a partial file
+ */
+void writeLines(const fs::path &spoolDir, const fs::path &fileName,
+        const std::string &owner, const std::vector<std::string> &lines) {
+    fs::path tmpFile = spoolDir/("." + fileName.filename().string() + "."
+        + owner + ".tmp");
+    {
+        std::ofstream handle(tmpFile.string());
+        for (auto &line: lines) {
+            handle << line << "\n";
+        }
+    }
+    fs::rename(tmpFile, fileName);
+}
+
+
+/*
+ * starts an empty queue.  only our own subdirectories are cleared out, in case
+ * someone points the spool at a directory with other things in it
+ */
+void WorkQueue::create(const std::vector<std::string> &header) {
+    destroy();
+    for (auto dir: QUEUE_DIRS) {
+        fs::create_directories(spoolDir/dir);
+    }
+    writeLines(spoolDir, spoolDir/"job", ownerName, header);
+}
+
+bool WorkQueue::exists() const {
+    return fs::exists(spoolDir/"job");
+}
+
+std::vector<std::string> WorkQueue::header() const {
+    return readLines(spoolDir/"job");
+}
+
+void WorkQueue::destroy() {
+    boost::system::error_code ec;
+    fs::remove(spoolDir/"job", ec);
+    for (auto dir: QUEUE_DIRS) {
+        fs::remove_all(spoolDir/dir, ec);
+    }
+}
+
+
+void WorkQueue::add(const std::string &unit,
+        const std::vector<std::string> &lines) {
+    writeLines(spoolDir, spoolDir/"pending"/unit, ownerName, lines);
+}
+
+/*
+ * the pending file's mtime is refreshed before we rename it, because rename
+ * keeps the old mtime and we don't want anyone reaping our claim as expired
+ * before we've had a chance to heartbeat it
+ */
+bool WorkQueue::claim(std::string &unit, std::vector<std::string> &lines) {
+    for (auto &name: listDir(spoolDir/"pending")) {
+        boost::system::error_code ec;
+        fs::path pendingFile = spoolDir/"pending"/name;
+
+        fs::last_write_time(pendingFile, std::time(nullptr), ec);
+        if (ec) {
+            continue;
+        }
+        fs::rename(pendingFile, claimedFile(name), ec);
+        if (ec) {
+            continue;
+        }
+
+        unit = name;
+        heartbeat(unit);
+        lines = readLines(claimedFile(unit));
+        dlog(ownerName << " claimed " << unit, logging::LOW);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * returns false if our lease is gone, because someone reaped it
+ */
+bool WorkQueue::heartbeat(const std::string &unit) {
+    boost::system::error_code ec;
+    fs::last_write_time(claimedFile(unit), std::time(nullptr), ec);
+    return !ec;
+}
+
+bool WorkQueue::complete(const std::string &unit,
+        const std::vector<std::string> &results) {
+    writeLines(spoolDir, spoolDir/"results"/unit, ownerName, results);
+
+    boost::system::error_code ec;
+    fs::rename(claimedFile(unit), spoolDir/"done"/unit, ec);
+    if (ec) {
+        dlog(ownerName << " lost its lease on " << unit, logging::HIGH);
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::string> WorkQueue::results(const std::string &unit) const {
+    return readLines(spoolDir/"results"/unit);
+}
+
+/*
+ * any process may do this, so a crashed worker's units get retried even if
+ * the coordinator itself has gone away
+ */
+int WorkQueue::reapExpired() {
+    int reaped = 0;
+    std::time_t now = std::time(nullptr);
+
+    for (auto &name: listDir(spoolDir/"claimed")) {
+        boost::system::error_code ec;
+        fs::path claimed = spoolDir/"claimed"/name;
+
+        std::time_t heartbeat = fs::last_write_time(claimed, ec);
+        if (ec || now - heartbeat < leaseSeconds) {
+            continue;
+        }
+
+        std::string unit = name.substr(0, name.find('@'));
+        fs::rename(claimed, spoolDir/"pending"/unit, ec);
+        if (!ec) {
+            dlog("lease on " << unit << " held by "
+                << name.substr(unit.size() + 1) << " expired, requeued",
+                logging::HIGH);
+            reaped++;
+        }
+    }
+    return reaped;
+}
+
+
+int WorkQueue::numPending() const {
+    return listDir(spoolDir/"pending").size();
+}
+
+int WorkQueue::numClaimed() const {
+    return listDir(spoolDir/"claimed").size();
+}
+
+std::vector<std::string> WorkQueue::doneUnits() const {
+    return listDir(spoolDir/"done");
+}